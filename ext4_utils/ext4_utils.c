@@ -83,6 +83,7 @@ int ext4_bg_has_super_block(int bg)
 /* Write the filesystem image to a file */
 void write_ext4_image(int fd, int gz, int sparse, int crc)
 {
+	sparse_file_set_threads(info.sparse_file, info.threads);
 	sparse_file_write(info.sparse_file, fd, gz, sparse, crc);
 }
 
@@ -119,6 +119,7 @@ struct fs_info {
 	u32 bg_desc_reserve_blocks;
 	const char *label;
 	u8 no_journal;
+	u32 threads;	/* threads compressing gzip output, 0 for one */
 
 	struct sparse_file *sparse_file;
 };
@@ -43,23 +43,156 @@ struct backed_block {
 			uint32_t val;
 		} fill;
 	};
-	struct backed_block *next;
+	/* skip list links, next[0] is the sorted list the iterators walk */
+	unsigned int height;
+	struct backed_block *next[];
 };
 
+/*
+ * The blocks are kept in a skip list ordered by block number, so queueing
+ * blocks in any order costs O(log n) instead of a walk of the whole list.
+ * Each level links a random subset of the level below, a block is on level
+ * n with probability 1/4^n.
+ */
+#define BB_MAX_HEIGHT 16
+
 struct backed_block_list {
-	struct backed_block *data_blocks;
-	struct backed_block *last_used;
+	struct backed_block *head[BB_MAX_HEIGHT];
+	unsigned int height;
+	uint32_t seed;
 	unsigned int block_size;
 };
 
+static unsigned int random_height(struct backed_block_list *bbl)
+{
+	unsigned int height = 1;
+	uint32_t r;
+
+	/* xorshift32, good enough for balancing and independent of rand() */
+	r = bbl->seed;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	bbl->seed = r;
+
+	while (height < BB_MAX_HEIGHT && (r & 3) == 0) {
+		height++;
+		r >>= 2;
+	}
+
+	return height;
+}
+
+static struct backed_block *backed_block_new(struct backed_block_list *bbl)
+{
+	unsigned int height = random_height(bbl);
+	struct backed_block *bb;
+
+	bb = calloc(1, sizeof(struct backed_block) +
+			height * sizeof(struct backed_block *));
+	if (bb == NULL) {
+		return NULL;
+	}
+
+	bb->height = height;
+
+	return bb;
+}
+
+static inline struct backed_block **next_ptr(struct backed_block_list *bbl,
+		struct backed_block *bb, unsigned int level)
+{
+	return bb ? &bb->next[level] : &bbl->head[level];
+}
+
+/*
+ * Find, on every level, the last block before block.  NULL stands for the
+ * list head.
+ */
+static void find_prev(struct backed_block_list *bbl, unsigned int block,
+		struct backed_block **prev)
+{
+	struct backed_block *bb = NULL;
+	struct backed_block *next;
+	int level;
+
+	for (level = BB_MAX_HEIGHT - 1; level >= 0; level--) {
+		if ((unsigned int)level >= bbl->height) {
+			prev[level] = NULL;
+			continue;
+		}
+		while ((next = *next_ptr(bbl, bb, level)) && next->block < block) {
+			bb = next;
+		}
+		prev[level] = bb;
+	}
+}
+
+static void link_bb(struct backed_block_list *bbl, struct backed_block *bb,
+		struct backed_block **prev)
+{
+	unsigned int level;
+
+	for (level = 0; level < bb->height; level++) {
+		bb->next[level] = *next_ptr(bbl, prev[level], level);
+		*next_ptr(bbl, prev[level], level) = bb;
+	}
+
+	if (bb->height > bbl->height) {
+		bbl->height = bb->height;
+	}
+}
+
+static void unlink_bb(struct backed_block_list *bbl, struct backed_block *bb)
+{
+	struct backed_block *prev[BB_MAX_HEIGHT];
+	unsigned int level;
+
+	find_prev(bbl, bb->block, prev);
+	for (level = 0; level < bb->height; level++) {
+		if (*next_ptr(bbl, prev[level], level) == bb) {
+			*next_ptr(bbl, prev[level], level) = bb->next[level];
+		}
+		bb->next[level] = NULL;
+	}
+
+	while (bbl->height > 0 && !bbl->head[bbl->height - 1]) {
+		bbl->height--;
+	}
+}
+
+static void insert_bb(struct backed_block_list *bbl, struct backed_block *bb)
+{
+	struct backed_block *prev[BB_MAX_HEIGHT];
+
+	find_prev(bbl, bb->block, prev);
+	link_bb(bbl, bb, prev);
+}
+
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl)
 {
-	return bbl->data_blocks;
+	return bbl->head[0];
 }
 
 struct backed_block *backed_block_iter_next(struct backed_block *bb)
 {
-	return bb->next;
+	return bb->next[0];
+}
+
+/* Start iterating at the block that may contain block */
+struct backed_block *backed_block_iter_find(struct backed_block_list *bbl,
+		unsigned int block)
+{
+	struct backed_block *prev[BB_MAX_HEIGHT];
+	struct backed_block *next;
+
+	find_prev(bbl, block, prev);
+	next = *next_ptr(bbl, prev[0], 0);
+	if (next && next->block == block) {
+		return next;
+	}
+
+	return prev[0] ? prev[0] : bbl->head[0];
 }
 
 unsigned int backed_block_len(struct backed_block *bb)
@@ -123,19 +256,22 @@ void backed_block_destroy(struct backed_block *bb)
 struct backed_block_list *backed_block_list_new(unsigned int block_size)
 {
 	struct backed_block_list *b = calloc(sizeof(struct backed_block_list), 1);
+	if (b == NULL) {
+		return NULL;
+	}
 	b->block_size = block_size;
+	b->seed = 2463534242U;
 	return b;
 }
 
 void backed_block_list_destroy(struct backed_block_list *bbl)
 {
-	if (bbl->data_blocks) {
-		struct backed_block *bb = bbl->data_blocks;
-		while (bb) {
-			struct backed_block *next = bb->next;
-			backed_block_destroy(bb);
-			bb = next;
-		}
+	struct backed_block *bb = bbl->head[0];
+
+	while (bb) {
+		struct backed_block *next = bb->next[0];
+		backed_block_destroy(bb);
+		bb = next;
 	}
 
 	free(bbl);
@@ -146,43 +282,22 @@ void backed_block_list_move(struct backed_block_list *from,
 		struct backed_block *end)
 {
 	struct backed_block *bb;
+	struct backed_block *next;
 
 	if (start == NULL) {
-		start = from->data_blocks;
+		start = from->head[0];
 	}
 
-	if (!end) {
-		for (end = start; end && end->next; end = end->next)
-			;
-	}
-
-	if (start == NULL || end == NULL) {
+	if (start == NULL) {
 		return;
 	}
 
-	from->last_used = NULL;
-	to->last_used = NULL;
-	if (from->data_blocks == start) {
-		from->data_blocks = end->next;
-	} else {
-		for (bb = from->data_blocks; bb; bb = bb->next) {
-			if (bb->next == start) {
-				bb->next = end->next;
-				break;
-			}
-		}
-	}
-
-	if (!to->data_blocks) {
-		to->data_blocks = start;
-		end->next = NULL;
-	} else {
-		for (bb = to->data_blocks; bb; bb = bb->next) {
-			if (!bb->next || bb->next->block > start->block) {
-				end->next = bb->next;
-				bb->next = start;
-				break;
-			}
+	for (bb = start; bb; bb = next) {
+		next = bb->next[0];
+		unlink_bb(from, bb);
+		insert_bb(to, bb);
+		if (bb == end) {
+			break;
 		}
 	}
 }
@@ -237,7 +352,7 @@ static int merge_bb(struct backed_block_list *bbl,
 	/* Blocks are compatible and adjacent, with a before b.  Merge b into a,
 	 * and free b */
 	a->len += b->len;
-	a->next = b->next;
+	unlink_bb(bbl, b);
 
 	backed_block_destroy(b);
 
@@ -246,40 +361,13 @@ static int merge_bb(struct backed_block_list *bbl,
 
 static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 {
-	struct backed_block *bb;
+	struct backed_block *prev[BB_MAX_HEIGHT];
 
-	if (bbl->data_blocks == NULL) {
-		bbl->data_blocks = new_bb;
-		return 0;
-	}
+	find_prev(bbl, new_bb->block, prev);
+	link_bb(bbl, new_bb, prev);
 
-	if (bbl->data_blocks->block > new_bb->block) {
-		new_bb->next = bbl->data_blocks;
-		bbl->data_blocks = new_bb;
-		return 0;
-	}
-
-	/* Optimization: blocks are mostly queued in sequence, so save the
-	   pointer to the last bb that was added, and start searching from
-	   there if the next block number is higher */
-	if (bbl->last_used && new_bb->block > bbl->last_used->block)
-		bb = bbl->last_used;
-	else
-		bb = bbl->data_blocks;
-	bbl->last_used = new_bb;
-
-	for (; bb->next && bb->next->block < new_bb->block; bb = bb->next)
-		;
-
-	if (bb->next == NULL) {
-		bb->next = new_bb;
-	} else {
-		new_bb->next = bb->next;
-		bb->next = new_bb;
-	}
-
-	merge_bb(bbl, new_bb, new_bb->next);
-	merge_bb(bbl, bb, new_bb);
+	merge_bb(bbl, new_bb, new_bb->next[0]);
+	merge_bb(bbl, prev[0], new_bb);
 
 	return 0;
 }
@@ -288,7 +376,7 @@ static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_new(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -297,8 +385,6 @@ int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 	bb->len = len;
 	bb->type = BACKED_BLOCK_FILL;
 	bb->fill.val = fill_val;
-	bb->next = NULL;
-
 	return queue_bb(bbl, bb);
 }
 
@@ -306,7 +392,7 @@ int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 int backed_block_add_data(struct backed_block_list *bbl, void *data,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_new(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -315,8 +401,6 @@ int backed_block_add_data(struct backed_block_list *bbl, void *data,
 	bb->len = len;
 	bb->type = BACKED_BLOCK_DATA;
 	bb->data.data = data;
-	bb->next = NULL;
-
 	return queue_bb(bbl, bb);
 }
 
@@ -324,7 +408,7 @@ int backed_block_add_data(struct backed_block_list *bbl, void *data,
 int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 		int64_t offset, unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_new(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -334,8 +418,6 @@ int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 	bb->type = BACKED_BLOCK_FILE;
 	bb->file.filename = strdup(filename);
 	bb->file.offset = offset;
-	bb->next = NULL;
-
 	return queue_bb(bbl, bb);
 }
 
@@ -343,7 +425,7 @@ int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_new(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -353,8 +435,6 @@ int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
 	bb->type = BACKED_BLOCK_FD;
 	bb->fd.fd = fd;
 	bb->fd.offset = offset;
-	bb->next = NULL;
-
 	return queue_bb(bbl, bb);
 }
 
@@ -369,17 +449,14 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 		return 0;
 	}
 
-	new_bb = malloc(sizeof(struct backed_block));
-	if (bb == NULL) {
+	new_bb = backed_block_new(bbl);
+	if (new_bb == NULL) {
 		return -ENOMEM;
 	}
 
-	*new_bb = *bb;
-
+	new_bb->type = bb->type;
 	new_bb->len = bb->len - max_len;
 	new_bb->block = bb->block + max_len / bbl->block_size;
-	new_bb->next = bb->next;
-	bb->next = new_bb;
 	bb->len = max_len;
 
 	switch (bb->type) {
@@ -387,14 +464,19 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 		new_bb->data.data = (char *)bb->data.data + max_len;
 		break;
 	case BACKED_BLOCK_FILE:
-		new_bb->file.offset += max_len;
+		new_bb->file.filename = strdup(bb->file.filename);
+		new_bb->file.offset = bb->file.offset + max_len;
 		break;
 	case BACKED_BLOCK_FD:
-		new_bb->fd.offset += max_len;
+		new_bb->fd.fd = bb->fd.fd;
+		new_bb->fd.offset = bb->fd.offset + max_len;
 		break;
 	case BACKED_BLOCK_FILL:
+		new_bb->fill.val = bb->fill.val;
 		break;
 	}
 
+	insert_bb(bbl, new_bb);
+
 	return 0;
 }
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * queues single blocks in random order into a backed_block_list, as
+ * make_ext4fs does, and times it. Blocks are two apart so none of them
+ * merge. Like the other tools here it isn't part of the build:
+ *
+ *   gcc -O2 -Iinclude backed_block_bench.c backed_block.c -o backed_block_bench
+ *   ./backed_block_bench [blocks] [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "backed_block.h"
+
+#define BLOCK_SIZE 4096
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct backed_block_list *bbl;
+	struct backed_block *bb;
+	static char data[BLOCK_SIZE];
+	unsigned int *order;
+	unsigned int count = 1000000;
+	unsigned int expect;
+	unsigned int i;
+	unsigned int j;
+	unsigned int t;
+	double start;
+	double end;
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 0);
+	srand(argc > 2 ? atoi(argv[2]) : 1);
+
+	order = malloc(count * sizeof(*order));
+	bbl = backed_block_list_new(BLOCK_SIZE);
+	if (!order || !bbl) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < count; i++)
+		order[i] = i * 2;
+	for (i = count; i > 1; i--) {
+		j = ((unsigned int)rand() << 16 ^ rand()) % i;
+		t = order[i - 1];
+		order[i - 1] = order[j];
+		order[j] = t;
+	}
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		if (backed_block_add_data(bbl, data, BLOCK_SIZE, order[i])) {
+			fprintf(stderr, "insert %u failed\n", i);
+			return 1;
+		}
+	}
+	end = now();
+
+	/* the list must come out sorted */
+	expect = 0;
+	for (bb = backed_block_iter_new(bbl); bb; bb = backed_block_iter_next(bb)) {
+		if (backed_block_block(bb) != expect) {
+			fprintf(stderr, "block %u out of order, expected %u\n",
+					backed_block_block(bb), expect);
+			return 1;
+		}
+		expect += 2;
+	}
+	if (expect != count * 2) {
+		fprintf(stderr, "%u blocks listed, %u queued\n", expect / 2,
+				count);
+		return 1;
+	}
+
+	printf("%u random inserts in %.3fs, %.0f ns each\n", count,
+			end - start, (end - start) * 1e9 / count);
+
+	backed_block_list_destroy(bbl);
+	free(order);
+	return 0;
+}
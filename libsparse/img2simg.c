@@ -40,7 +40,7 @@
 
 void usage()
 {
-    fprintf(stderr, "Usage: img2simg <raw_image_file> <sparse_image_file> [<block_size>]\n");
+    fprintf(stderr, "Usage: img2simg [-z] [-d] [-j <threads>] <raw_image_file> <sparse_image_file> [<block_size>]\n");
 }
 
 int main(int argc, char *argv[])
@@ -51,7 +51,31 @@ int main(int argc, char *argv[])
 	int ret;
 	struct sparse_file *s;
 	unsigned int block_size = 4096;
+	unsigned int threads = 0;
+	bool gz = false;
+	bool skip_zeros = false;
 	off64_t len;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "zdj:")) != -1) {
+		switch (opt) {
+		case 'z':
+			gz = true;
+			break;
+		case 'd':
+			skip_zeros = true;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(-1);
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc < 3 || argc > 4) {
 		usage();
@@ -97,13 +121,15 @@ int main(int argc, char *argv[])
 	}
 
 	sparse_file_verbose(s);
+	sparse_file_set_threads(s, threads);
+	sparse_file_set_skip_zeros(s, skip_zeros);
 	ret = sparse_file_read(s, in, false, false);
 	if (ret) {
 		fprintf(stderr, "Failed to read file\n");
 		exit(-1);
 	}
 
-	ret = sparse_file_write(s, out, false, true, false);
+	ret = sparse_file_write(s, out, gz, true, false);
 	if (ret) {
 		fprintf(stderr, "Failed to write sparse file\n");
 		exit(-1);
@@ -18,6 +18,7 @@
 #define _LIBSPARSE_SPARSE_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct sparse_file;
@@ -136,6 +137,47 @@ int sparse_file_add_file(struct sparse_file *s,
 int sparse_file_add_fd(struct sparse_file *s,
 		int fd, int64_t file_offset, unsigned int len, unsigned int block);
 
+/**
+ * sparse_file_set_write_buffer - set the output buffer size of sparse_file_write
+ *
+ * @s - sparse file cookie
+ * @size - number of bytes to gather before writing
+ *
+ * Chunk headers, padding and other small pieces are gathered in a buffer of
+ * size bytes and written together with the next large payload using writev,
+ * or once the buffer is full.  A size of 0 writes every piece on its own.
+ * The default is 1MB.  Has no effect on gzip output, zlib buffers that.
+ */
+void sparse_file_set_write_buffer(struct sparse_file *s, unsigned int size);
+
+/**
+ * sparse_file_set_threads - set the number of threads used by sparse_file_write
+ * and sparse_file_read
+ *
+ * @s - sparse file cookie
+ * @threads - number of threads
+ *
+ * With more than one thread, gzip output of sparse_file_write is compressed
+ * in independent blocks on a pool of threads.  The result is a single
+ * standard gzip stream.  Reading a raw file with sparse_file_read splits the
+ * scan for fill blocks between the threads.  The default of 0 does all the
+ * work on the calling thread.
+ */
+void sparse_file_set_threads(struct sparse_file *s, unsigned int threads);
+
+/**
+ * sparse_file_set_skip_zeros - leave zero blocks out of imported raw files
+ *
+ * @s - sparse file cookie
+ * @skip - true to skip zero blocks
+ *
+ * By default sparse_file_read of a raw file stores blocks of zeros as fill
+ * chunks, so writing the sparse file back out zeroes them on the target.
+ * With skip set they are not added at all and become don't care chunks,
+ * which is only safe when the target is known to read back as zeros there.
+ */
+void sparse_file_set_skip_zeros(struct sparse_file *s, bool skip);
+
 /**
  * sparse_file_write - write a sparse file to a file
  *
@@ -241,6 +283,67 @@ struct sparse_file *sparse_file_import(int fd, bool verbose, bool crc);
  */
 struct sparse_file *sparse_file_import_auto(int fd, bool crc);
 
+/**
+ * sparse_file_import_index - open a sparse file for random access
+ *
+ * @fd - file descriptor of a file in the Android sparse file format
+ * @index_path - sidecar file for the chunk index, or NULL
+ * @verbose - print verbose errors while reading the sparse file
+ *
+ * Instead of importing every chunk, reads only the chunk headers and keeps a
+ * compact index of where each chunk starts.  If index_path names a sidecar
+ * that matches the file it is loaded instead, otherwise the index is built
+ * and saved there for the next time.
+ *
+ * The returned cookie can only be read with sparse_file_read_blocks and
+ * destroyed, it has no backed blocks to write out.  The fd must remain open
+ * until the sparse file is destroyed.
+ *
+ * Returns a new sparse file cookie on success, NULL on error.
+ */
+struct sparse_file *sparse_file_import_index(int fd, const char *index_path,
+		bool verbose);
+
+/**
+ * sparse_file_read_blocks - read blocks of the expanded image
+ *
+ * @s - sparse file cookie
+ * @block - first block to read
+ * @count - number of blocks to read
+ * @buf - buffer of count blocks
+ *
+ * Reads blocks as they would appear in the expanded image, fill chunks
+ * expanded and don't care chunks as zeros.  Files opened with
+ * sparse_file_import_index are looked up in the chunk index and only the
+ * raw data needed is read.  Other files are read from their backed blocks.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_read_blocks(struct sparse_file *s, unsigned int block,
+		unsigned int count, void *buf);
+
+/**
+ * sparse_file_diff - make a sparse file of the blocks that changed
+ *
+ * @old - sparse file cookie of the image on the target
+ * @new - sparse file cookie of the image to update it to
+ * @threads - number of threads comparing blocks
+ *
+ * Compares the expanded contents of old and new block by block, as read by
+ * sparse_file_read_blocks, and returns a sparse file holding only the
+ * blocks of new that differ, with don't care everywhere else.  Changed
+ * blocks of a single 32 bit value become fill chunks.  Blocks past the end
+ * of old always count as changed, don't care regions of new count as
+ * zeros.  Writing the result over a copy of old gives new.
+ *
+ * Both files must have the same block size.  The result refers to the data
+ * of new, which must not be destroyed before the result.
+ *
+ * Returns a new sparse file cookie on success, NULL on error.
+ */
+struct sparse_file *sparse_file_diff(struct sparse_file *old,
+		struct sparse_file *new, unsigned int threads);
+
 /** sparse_file_resparse - rechunk an existing sparse file into smaller files
  *
  * @in_s - sparse file cookie of the existing sparse file
@@ -255,6 +358,82 @@ struct sparse_file *sparse_file_import_auto(int fd, bool crc);
 int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
 		struct sparse_file **out_s, int out_s_count);
 
+/**
+ * struct sparse_push_ops - callbacks of a push mode sparse parser
+ *
+ * @on_header - called once with the geometry of the expanded image
+ * @on_raw - called with data of a raw chunk, possibly in several pieces.
+ *   The data starts offset bytes into output block block and may end in
+ *   the middle of a block.  The pointer is only valid during the call.
+ * @on_fill - called for a run of blocks filled with a 32 bit value
+ * @on_skip - called for a run of blocks that don't care about their content
+ * @on_crc - called with the value of a crc chunk
+ *
+ * Any callback may be NULL.  Callbacks return negative errno to stop parsing,
+ * 0 on success.
+ */
+struct sparse_push_ops {
+	int (*on_header)(void *priv, unsigned int block_size,
+			unsigned int total_blocks, unsigned int total_chunks);
+	int (*on_raw)(void *priv, unsigned int block, unsigned int offset,
+			const void *data, unsigned int len);
+	int (*on_fill)(void *priv, unsigned int block, unsigned int blocks,
+			uint32_t fill_val);
+	int (*on_skip)(void *priv, unsigned int block, unsigned int blocks);
+	int (*on_crc)(void *priv, uint32_t crc32);
+};
+
+struct sparse_push;
+
+/**
+ * sparse_push_new - create a push mode parser for the Android sparse format
+ *
+ * @ops - callbacks for the parsed chunks
+ * @priv - value that will be passed as the first argument to the callbacks
+ * @verbose - print verbose errors while parsing
+ * @crc - verify crc chunks against the crc of the expanded data
+ *
+ * Creates a parser that is fed a sparse file in arbitrary pieces with
+ * sparse_push_data, for input that can't be seeked such as a pipe or a usb
+ * stream.  Only the current header is buffered, raw data is handed to the
+ * callbacks straight from the caller's buffer.
+ *
+ * Returns the parser, or NULL on error.
+ */
+struct sparse_push *sparse_push_new(const struct sparse_push_ops *ops,
+		void *priv, bool verbose, bool crc);
+
+/**
+ * sparse_push_data - feed the next piece of a sparse file to a parser
+ *
+ * @p - push parser
+ * @data - pointer to the data
+ * @len - length of the data
+ *
+ * Parses data and calls the callbacks for every chunk it completes.  After an
+ * error all further calls fail.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_push_data(struct sparse_push *p, const void *data, size_t len);
+
+/**
+ * sparse_push_finish - check that a parser has seen a complete sparse file
+ *
+ * @p - push parser
+ *
+ * Returns 0 if all chunks announced by the header were parsed and cover the
+ * whole image, negative errno otherwise.
+ */
+int sparse_push_finish(struct sparse_push *p);
+
+/**
+ * sparse_push_destroy - destroy a push mode parser
+ *
+ * @p - push parser
+ */
+void sparse_push_destroy(struct sparse_push *p);
+
 /**
  * sparse_file_verbose - set a sparse file cookie to print verbose errors
  *
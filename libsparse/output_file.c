@@ -19,12 +19,14 @@
 
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <zlib.h>
 
@@ -63,6 +65,12 @@ static inline void *mmap64(void *addr, size_t length, int prot, int flags,
 #define SPARSE_HEADER_LEN       (sizeof(sparse_header_t))
 #define CHUNK_HEADER_LEN (sizeof(chunk_header_t))
 
+/*
+ * Writes of at most this size are copied into the output buffer, larger
+ * payloads go out with writev together with whatever is buffered.
+ */
+#define WRITE_COPY_MAX (64 * 1024)
+
 #define container_of(inner, outer_t, elem) \
 	((outer_t *)((char *)inner - offsetof(outer_t, elem)))
 
@@ -71,7 +79,7 @@ struct output_file_ops {
 	int (*skip)(struct output_file *, int64_t);
 	int (*pad)(struct output_file *, int64_t);
 	int (*write)(struct output_file *, void *, int);
-	void (*close)(struct output_file *);
+	int (*close)(struct output_file *);
 };
 
 struct sparse_file_ops {
@@ -105,9 +113,57 @@ struct output_file_gz {
 #define to_output_file_gz(_o) \
 	container_of((_o), struct output_file_gz, out)
 
+/*
+ * Parallel gzip output: the stream is cut into blocks that are deflated
+ * independently on a pool of threads, pigz style.  Every block but the last
+ * ends with a sync flush so the raw deflate streams can simply be
+ * concatenated behind one gzip header, and the crc of the whole stream is
+ * combined from the per block crcs.
+ */
+#define PGZ_BLOCK_SIZE (128 * 1024)
+#define PGZ_LEVEL 9
+
+struct pgz_job {
+	unsigned char *in;
+	unsigned int in_len;
+	unsigned char *out;
+	unsigned int out_size;
+	unsigned int out_len;
+	uLong crc;
+	int last;
+	int done;
+	int err;
+};
+
+struct output_file_pgz {
+	struct output_file out;
+	int fd;
+	int64_t pos;
+	uLong crc;
+	unsigned int threads;
+	pthread_t *tids;
+	unsigned int nr_started;
+	struct pgz_job *jobs;
+	unsigned int nr_jobs;
+	unsigned int submit_seq;	/* jobs handed to the workers */
+	unsigned int take_seq;		/* jobs taken by a worker */
+	unsigned int write_seq;		/* jobs written to fd */
+	int stop;
+	int err;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+};
+
+#define to_output_file_pgz(_o) \
+	container_of((_o), struct output_file_pgz, out)
+
 struct output_file_normal {
 	struct output_file out;
 	int fd;
+	char *buf;
+	unsigned int buf_size;
+	unsigned int buf_len;
 };
 
 #define to_output_file_normal(_o) \
@@ -127,6 +183,62 @@ static int file_open(struct output_file *out, int fd)
 	struct output_file_normal *outn = to_output_file_normal(out);
 
 	outn->fd = fd;
+
+	if (outn->buf_size) {
+		outn->buf = malloc(outn->buf_size);
+		if (!outn->buf) {
+			error_errno("malloc write buffer");
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/* Write the buffered data followed by len bytes of data in one writev */
+static int file_flush(struct output_file_normal *outn, void *data, int len)
+{
+	struct iovec iov[2];
+	struct iovec *v = iov;
+	int cnt = 0;
+	ssize_t ret;
+
+	if (outn->buf_len) {
+		iov[cnt].iov_base = outn->buf;
+		iov[cnt].iov_len = outn->buf_len;
+		cnt++;
+	}
+	if (len) {
+		iov[cnt].iov_base = data;
+		iov[cnt].iov_len = len;
+		cnt++;
+	}
+
+	while (cnt) {
+		ret = writev(outn->fd, v, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			error_errno("writev");
+			return -1;
+		}
+		if (ret == 0) {
+			error("incomplete write");
+			return -1;
+		}
+		while (cnt && (size_t)ret >= v->iov_len) {
+			ret -= v->iov_len;
+			v++;
+			cnt--;
+		}
+		if (cnt) {
+			v->iov_base = (char *)v->iov_base + ret;
+			v->iov_len -= ret;
+		}
+	}
+
+	outn->buf_len = 0;
+
 	return 0;
 }
 
@@ -135,6 +247,10 @@ static int file_skip(struct output_file *out, int64_t cnt)
 	off64_t ret;
 	struct output_file_normal *outn = to_output_file_normal(out);
 
+	if (file_flush(outn, NULL, 0) < 0) {
+		return -1;
+	}
+
 	ret = lseek64(outn->fd, cnt, SEEK_CUR);
 	if (ret < 0) {
 		error_errno("lseek64");
@@ -148,6 +264,10 @@ static int file_pad(struct output_file *out, int64_t len)
 	int ret;
 	struct output_file_normal *outn = to_output_file_normal(out);
 
+	if (file_flush(outn, NULL, 0) < 0) {
+		return -EIO;
+	}
+
 	ret = ftruncate64(outn->fd, len);
 	if (ret < 0) {
 		return -errno;
@@ -158,26 +278,40 @@ static int file_pad(struct output_file *out, int64_t len)
 
 static int file_write(struct output_file *out, void *data, int len)
 {
-	int ret;
 	struct output_file_normal *outn = to_output_file_normal(out);
 
-	ret = write(outn->fd, data, len);
-	if (ret < 0) {
-		error_errno("write");
-		return -1;
-	} else if (ret < len) {
-		error("incomplete write");
-		return -1;
+	/* big payloads aren't copied, they go out behind the buffered data */
+	if (len > WRITE_COPY_MAX || len > outn->buf_size) {
+		return file_flush(outn, data, len);
+	}
+
+	if (len > outn->buf_size - outn->buf_len) {
+		if (file_flush(outn, NULL, 0) < 0) {
+			return -1;
+		}
+	}
+
+	memcpy(outn->buf + outn->buf_len, data, len);
+	outn->buf_len += len;
+
+	if (outn->buf_len == outn->buf_size) {
+		return file_flush(outn, NULL, 0);
 	}
 
 	return 0;
 }
 
-static void file_close(struct output_file *out)
+static int file_close(struct output_file *out)
 {
 	struct output_file_normal *outn = to_output_file_normal(out);
+	int ret;
+
+	ret = file_flush(outn, NULL, 0);
 
+	free(outn->buf);
 	free(outn);
+
+	return ret;
 }
 
 static struct output_file_ops file_ops = {
@@ -256,12 +390,15 @@ static int gz_file_write(struct output_file *out, void *data, int len)
 	return 0;
 }
 
-static void gz_file_close(struct output_file *out)
+static int gz_file_close(struct output_file *out)
 {
 	struct output_file_gz *outgz = to_output_file_gz(out);
+	int ret;
 
-	gzclose(outgz->gz_fd);
+	ret = gzclose(outgz->gz_fd);
 	free(outgz);
+
+	return ret == Z_OK ? 0 : -1;
 }
 
 static struct output_file_ops gz_file_ops = {
@@ -272,6 +409,307 @@ static struct output_file_ops gz_file_ops = {
 	.close = gz_file_close,
 };
 
+static int write_all(int fd, const void *data, size_t len)
+{
+	const char *ptr = data;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, ptr, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			error_errno("write");
+			return -1;
+		}
+		if (ret == 0) {
+			error("incomplete write");
+			return -1;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int pgz_deflate(z_stream *zs, struct pgz_job *job)
+{
+	int ret;
+
+	ret = deflateReset(zs);
+	if (ret != Z_OK) {
+		return -1;
+	}
+
+	zs->next_in = job->in;
+	zs->avail_in = job->in_len;
+	zs->next_out = job->out;
+	zs->avail_out = job->out_size;
+
+	ret = deflate(zs, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+	if (job->last ? ret != Z_STREAM_END : ret != Z_OK || zs->avail_in) {
+		return -1;
+	}
+
+	job->out_len = job->out_size - zs->avail_out;
+	job->crc = crc32(0, job->in, job->in_len);
+
+	return 0;
+}
+
+static void *pgz_worker(void *arg)
+{
+	struct output_file_pgz *outp = arg;
+	struct pgz_job *job;
+	z_stream zs;
+	int zerr;
+
+	memset(&zs, 0, sizeof(zs));
+	zerr = deflateInit2(&zs, PGZ_LEVEL, Z_DEFLATED, -15, 8,
+			Z_DEFAULT_STRATEGY);
+
+	pthread_mutex_lock(&outp->lock);
+	for (;;) {
+		while (outp->take_seq == outp->submit_seq && !outp->stop) {
+			pthread_cond_wait(&outp->work, &outp->lock);
+		}
+		if (outp->take_seq == outp->submit_seq) {
+			break;
+		}
+		job = &outp->jobs[outp->take_seq++ % outp->nr_jobs];
+		pthread_mutex_unlock(&outp->lock);
+
+		job->err = zerr != Z_OK || pgz_deflate(&zs, job) < 0;
+
+		pthread_mutex_lock(&outp->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&outp->done);
+	}
+	pthread_mutex_unlock(&outp->lock);
+
+	if (zerr == Z_OK) {
+		deflateEnd(&zs);
+	}
+
+	return NULL;
+}
+
+/* Wait for the oldest job and write its output */
+static int pgz_write_job(struct output_file_pgz *outp)
+{
+	struct pgz_job *job = &outp->jobs[outp->write_seq % outp->nr_jobs];
+
+	pthread_mutex_lock(&outp->lock);
+	while (!job->done) {
+		pthread_cond_wait(&outp->done, &outp->lock);
+	}
+	pthread_mutex_unlock(&outp->lock);
+
+	if (job->err) {
+		error("deflate failed");
+		outp->err = -1;
+	}
+
+	if (!outp->err) {
+		outp->crc = crc32_combine(outp->crc, job->crc, job->in_len);
+		if (write_all(outp->fd, job->out, job->out_len) < 0) {
+			outp->err = -1;
+		}
+	}
+
+	job->done = 0;
+	job->in_len = 0;
+	outp->write_seq++;
+
+	return outp->err;
+}
+
+static int pgz_submit(struct output_file_pgz *outp, int last)
+{
+	outp->jobs[outp->submit_seq % outp->nr_jobs].last = last;
+
+	pthread_mutex_lock(&outp->lock);
+	outp->submit_seq++;
+	pthread_cond_signal(&outp->work);
+	pthread_mutex_unlock(&outp->lock);
+
+	/* make sure the next job to fill is free */
+	if (outp->submit_seq - outp->write_seq == outp->nr_jobs) {
+		return pgz_write_job(outp);
+	}
+
+	return outp->err;
+}
+
+/* Feed len bytes of data, or of zeros if data is NULL, into the stream */
+static int pgz_feed(struct output_file_pgz *outp, const void *data, int64_t len)
+{
+	const char *ptr = data;
+	struct pgz_job *job;
+	unsigned int chunk;
+
+	while (len > 0) {
+		job = &outp->jobs[outp->submit_seq % outp->nr_jobs];
+		chunk = min(len, (int64_t)(PGZ_BLOCK_SIZE - job->in_len));
+		if (ptr) {
+			memcpy(job->in + job->in_len, ptr, chunk);
+			ptr += chunk;
+		} else {
+			memset(job->in + job->in_len, 0, chunk);
+		}
+		job->in_len += chunk;
+		outp->pos += chunk;
+		len -= chunk;
+
+		if (job->in_len == PGZ_BLOCK_SIZE && pgz_submit(outp, 0) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void pgz_stop(struct output_file_pgz *outp)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&outp->lock);
+	outp->stop = 1;
+	pthread_cond_broadcast(&outp->work);
+	pthread_mutex_unlock(&outp->lock);
+
+	for (i = 0; i < outp->nr_started; i++) {
+		pthread_join(outp->tids[i], NULL);
+	}
+	outp->nr_started = 0;
+}
+
+static void pgz_free(struct output_file_pgz *outp)
+{
+	unsigned int i;
+
+	pgz_stop(outp);
+
+	if (outp->jobs) {
+		for (i = 0; i < outp->nr_jobs; i++) {
+			free(outp->jobs[i].in);
+			free(outp->jobs[i].out);
+		}
+	}
+	free(outp->jobs);
+	free(outp->tids);
+	pthread_mutex_destroy(&outp->lock);
+	pthread_cond_destroy(&outp->work);
+	pthread_cond_destroy(&outp->done);
+	free(outp);
+}
+
+static int pgz_file_open(struct output_file *out, int fd)
+{
+	struct output_file_pgz *outp = to_output_file_pgz(out);
+	static const unsigned char gz_header[10] = {
+		0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 2, 3
+	};
+	unsigned int i;
+
+	outp->fd = fd;
+	outp->crc = crc32(0, NULL, 0);
+	outp->nr_jobs = 2 * outp->threads;
+
+	outp->jobs = calloc(outp->nr_jobs, sizeof(struct pgz_job));
+	outp->tids = calloc(outp->threads, sizeof(pthread_t));
+	if (!outp->jobs || !outp->tids) {
+		error_errno("malloc pgz jobs");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < outp->nr_jobs; i++) {
+		struct pgz_job *job = &outp->jobs[i];
+
+		/* room for incompressible data and the sync flush marker */
+		job->out_size = compressBound(PGZ_BLOCK_SIZE) + 64;
+		job->in = malloc(PGZ_BLOCK_SIZE);
+		job->out = malloc(job->out_size);
+		if (!job->in || !job->out) {
+			error_errno("malloc pgz buffers");
+			return -ENOMEM;
+		}
+	}
+
+	for (i = 0; i < outp->threads; i++) {
+		if (pthread_create(&outp->tids[i], NULL, pgz_worker, outp)) {
+			error("failed to start compression thread");
+			return -EAGAIN;
+		}
+		outp->nr_started++;
+	}
+
+	return write_all(fd, gz_header, sizeof(gz_header));
+}
+
+static int pgz_file_skip(struct output_file *out, int64_t cnt)
+{
+	struct output_file_pgz *outp = to_output_file_pgz(out);
+
+	return pgz_feed(outp, NULL, cnt);
+}
+
+static int pgz_file_pad(struct output_file *out, int64_t len)
+{
+	struct output_file_pgz *outp = to_output_file_pgz(out);
+
+	if (outp->pos >= len) {
+		return 0;
+	}
+
+	return pgz_feed(outp, NULL, len - outp->pos);
+}
+
+static int pgz_file_write(struct output_file *out, void *data, int len)
+{
+	struct output_file_pgz *outp = to_output_file_pgz(out);
+
+	return pgz_feed(outp, data, len);
+}
+
+static int pgz_file_close(struct output_file *out)
+{
+	struct output_file_pgz *outp = to_output_file_pgz(out);
+	unsigned char trailer[8];
+	uint32_t isize;
+	int ret;
+	int i;
+
+	ret = pgz_submit(outp, 1);
+	while (outp->write_seq != outp->submit_seq) {
+		if (pgz_write_job(outp) < 0) {
+			ret = -1;
+		}
+	}
+
+	if (ret == 0) {
+		isize = outp->pos;
+		for (i = 0; i < 4; i++) {
+			trailer[i] = outp->crc >> (8 * i);
+			trailer[4 + i] = isize >> (8 * i);
+		}
+		ret = write_all(outp->fd, trailer, sizeof(trailer));
+	}
+
+	pgz_free(outp);
+
+	return ret;
+}
+
+static struct output_file_ops pgz_file_ops = {
+	.open = pgz_file_open,
+	.skip = pgz_file_skip,
+	.pad = pgz_file_pad,
+	.write = pgz_file_write,
+	.close = pgz_file_close,
+};
+
 static int callback_file_open(struct output_file *out, int fd)
 {
 	return 0;
@@ -308,11 +746,13 @@ static int callback_file_write(struct output_file *out, void *data, int len)
 	return outc->write(outc->priv, data, len);
 }
 
-static void callback_file_close(struct output_file *out)
+static int callback_file_close(struct output_file *out)
 {
 	struct output_file_callback *outc = to_output_file_callback(out);
 
 	free(outc);
+
+	return 0;
 }
 
 static struct output_file_ops callback_file_ops = {
@@ -365,6 +805,10 @@ static int write_sparse_skip_chunk(struct output_file *out, int64_t skip_len)
 	if (ret < 0)
 		return -1;
 
+	/* readers count don't care data as zeros */
+	if (out->use_crc)
+		out->crc32 = sparse_crc32_fill(out->crc32, 0, skip_len);
+
 	out->cur_out_ptr += skip_len;
 	out->chunk_cnt++;
 
@@ -375,9 +819,8 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len,
 		uint32_t fill_val)
 {
 	chunk_header_t chunk_header;
-	int rnd_up_len, zero_len, count;
+	int rnd_up_len;
 	int ret;
-	unsigned int i;
 
 	/* Round up the fill length to a multiple of the block size */
 	rnd_up_len = ALIGN(len, out->block_size);
@@ -395,11 +838,8 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len,
 	if (ret < 0)
 		return -1;
 
-	if (out->use_crc) {
-		count = out->block_size / sizeof(uint32_t);
-		while (count--)
-			out->crc32 = sparse_crc32(out->crc32, &fill_val, sizeof(uint32_t));
-	}
+	if (out->use_crc)
+		out->crc32 = sparse_crc32_fill(out->crc32, fill_val, rnd_up_len);
 
 	out->cur_out_ptr += rnd_up_len;
 	out->chunk_cnt++;
@@ -541,12 +981,16 @@ static struct sparse_file_ops normal_file_ops = {
 		.write_end_chunk = write_normal_end_chunk,
 };
 
-void output_file_close(struct output_file *out)
+int output_file_close(struct output_file *out)
 {
 	int ret;
 
-	out->sparse_ops->write_end_chunk(out);
-	out->ops->close(out);
+	ret = out->sparse_ops->write_end_chunk(out);
+	if (out->ops->close(out) < 0) {
+		ret = -EIO;
+	}
+
+	return ret < 0 ? ret : 0;
 }
 
 static int output_file_init(struct output_file *out, int block_size,
@@ -588,7 +1032,7 @@ static int output_file_init(struct output_file *out, int block_size,
 				.file_hdr_sz = SPARSE_HEADER_LEN,
 				.chunk_hdr_sz = CHUNK_HEADER_LEN,
 				.blk_sz = out->block_size,
-				.total_blks = out->len / out->block_size,
+				.total_blks = DIV_ROUND_UP(out->len, out->block_size),
 				.total_chunks = chunks,
 				.image_checksum = 0
 		};
@@ -625,7 +1069,24 @@ static struct output_file *output_file_new_gz(void)
 	return &outgz->out;
 }
 
-static struct output_file *output_file_new_normal(void)
+static struct output_file *output_file_new_pgz(unsigned int threads)
+{
+	struct output_file_pgz *outp = calloc(1, sizeof(struct output_file_pgz));
+	if (!outp) {
+		error_errno("malloc struct outp");
+		return NULL;
+	}
+
+	outp->out.ops = &pgz_file_ops;
+	outp->threads = threads;
+	pthread_mutex_init(&outp->lock, NULL);
+	pthread_cond_init(&outp->work, NULL);
+	pthread_cond_init(&outp->done, NULL);
+
+	return &outp->out;
+}
+
+static struct output_file *output_file_new_normal(unsigned int buffer_size)
 {
 	struct output_file_normal *outn = calloc(1, sizeof(struct output_file_normal));
 	if (!outn) {
@@ -634,6 +1095,7 @@ static struct output_file *output_file_new_normal(void)
 	}
 
 	outn->out.ops = &file_ops;
+	outn->buf_size = buffer_size;
 
 	return &outn->out;
 }
@@ -665,26 +1127,46 @@ struct output_file *output_file_open_callback(int (*write)(void *, const void *,
 }
 
 struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t len,
-		int gz, int sparse, int chunks, int crc)
+		int gz, int sparse, int chunks, int crc, unsigned int buffer_size,
+		unsigned int threads)
 {
 	int ret;
 	struct output_file *out;
 
-	if (gz) {
+	if (gz && threads > 1) {
+		out = output_file_new_pgz(threads);
+	} else if (gz) {
 		out = output_file_new_gz();
 	} else {
-		out = output_file_new_normal();
+		out = output_file_new_normal(buffer_size);
 	}
 
-	out->ops->open(out, fd);
+	if (!out) {
+		return NULL;
+	}
+
+	ret = out->ops->open(out, fd);
+	if (ret < 0) {
+		goto err;
+	}
 
 	ret = output_file_init(out, block_size, len, sparse, chunks, crc);
 	if (ret < 0) {
-		free(out);
-		return NULL;
+		goto err;
 	}
 
 	return out;
+
+err:
+	if (out->ops == &pgz_file_ops) {
+		pgz_free(to_output_file_pgz(out));
+		return NULL;
+	}
+	if (out->ops == &file_ops) {
+		free(to_output_file_normal(out)->buf);
+	}
+	free(out);
+	return NULL;
 }
 
 /* Write a contiguous region of data blocks from a memory buffer */
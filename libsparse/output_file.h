@@ -22,7 +22,8 @@
 struct output_file;
 
 struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t len,
-		int gz, int sparse, int chunks, int crc);
+		int gz, int sparse, int chunks, int crc, unsigned int buffer_size,
+		unsigned int threads);
 struct output_file *output_file_open_callback(int (*write)(void *, const void *, int),
 		void *priv, unsigned int block_size, int64_t len, int gz, int sparse,
 		int chunks, int crc);
@@ -34,7 +35,7 @@ int write_file_chunk(struct output_file *out, unsigned int len,
 int write_fd_chunk(struct output_file *out, unsigned int len,
 		int fd, int64_t offset);
 int write_skip_chunk(struct output_file *out, int64_t len);
-void output_file_close(struct output_file *out);
+int output_file_close(struct output_file *out);
 
 int read_all(int fd, void *buf, size_t len);
 
@@ -14,25 +14,476 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include <sparse/sparse.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
+#define COPY_BUF_SIZE (1024 * 1024)
+#define FILL_BUF_SIZE (4 * 1024 * 1024)
+/* fill chunks are split so one large chunk spreads over the workers */
+#define FILL_JOB_SIZE (64 * 1024 * 1024)
+
+enum job_type {
+	JOB_RAW,
+	JOB_FILL,
+};
+
+struct job {
+	enum job_type type;
+	int64_t offset;
+	int64_t len;
+	uint32_t fill_val;
+	char *buf;
+};
+
+/*
+ * Expansion is split between the thread parsing the input and a pool of
+ * workers doing the writes.  Raw data is copied into one of a fixed set
+ * of buffers and queued with its absolute offset, so the workers can
+ * pwrite in any order.  Zero fills punch holes where the filesystem can.
+ */
+struct expand {
+	int out;
+	unsigned int block_size;
+	int64_t len;
+
+	pthread_t *tids;
+	unsigned int threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct job *queue;
+	unsigned int queue_size;
+	unsigned int head;
+	unsigned int count;
+	unsigned int busy;
+	char **free_bufs;
+	unsigned int nr_free;
+	bool stop;
+	bool punch;
+	int error;
+
+	/* raw data gathered for the next job */
+	struct job cur;
+};
+
 void usage()
 {
-  fprintf(stderr, "Usage: simg2img <sparse_image_files> <raw_image_file>\n");
+  fprintf(stderr, "Usage: simg2img [-j <threads>] <sparse_image_files> <raw_image_file>\n");
+}
+
+static int write_at(int fd, const void *data, size_t len, int64_t offset)
+{
+	const char *ptr = data;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, ptr, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		ptr += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int punch_hole(struct expand *e, int64_t offset, int64_t len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (e->punch) {
+		if (fallocate(e->out, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				offset, len) == 0) {
+			return 0;
+		}
+		if (errno != EOPNOTSUPP && errno != ENOSYS) {
+			return -errno;
+		}
+		/* not supported here, write the zeros from now on */
+		e->punch = false;
+	}
+#endif
+	return -EOPNOTSUPP;
+}
+
+/*
+ * fillbuf holds fill_len bytes of fill_val, only as much of it is set up
+ * as the fill at hand needs, small fills of changing values are common.
+ */
+static int run_fill(struct expand *e, struct job *job, uint32_t *fillbuf,
+		uint32_t *fill_val, size_t *fill_len)
+{
+	int64_t offset = job->offset;
+	int64_t len = job->len;
+	size_t need = len < FILL_BUF_SIZE ? len : FILL_BUF_SIZE;
+	size_t i;
+	size_t chunk;
+	int ret;
+
+	if (job->fill_val == 0 && punch_hole(e, offset, len) == 0) {
+		return 0;
+	}
+
+	if (*fill_val != job->fill_val) {
+		*fill_val = job->fill_val;
+		*fill_len = 0;
+	}
+	for (i = *fill_len / sizeof(uint32_t); i < need / sizeof(uint32_t); i++) {
+		fillbuf[i] = job->fill_val;
+	}
+	if (*fill_len < need) {
+		*fill_len = need;
+	}
+
+	while (len) {
+		chunk = len < need ? len : need;
+		ret = write_at(e->out, fillbuf, chunk, offset);
+		if (ret < 0) {
+			return ret;
+		}
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static void *worker(void *arg)
+{
+	struct expand *e = arg;
+	uint32_t *fillbuf;
+	uint32_t fill_val = 0;
+	size_t fill_len = 0;
+	struct job job;
+	int ret;
+
+	fillbuf = malloc(FILL_BUF_SIZE);
+
+	pthread_mutex_lock(&e->lock);
+	for (;;) {
+		while (!e->count && !e->stop) {
+			pthread_cond_wait(&e->work, &e->lock);
+		}
+		if (!e->count) {
+			break;
+		}
+
+		job = e->queue[e->head];
+		e->head = (e->head + 1) % e->queue_size;
+		e->count--;
+		e->busy++;
+		pthread_cond_broadcast(&e->done);
+		pthread_mutex_unlock(&e->lock);
+
+		if (job.type == JOB_RAW) {
+			ret = write_at(e->out, job.buf, job.len, job.offset);
+		} else if (fillbuf) {
+			ret = run_fill(e, &job, fillbuf, &fill_val, &fill_len);
+		} else {
+			ret = -ENOMEM;
+		}
+
+		pthread_mutex_lock(&e->lock);
+		if (ret < 0 && !e->error) {
+			e->error = ret;
+		}
+		if (job.buf) {
+			e->free_bufs[e->nr_free++] = job.buf;
+		}
+		e->busy--;
+		pthread_cond_broadcast(&e->done);
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	free(fillbuf);
+	return NULL;
+}
+
+static int queue_job(struct expand *e, struct job *job)
+{
+	int ret;
+
+	pthread_mutex_lock(&e->lock);
+	while (e->count == e->queue_size && !e->error) {
+		pthread_cond_wait(&e->done, &e->lock);
+	}
+	ret = e->error;
+	if (!ret) {
+		e->queue[(e->head + e->count) % e->queue_size] = *job;
+		e->count++;
+		pthread_cond_signal(&e->work);
+	} else if (job->buf) {
+		e->free_bufs[e->nr_free++] = job->buf;
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return ret;
+}
+
+static int flush_raw(struct expand *e)
+{
+	int ret;
+
+	if (!e->cur.len) {
+		return 0;
+	}
+
+	ret = queue_job(e, &e->cur);
+	e->cur.buf = NULL;
+	e->cur.len = 0;
+
+	return ret;
+}
+
+/* wait until every queued write has been done */
+static int drain(struct expand *e)
+{
+	int ret;
+
+	ret = flush_raw(e);
+
+	pthread_mutex_lock(&e->lock);
+	while (e->count || e->busy) {
+		pthread_cond_wait(&e->done, &e->lock);
+	}
+	if (!ret) {
+		ret = e->error;
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return ret;
+}
+
+static int pool_start(struct expand *e, unsigned int threads)
+{
+	unsigned int i;
+
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->work, NULL);
+	pthread_cond_init(&e->done, NULL);
+	e->punch = true;
+
+	/* buffers for every queued job, one per worker and the one being filled */
+	e->queue_size = 2 * threads;
+	e->queue = calloc(e->queue_size, sizeof(struct job));
+	e->free_bufs = calloc(e->queue_size + threads + 1, sizeof(char *));
+	e->tids = calloc(threads, sizeof(pthread_t));
+	if (!e->queue || !e->free_bufs || !e->tids) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < e->queue_size + threads + 1; i++) {
+		e->free_bufs[i] = malloc(COPY_BUF_SIZE);
+		if (!e->free_bufs[i]) {
+			return -ENOMEM;
+		}
+		e->nr_free++;
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&e->tids[i], NULL, worker, e)) {
+			break;
+		}
+		e->threads++;
+	}
+
+	return e->threads ? 0 : -EAGAIN;
+}
+
+static void pool_stop(struct expand *e)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&e->lock);
+	e->stop = true;
+	pthread_cond_broadcast(&e->work);
+	pthread_mutex_unlock(&e->lock);
+
+	for (i = 0; i < e->threads; i++) {
+		pthread_join(e->tids[i], NULL);
+	}
+
+	if (e->free_bufs) {
+		for (i = 0; i < e->nr_free; i++) {
+			free(e->free_bufs[i]);
+		}
+	}
+	free(e->free_bufs);
+	free(e->queue);
+	free(e->tids);
+}
+
+static char *get_buffer(struct expand *e)
+{
+	char *buf = NULL;
+
+	pthread_mutex_lock(&e->lock);
+	while (!e->nr_free && !e->error) {
+		pthread_cond_wait(&e->done, &e->lock);
+	}
+	if (e->nr_free) {
+		buf = e->free_bufs[--e->nr_free];
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return buf;
+}
+
+static int on_header(void *priv, unsigned int block_size,
+		unsigned int total_blocks, unsigned int total_chunks)
+{
+	struct expand *e = priv;
+
+	e->block_size = block_size;
+	e->len = (int64_t)total_blocks * block_size;
+
+	return 0;
+}
+
+static int on_raw(void *priv, unsigned int block, unsigned int offset,
+		const void *data, unsigned int len)
+{
+	struct expand *e = priv;
+	int64_t pos = (int64_t)block * e->block_size + offset;
+	const char *ptr = data;
+	unsigned int chunk;
+	int ret;
+
+	while (len) {
+		if (e->cur.len && (e->cur.offset + e->cur.len != pos ||
+				e->cur.len == COPY_BUF_SIZE)) {
+			ret = flush_raw(e);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+
+		if (!e->cur.len) {
+			e->cur.buf = get_buffer(e);
+			if (!e->cur.buf) {
+				return e->error;
+			}
+			e->cur.type = JOB_RAW;
+			e->cur.offset = pos;
+		}
+
+		chunk = COPY_BUF_SIZE - e->cur.len;
+		if (chunk > len) {
+			chunk = len;
+		}
+		memcpy(e->cur.buf + e->cur.len, ptr, chunk);
+		e->cur.len += chunk;
+		ptr += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static int on_fill(void *priv, unsigned int block, unsigned int blocks,
+		uint32_t fill_val)
+{
+	struct expand *e = priv;
+	int64_t offset = (int64_t)block * e->block_size;
+	int64_t len = (int64_t)blocks * e->block_size;
+	struct job job;
+	int ret;
+
+	while (len) {
+		job.type = JOB_FILL;
+		job.offset = offset;
+		job.len = len < FILL_JOB_SIZE ? len : FILL_JOB_SIZE;
+		job.fill_val = fill_val;
+		job.buf = NULL;
+
+		ret = queue_job(e, &job);
+		if (ret < 0) {
+			return ret;
+		}
+		offset += job.len;
+		len -= job.len;
+	}
+
+	return 0;
+}
+
+static const struct sparse_push_ops expand_ops = {
+	.on_header = on_header,
+	.on_raw = on_raw,
+	.on_fill = on_fill,
+};
+
+/*
+ * Expand one sparse file into out as it is read, so the input doesn't
+ * need to be seekable and can come from a pipe.  Don't care chunks are not
+ * touched, they stay holes in the new output file or keep the data of an
+ * earlier input.  All writes are finished before returning so the next
+ * input is laid over a complete image.
+ */
+static int expand(int in, struct expand *e)
+{
+	struct sparse_push *p;
+	char *buf;
+	ssize_t len;
+	int ret = 0;
+
+	buf = malloc(COPY_BUF_SIZE);
+	p = sparse_push_new(&expand_ops, e, true, false);
+	if (!buf || !p) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (ret == 0) {
+		len = read(in, buf, COPY_BUF_SIZE);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ret = -errno;
+		} else if (len == 0) {
+			ret = sparse_push_finish(p);
+			break;
+		} else {
+			ret = sparse_push_data(p, buf, len);
+		}
+	}
+
+	len = drain(e);
+	if (!ret) {
+		ret = len;
+	}
+
+out:
+	if (p) {
+		sparse_push_destroy(p);
+	}
+	free(buf);
+	return ret;
 }
 
 int main(int argc, char *argv[])
@@ -41,19 +492,48 @@ int main(int argc, char *argv[])
 	int out;
 	int i;
 	int ret;
-	struct sparse_file *s;
+	int64_t len = 0;
+	long threads;
+	int opt;
+	struct expand e;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(-1);
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc < 3) {
 		usage();
 		exit(-1);
 	}
 
+	if (threads < 1) {
+		threads = 1;
+	}
+
 	out = open(argv[argc - 1], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
 	if (out < 0) {
 		fprintf(stderr, "Cannot open output file %s\n", argv[argc - 1]);
 		exit(-1);
 	}
 
+	memset(&e, 0, sizeof(e));
+	e.out = out;
+	if (pool_start(&e, threads) < 0) {
+		fprintf(stderr, "Failed to start writer threads\n");
+		exit(-1);
+	}
+
 	for (i = 1; i < argc - 1; i++) {
 		if (strcmp(argv[i], "-") == 0) {
 			in = STDIN_FILENO;
@@ -65,25 +545,26 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		s = sparse_file_import(in, true, false);
-		if (!s) {
-			fprintf(stderr, "Failed to read sparse file\n");
-			exit(-1);
-		}
-
-		lseek(out, SEEK_SET, 0);
-
-		ret = sparse_file_write(s, out, false, false, false);
+		ret = expand(in, &e);
 		if (ret < 0) {
-			fprintf(stderr, "Cannot write output file\n");
+			fprintf(stderr, "Failed to expand sparse file %s\n", argv[i]);
 			exit(-1);
 		}
-		sparse_file_destroy(s);
+		if (e.len > len) {
+			len = e.len;
+		}
 		close(in);
 	}
 
+	pool_stop(&e);
+
+	/* don't care chunks at the end leave a hole that sets the size */
+	if (ftruncate(out, len) < 0) {
+		fprintf(stderr, "Cannot write output file\n");
+		exit(-1);
+	}
+
 	close(out);
 
 	exit(0);
 }
-
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+/* raw images are added in pieces, backed block lengths are 32 bit */
+#define RAW_PIECE_SIZE (1024 * 1024 * 1024)
+
+void usage()
+{
+  fprintf(stderr, "Usage: simgdiff [-z] [-j <threads>] [-b <block_size>] <old_image_file> <new_image_file> <sparse_image_file>\n");
+}
+
+/*
+ * Open a raw or sparse image for reading blocks.  Sparse images are only
+ * indexed, raw images are added as fd backed blocks.
+ */
+static struct sparse_file *open_image(const char *path, unsigned int block_size)
+{
+	struct sparse_file *s;
+	uint32_t magic = 0;
+	int64_t len;
+	int64_t off;
+	unsigned int piece;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open input file %s\n", path);
+		return NULL;
+	}
+
+	if (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+			magic == SPARSE_HEADER_MAGIC) {
+		s = sparse_file_import_index(fd, NULL, true);
+		if (!s) {
+			fprintf(stderr, "Failed to read sparse file %s\n", path);
+		}
+		return s;
+	}
+
+	len = lseek(fd, 0, SEEK_END);
+	if (len < 0) {
+		fprintf(stderr, "Cannot read input file %s\n", path);
+		return NULL;
+	}
+
+	s = sparse_file_new(block_size, len);
+	if (!s) {
+		return NULL;
+	}
+
+	for (off = 0; off < len; off += piece) {
+		piece = len - off < RAW_PIECE_SIZE ? len - off : RAW_PIECE_SIZE;
+		if (sparse_file_add_fd(s, fd, off, piece, off / block_size) < 0) {
+			sparse_file_destroy(s);
+			return NULL;
+		}
+	}
+
+	return s;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sparse_file *old_s;
+	struct sparse_file *new_s;
+	struct sparse_file *s;
+	unsigned int block_size = 4096;
+	long threads;
+	bool gz = false;
+	int out;
+	int opt;
+	int ret;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "zj:b:")) != -1) {
+		switch (opt) {
+		case 'z':
+			gz = true;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'b':
+			block_size = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(-1);
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc != 4 || block_size < 1024 || block_size % 4 != 0) {
+		usage();
+		exit(-1);
+	}
+
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	old_s = open_image(argv[1], block_size);
+	new_s = open_image(argv[2], block_size);
+	if (!old_s || !new_s) {
+		exit(-1);
+	}
+
+	s = sparse_file_diff(old_s, new_s, threads);
+	if (!s) {
+		fprintf(stderr, "Failed to compare images, block sizes must match\n");
+		exit(-1);
+	}
+
+	out = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0664);
+	if (out < 0) {
+		fprintf(stderr, "Cannot open output file %s\n", argv[3]);
+		exit(-1);
+	}
+
+	sparse_file_set_threads(s, threads);
+	ret = sparse_file_write(s, out, gz, true, false);
+	if (ret) {
+		fprintf(stderr, "Failed to write sparse file\n");
+		exit(-1);
+	}
+
+	close(out);
+	sparse_file_destroy(s);
+	sparse_file_destroy(new_s);
+	sparse_file_destroy(old_s);
+
+	exit(0);
+}
@@ -14,7 +14,6 @@
  * limitations under the License.
  */
 
-#include <assert.h>
 #include <stdlib.h>
 
 #include <sparse/sparse.h>
@@ -25,6 +24,9 @@
 #include "backed_block.h"
 #include "sparse_defs.h"
 #include "sparse_format.h"
+#include "sparse_index.h"
+
+#define SPARSE_WRITE_BUFFER (1024 * 1024)
 
 struct sparse_file *sparse_file_new(unsigned int block_size, int64_t len)
 {
@@ -41,6 +43,7 @@ struct sparse_file *sparse_file_new(unsigned int block_size, int64_t len)
 
 	s->block_size = block_size;
 	s->len = len;
+	s->write_buffer = SPARSE_WRITE_BUFFER;
 
 	return s;
 }
@@ -48,6 +51,9 @@ struct sparse_file *sparse_file_new(unsigned int block_size, int64_t len)
 void sparse_file_destroy(struct sparse_file *s)
 {
 	backed_block_list_destroy(s->backed_block_list);
+	if (s->index) {
+		sparse_index_destroy(s->index);
+	}
 	free(s);
 }
 
@@ -139,8 +145,8 @@ static int write_all_blocks(struct sparse_file *s, struct output_file *out)
 				DIV_ROUND_UP(backed_block_len(bb), s->block_size);
 	}
 
+	/* negative when a partial last block was already written padded */
 	pad = s->len - (int64_t)last_block * s->block_size;
-	assert(pad >= 0);
 	if (pad > 0) {
 		write_skip_chunk(out, pad);
 	}
@@ -156,14 +162,16 @@ int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse,
 	struct output_file *out;
 
 	chunks = sparse_count_chunks(s);
-	out = output_file_open_fd(fd, s->block_size, s->len, gz, sparse, chunks, crc);
+	out = output_file_open_fd(fd, s->block_size, s->len, gz, sparse, chunks, crc,
+			s->write_buffer, s->threads);
 
 	if (!out)
 		return -ENOMEM;
 
 	ret = write_all_blocks(s, out);
 
-	output_file_close(out);
+	if (output_file_close(out) < 0 && ret == 0)
+		ret = -EIO;
 
 	return ret;
 }
@@ -311,6 +319,21 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
 	return c;
 }
 
+void sparse_file_set_write_buffer(struct sparse_file *s, unsigned int size)
+{
+	s->write_buffer = size;
+}
+
+void sparse_file_set_threads(struct sparse_file *s, unsigned int threads)
+{
+	s->threads = threads;
+}
+
+void sparse_file_set_skip_zeros(struct sparse_file *s, bool skip)
+{
+	s->skip_zeros = skip;
+}
+
 void sparse_file_verbose(struct sparse_file *s)
 {
 	s->verbose = true;
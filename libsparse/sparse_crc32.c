@@ -43,7 +43,10 @@
  */
 
 /* Code taken from FreeBSD 8 */
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 static uint32_t crc32_tab[] = {
         0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -92,20 +95,352 @@ static uint32_t crc32_tab[] = {
 };
 
 /*
- * A function that calculates the CRC-32 based on the table above is
- * given below for documentation purposes. An equivalent implementation
- * of this function that's actually used in the kernel can be found
- * in sys/libkern.h, where it can be inlined.
+ * Byte at a time version of the table lookup.  Every other implementation
+ * below is checked against it before it gets used.
  */
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t *p, size_t size)
+{
+	while (size--)
+		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+/*
+ * Slicing-by-8: eight tables derived from crc32_tab, each one advancing the
+ * crc by one more zero byte, let eight input bytes be folded in with eight
+ * independent lookups.
+ */
+static uint32_t crc32_slice8_tab[8][256];
+
+static void crc32_slice8_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+		crc32_slice8_tab[0][i] = crc32_tab[i];
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc32_slice8_tab[k][i] = (crc32_slice8_tab[k - 1][i] >> 8) ^
+				crc32_tab[crc32_slice8_tab[k - 1][i] & 0xFF];
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	uint32_t (*t)[256] = crc32_slice8_tab;
+	uint32_t lo, hi;
+
+	while (size && ((uintptr_t)p & 7)) {
+		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		size--;
+	}
+
+	while (size >= 8) {
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+			t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+			t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+			t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+		p += 8;
+		size -= 8;
+	}
+
+	return crc32_bytewise(crc, p, size);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define CRC32_PCLMUL 1
+
+#include <cpuid.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+
+/*
+ * Carry-less multiplication folding, after Intel's "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction".  The SSE4.2 crc32
+ * instruction implements the Castagnoli polynomial, so it can't be used for
+ * the 802.3 crc of the sparse format.
+ *
+ * Folds 64 bytes per iteration, size must be at least 64 and a multiple
+ * of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t size)
+{
+	static const uint64_t k1k2[] __attribute__((aligned(16))) =
+		{ 0x0154442bd4ULL, 0x01c6e41596ULL };
+	static const uint64_t k3k4[] __attribute__((aligned(16))) =
+		{ 0x01751997d0ULL, 0x00ccaa009eULL };
+	static const uint64_t k5k0[] __attribute__((aligned(16))) =
+		{ 0x0163cd6124ULL, 0x0000000000ULL };
+	static const uint64_t poly[] __attribute__((aligned(16))) =
+		{ 0x01db710641ULL, 0x01f7011641ULL };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	buf += 64;
+	size -= 64;
+
+	/* fold four lanes of 16 bytes in parallel */
+	while (size >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		buf += 64;
+		size -= 64;
+	}
+
+	/* fold the four lanes into one */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* remaining blocks of 16 */
+	while (size >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)buf);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		buf += 16;
+		size -= 16;
+	}
+
+	/* fold 128 bits to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static int crc32_have_pclmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+#endif
 
-uint32_t sparse_crc32(uint32_t crc_in, const void *buf, int size)
+static uint32_t crc32_fast(uint32_t crc, const uint8_t *p, size_t size);
+static uint32_t (*crc32_impl)(uint32_t crc, const uint8_t *p, size_t size) =
+	crc32_bytewise;
+static int crc32_use_pclmul;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32_fast(uint32_t crc, const uint8_t *p, size_t size)
+{
+#ifdef CRC32_PCLMUL
+	size_t chunk;
+
+	if (crc32_use_pclmul && size >= 64) {
+		chunk = size & ~(size_t)15;
+		crc = crc32_pclmul(crc, p, chunk);
+		p += chunk;
+		size -= chunk;
+	}
+#endif
+	return crc32_slice8(crc, p, size);
+}
+
+/*
+ * Compare an implementation with the byte at a time table over a range of
+ * lengths and alignments, to catch a miscompiled or misdetected fast path.
+ */
+static int crc32_selftest(void)
+{
+	static uint8_t buf[1024 + 16];
+	uint32_t seed = 0x12345678;
+	size_t i, off, len;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	for (off = 0; off < 16; off += 5) {
+		for (len = 0; len <= 1024; len += len < 160 ? 1 : 61) {
+			if (crc32_fast(~0U, buf + off, len) !=
+					crc32_bytewise(~0U, buf + off, len))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * CRC combination, as in zlib's crc32_combine.  A crc is a polynomial over
+ * GF(2) and appending n zero bytes multiplies it by x^(8n) modulo the crc
+ * polynomial, so the crc of a concatenation can be computed from the crcs of
+ * its parts in O(log n) time.
+ */
+#define CRC32_POLY 0xedb88320
+
+/* x^(2^n) modulo the crc polynomial */
+static uint32_t crc32_x2n_tab[32];
+
+/* a * b modulo the crc polynomial, in the reflected bit order */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31;
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+
+	return p;
+}
+
+/* x^(n * 2^k) modulo the crc polynomial */
+static uint32_t crc32_x2nmodp(uint64_t n, unsigned int k)
 {
-        const uint8_t *p = buf;
-        uint32_t crc;
+	uint32_t p = 1U << 31;
+
+	while (n) {
+		if (n & 1)
+			p = crc32_multmodp(crc32_x2n_tab[k & 31], p);
+		n >>= 1;
+		k++;
+	}
 
-        crc = crc_in ^ ~0U;
-        while (size--)
-                crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
-        return crc ^ ~0U;
+	return p;
 }
 
+static void crc32_x2n_init(void)
+{
+	uint32_t p = 1U << 30;
+	int n;
+
+	crc32_x2n_tab[0] = p;
+	for (n = 1; n < 32; n++)
+		crc32_x2n_tab[n] = p = crc32_multmodp(p, p);
+}
+
+static void crc32_init(void)
+{
+	crc32_slice8_init();
+	crc32_x2n_init();
+
+#ifdef CRC32_PCLMUL
+	crc32_use_pclmul = crc32_have_pclmul();
+	if (crc32_use_pclmul && crc32_selftest()) {
+		fprintf(stderr, "sparse_crc32: pclmul self test failed\n");
+		crc32_use_pclmul = 0;
+	}
+#endif
+
+	if (crc32_selftest()) {
+		fprintf(stderr, "sparse_crc32: slice-by-8 self test failed\n");
+		return;
+	}
+
+	crc32_impl = crc32_fast;
+}
+
+uint32_t sparse_crc32(uint32_t crc_in, const void *buf, size_t size)
+{
+	pthread_once(&crc32_once, crc32_init);
+
+	return crc32_impl(crc_in ^ ~0U, buf, size) ^ ~0U;
+}
+
+uint32_t sparse_crc32_combine(uint32_t crc1, uint32_t crc2, int64_t len2)
+{
+	pthread_once(&crc32_once, crc32_init);
+
+	return crc32_multmodp(crc32_x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+uint32_t sparse_crc32_fill(uint32_t crc_in, uint32_t fill_val, int64_t len)
+{
+	uint32_t pat_crc, crc = 0;
+	int64_t pat_len = sizeof(fill_val);
+	int64_t crc_len = 0;
+	uint64_t n = len / sizeof(fill_val);
+
+	pthread_once(&crc32_once, crc32_init);
+
+	/*
+	 * Every repetition of the pattern is the same, so the crc of the whole
+	 * run is built by doubling the pattern and appending the doubled runs
+	 * that make up the binary representation of the count.
+	 */
+	pat_crc = sparse_crc32(0, &fill_val, sizeof(fill_val));
+	while (n) {
+		if (n & 1) {
+			crc = sparse_crc32_combine(crc, pat_crc, pat_len);
+			crc_len += pat_len;
+		}
+		n >>= 1;
+		if (n) {
+			pat_crc = sparse_crc32_combine(pat_crc, pat_crc, pat_len);
+			pat_len *= 2;
+		}
+	}
+
+	crc = sparse_crc32_combine(crc_in, crc, crc_len);
+
+	return sparse_crc32(crc, &fill_val, len % sizeof(fill_val));
+}
@@ -14,7 +14,14 @@
  * limitations under the License.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 uint32_t sparse_crc32(uint32_t crc, const void *buf, size_t size);
 
+/* crc of the concatenation of two buffers from their crcs */
+uint32_t sparse_crc32_combine(uint32_t crc1, uint32_t crc2, int64_t len2);
+
+/* crc after len bytes of fill_val repeated, in O(log len) */
+uint32_t sparse_crc32_fill(uint32_t crc, uint32_t fill_val, int64_t len);
+
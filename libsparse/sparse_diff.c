@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sparse/sparse.h>
+
+#include "sparse_defs.h"
+#include "sparse_file.h"
+#include "sparse_index.h"
+
+/*
+ * Both images are compared a window of blocks at a time.  The window is
+ * split between the threads, each reads its share of both images in
+ * batches and marks the blocks that differ.  Reads go through
+ * sparse_file_read_blocks, which only uses pread, so the threads can
+ * share the sparse files.
+ */
+#define DIFF_BATCH_BLOCKS 256
+#define DIFF_WINDOW_BLOCKS 65536
+/* keep the fd ranges of the result small enough to map on 32 bit hosts */
+#define DIFF_MAX_RUN (64U * 1024U * 1024U)
+
+#define min(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
+
+enum diff_type {
+	DIFF_SAME,
+	DIFF_DATA,
+	DIFF_FILL,
+};
+
+struct diff_job {
+	struct sparse_file *old;
+	struct sparse_file *new;
+	unsigned int first;
+	unsigned int count;
+	unsigned int old_blocks;
+	uint8_t *changed;
+	uint32_t *vals;
+	bool threaded;
+	int ret;
+};
+
+static void *diff_blocks(void *arg)
+{
+	struct diff_job *job = arg;
+	unsigned int block_size = job->new->block_size;
+	size_t batch = (size_t)DIFF_BATCH_BLOCKS * block_size;
+	unsigned int done = 0;
+	unsigned int block;
+	unsigned int blocks;
+	unsigned int same;
+	unsigned int i;
+	char *old_buf;
+	char *new_buf;
+	int ret = 0;
+
+	old_buf = malloc(batch);
+	new_buf = malloc(batch);
+	if (!old_buf || !new_buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (done < job->count) {
+		block = job->first + done;
+		blocks = min(job->count - done, (unsigned int)DIFF_BATCH_BLOCKS);
+
+		ret = sparse_file_read_blocks(job->new, block, blocks, new_buf);
+		if (ret < 0) {
+			goto out;
+		}
+
+		/* blocks past the end of the old image always changed */
+		same = 0;
+		if (block < job->old_blocks) {
+			same = min(blocks, job->old_blocks - block);
+			ret = sparse_file_read_blocks(job->old, block, same, old_buf);
+			if (ret < 0) {
+				goto out;
+			}
+		}
+
+		/* memcmp is vectorised by the C library */
+		for (i = 0; i < blocks; i++) {
+			char *new_block = new_buf + (size_t)i * block_size;
+			unsigned int n = done + i;
+
+			if (i < same && !memcmp(old_buf + (size_t)i * block_size,
+					new_block, block_size)) {
+				job->changed[n] = DIFF_SAME;
+			} else if (!memcmp(new_block, new_block + sizeof(uint32_t),
+					block_size - sizeof(uint32_t))) {
+				job->changed[n] = DIFF_FILL;
+				memcpy(&job->vals[n], new_block, sizeof(uint32_t));
+			} else {
+				job->changed[n] = DIFF_DATA;
+			}
+		}
+
+		done += blocks;
+	}
+
+out:
+	free(new_buf);
+	free(old_buf);
+	job->ret = ret;
+	return NULL;
+}
+
+static int add_run(struct sparse_file *s, struct sparse_file *new,
+		enum diff_type type, uint32_t val, unsigned int block,
+		unsigned int count)
+{
+	int64_t len;
+
+	switch (type) {
+	case DIFF_DATA:
+		return sparse_file_copy_blocks(s, new, block, count);
+	case DIFF_FILL:
+		len = min((int64_t)count * s->block_size,
+				s->len - (int64_t)block * s->block_size);
+		return sparse_file_add_fill(s, val, len, block);
+	default:
+		return 0;
+	}
+}
+
+struct sparse_file *sparse_file_diff(struct sparse_file *old,
+		struct sparse_file *new, unsigned int threads)
+{
+	unsigned int block_size = new->block_size;
+	unsigned int total = DIV_ROUND_UP(new->len, block_size);
+	unsigned int window = min(total, (unsigned int)DIFF_WINDOW_BLOCKS);
+	unsigned int max_run = DIFF_MAX_RUN / block_size;
+	struct sparse_file *s;
+	struct diff_job *jobs = NULL;
+	pthread_t *tids = NULL;
+	uint8_t *changed = NULL;
+	uint32_t *vals = NULL;
+	enum diff_type run_type = DIFF_SAME;
+	uint32_t run_val = 0;
+	unsigned int run_start = 0;
+	unsigned int run_len = 0;
+	unsigned int base;
+	unsigned int i, t;
+	int ret = 0;
+
+	if (old->block_size != block_size || block_size > DIFF_MAX_RUN) {
+		return NULL;
+	}
+
+	s = sparse_file_new(block_size, new->len);
+	if (!s) {
+		return NULL;
+	}
+
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	jobs = calloc(threads, sizeof(struct diff_job));
+	tids = calloc(threads, sizeof(pthread_t));
+	changed = malloc(window ? window : 1);
+	vals = malloc((window ? window : 1) * sizeof(uint32_t));
+	if (!jobs || !tids || !changed || !vals) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (base = 0; base < total; base += window) {
+		unsigned int count = min(total - base, window);
+		unsigned int per_thread = DIV_ROUND_UP(count, threads);
+
+		for (t = 0; t < threads && t * per_thread < count; t++) {
+			struct diff_job *job = &jobs[t];
+
+			job->old = old;
+			job->new = new;
+			job->first = base + t * per_thread;
+			job->count = min(per_thread, count - t * per_thread);
+			job->old_blocks = DIV_ROUND_UP(old->len, block_size);
+			job->changed = changed + t * per_thread;
+			job->vals = vals + t * per_thread;
+			job->ret = -EINVAL;
+			job->threaded = t > 0 &&
+				!pthread_create(&tids[t], NULL, diff_blocks, job);
+		}
+
+		for (t = 0; t < threads && t * per_thread < count; t++) {
+			if (jobs[t].threaded) {
+				pthread_join(tids[t], NULL);
+			} else {
+				diff_blocks(&jobs[t]);
+			}
+			if (jobs[t].ret < 0) {
+				ret = jobs[t].ret;
+			}
+		}
+		if (ret < 0) {
+			goto out;
+		}
+
+		/*
+		 * runs of changed data take their contents from the new image,
+		 * changed blocks of one value become fill chunks
+		 */
+		for (i = 0; i < count; i++) {
+			if (changed[i] == run_type && run_start + run_len == base + i &&
+					(run_type != DIFF_FILL || vals[i] == run_val) &&
+					run_len < max_run) {
+				run_len++;
+				continue;
+			}
+			ret = add_run(s, new, run_type, run_val, run_start, run_len);
+			if (ret < 0) {
+				goto out;
+			}
+			run_type = changed[i];
+			run_val = vals[i];
+			run_start = base + i;
+			run_len = 1;
+		}
+	}
+
+	ret = add_run(s, new, run_type, run_val, run_start, run_len);
+
+out:
+	free(vals);
+	free(changed);
+	free(tids);
+	free(jobs);
+	if (ret < 0) {
+		sparse_file_destroy(s);
+		return NULL;
+	}
+	return s;
+}
@@ -23,9 +23,13 @@ struct sparse_file {
 	unsigned int block_size;
 	int64_t len;
 	bool verbose;
+	unsigned int write_buffer;
+	unsigned int threads;
+	bool skip_zeros;
 
 	struct backed_block_list *backed_block_list;
 	struct output_file *out;
+	struct sparse_index *index;
 };
 
 
@@ -0,0 +1,722 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#define _LARGEFILE64_SOURCE 1
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sparse/sparse.h>
+
+#include "backed_block.h"
+#include "sparse_defs.h"
+#include "sparse_file.h"
+#include "sparse_format.h"
+#include "sparse_index.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define SPARSE_HEADER_MAJOR_VER 1
+
+#define SPARSE_INDEX_MAGIC 0x58444953 /* "SIDX" */
+#define SPARSE_INDEX_VERSION 2
+
+/* chunk headers are read through a window of this size */
+#define HEADER_WINDOW_SIZE (64 * 1024)
+
+#define min(a, b) \
+	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
+
+/*
+ * One entry per chunk that covers output blocks, sorted by block.  The
+ * chunk runs up to the block of the next entry, the last entry is a
+ * sentinel at total_blks.  data is the file offset of a raw chunk's data
+ * or the value of a fill chunk.
+ */
+struct sparse_index_entry {
+	uint32_t block;
+	uint32_t type;
+	int64_t data;
+};
+
+/*
+ * sidecar file header, followed by nr_entries entries.  The size, mtime
+ * and inode of the image tell a rewritten image from the indexed one.
+ */
+struct sparse_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+	int64_t image_size;
+	int64_t image_mtime;
+	uint64_t image_ino;
+	uint32_t image_mtime_nsec;
+	uint32_t nr_entries;
+};
+
+struct sparse_index {
+	int fd;
+	struct sparse_index_header hdr;
+	struct sparse_index_entry *entries;
+};
+
+struct header_window {
+	int fd;
+	char *buf;
+	int64_t start;
+	unsigned int len;
+};
+
+static int pread_all(int fd, void *buf, size_t len, int64_t offset)
+{
+	char *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, ptr, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		if (ret == 0) {
+			return -EINVAL;
+		}
+		ptr += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Return len bytes at offset.  Fill and don't care chunks are packed
+ * together, so most headers come out of the window already read.
+ */
+static void *window_get(struct header_window *w, int64_t offset,
+		unsigned int len)
+{
+	ssize_t ret;
+
+	if (offset < w->start || offset + len > w->start + w->len) {
+		do {
+			ret = pread(w->fd, w->buf, HEADER_WINDOW_SIZE, offset);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0) {
+			return NULL;
+		}
+		w->start = offset;
+		w->len = ret;
+		if (ret < len) {
+			return NULL;
+		}
+	}
+
+	return w->buf + (offset - w->start);
+}
+
+static int add_entry(struct sparse_index *idx, unsigned int *alloc,
+		uint32_t block, uint32_t type, int64_t data)
+{
+	struct sparse_index_entry *entries;
+
+	if (idx->hdr.nr_entries == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 64;
+		entries = realloc(idx->entries, *alloc * sizeof(*entries));
+		if (!entries) {
+			return -ENOMEM;
+		}
+		idx->entries = entries;
+	}
+
+	idx->entries[idx->hdr.nr_entries].block = block;
+	idx->entries[idx->hdr.nr_entries].type = type;
+	idx->entries[idx->hdr.nr_entries].data = data;
+	idx->hdr.nr_entries++;
+
+	return 0;
+}
+
+/* One pass over the chunk headers, skipping all chunk data */
+static int index_build(struct sparse_index *idx, sparse_header_t *sparse_header)
+{
+	struct header_window w = { .fd = idx->fd };
+	chunk_header_t *chunk_header;
+	unsigned int alloc = 0;
+	unsigned int block = 0;
+	int64_t offset = sparse_header->file_hdr_sz;
+	unsigned int data_sz;
+	unsigned int i;
+	uint32_t *fill_val;
+	int ret = 0;
+
+	w.buf = malloc(HEADER_WINDOW_SIZE);
+	if (!w.buf) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < sparse_header->total_chunks; i++) {
+		chunk_header = window_get(&w, offset, sizeof(chunk_header_t));
+		if (!chunk_header) {
+			ret = -EINVAL;
+			break;
+		}
+
+		if (chunk_header->total_sz < sparse_header->chunk_hdr_sz ||
+				chunk_header->chunk_sz > sparse_header->total_blks - block) {
+			ret = -EINVAL;
+			break;
+		}
+		data_sz = chunk_header->total_sz - sparse_header->chunk_hdr_sz;
+
+		switch (chunk_header->chunk_type) {
+		case CHUNK_TYPE_RAW:
+			if (data_sz != (int64_t)chunk_header->chunk_sz * sparse_header->blk_sz) {
+				ret = -EINVAL;
+				break;
+			}
+			ret = add_entry(idx, &alloc, block, CHUNK_TYPE_RAW,
+					offset + sparse_header->chunk_hdr_sz);
+			break;
+		case CHUNK_TYPE_FILL:
+			fill_val = window_get(&w, offset + sparse_header->chunk_hdr_sz,
+					sizeof(uint32_t));
+			if (data_sz != sizeof(uint32_t) || !fill_val) {
+				ret = -EINVAL;
+				break;
+			}
+			ret = add_entry(idx, &alloc, block, CHUNK_TYPE_FILL, *fill_val);
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+			ret = add_entry(idx, &alloc, block, CHUNK_TYPE_DONT_CARE, 0);
+			break;
+		case CHUNK_TYPE_CRC32:
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+		if (ret < 0) {
+			break;
+		}
+
+		if (chunk_header->chunk_type != CHUNK_TYPE_CRC32) {
+			block += chunk_header->chunk_sz;
+		}
+		offset += chunk_header->total_sz;
+	}
+
+	if (!ret && block != sparse_header->total_blks) {
+		ret = -EINVAL;
+	}
+	if (!ret) {
+		ret = add_entry(idx, &alloc, block, CHUNK_TYPE_DONT_CARE, 0);
+	}
+
+	free(w.buf);
+	return ret;
+}
+
+/*
+ * Entries must start at block 0 and increase up to the sentinel, and raw
+ * data must lie inside the image, or reads would go astray
+ */
+static int index_check(struct sparse_index *idx, uint32_t nr_entries)
+{
+	struct sparse_index_entry *e = idx->entries;
+	uint32_t i;
+
+	if (e[0].block != 0 || e[nr_entries - 1].block != idx->hdr.total_blks) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < nr_entries - 1; i++) {
+		if (e[i + 1].block <= e[i].block) {
+			return -EINVAL;
+		}
+
+		switch (e[i].type) {
+		case CHUNK_TYPE_RAW:
+			if (e[i].data < 0 || e[i].data > idx->hdr.image_size ||
+					(int64_t)(e[i + 1].block - e[i].block) * idx->hdr.blk_sz >
+					idx->hdr.image_size - e[i].data) {
+				return -EINVAL;
+			}
+			break;
+		case CHUNK_TYPE_FILL:
+		case CHUNK_TYPE_DONT_CARE:
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int index_load(struct sparse_index *idx, const char *path)
+{
+	struct sparse_index_header hdr;
+	uint32_t nr_entries;
+	size_t size;
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	ret = pread_all(fd, &hdr, sizeof(hdr), 0);
+	if (ret < 0) {
+		goto out;
+	}
+
+	/* a stale sidecar of a rewritten image must not be used */
+	nr_entries = hdr.nr_entries;
+	hdr.nr_entries = 0;
+	if (memcmp(&hdr, &idx->hdr, sizeof(hdr))) {
+		ret = -ESTALE;
+		goto out;
+	}
+
+	if (nr_entries == 0 || nr_entries > idx->hdr.total_chunks + 1) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	size = nr_entries * sizeof(struct sparse_index_entry);
+	idx->entries = malloc(size);
+	if (!idx->entries) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = pread_all(fd, idx->entries, size, sizeof(hdr));
+	if (ret < 0) {
+		goto out;
+	}
+
+	ret = index_check(idx, nr_entries);
+	if (ret < 0) {
+		goto out;
+	}
+	idx->hdr.nr_entries = nr_entries;
+
+out:
+	close(fd);
+	return ret;
+}
+
+/* Write to a temporary file first so readers never see a partial index */
+static int index_save(struct sparse_index *idx, const char *path)
+{
+	struct sparse_index_header hdr = idx->hdr;
+	size_t size = idx->hdr.nr_entries * sizeof(struct sparse_index_entry);
+	char *tmp;
+	int fd;
+	int ret = 0;
+
+	if (asprintf(&tmp, "%s.tmp", path) < 0) {
+		return -ENOMEM;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		free(tmp);
+		return ret;
+	}
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			write(fd, idx->entries, size) != (ssize_t)size) {
+		ret = -EIO;
+	}
+	if (close(fd) < 0 && !ret) {
+		ret = -errno;
+	}
+
+	if (!ret && rename(tmp, path) < 0) {
+		ret = -errno;
+	}
+	if (ret) {
+		unlink(tmp);
+	}
+
+	free(tmp);
+	return ret;
+}
+
+void sparse_index_destroy(struct sparse_index *idx)
+{
+	free(idx->entries);
+	free(idx);
+}
+
+struct sparse_file *sparse_file_import_index(int fd, const char *index_path,
+		bool verbose)
+{
+	sparse_header_t sparse_header;
+	struct sparse_index *idx;
+	struct sparse_file *s;
+	struct stat st;
+	int ret;
+
+	ret = pread_all(fd, &sparse_header, sizeof(sparse_header), 0);
+	if (ret < 0 || fstat(fd, &st) < 0) {
+		return NULL;
+	}
+
+	if (sparse_header.magic != SPARSE_HEADER_MAGIC ||
+			sparse_header.major_version != SPARSE_HEADER_MAJOR_VER ||
+			sparse_header.file_hdr_sz < sizeof(sparse_header_t) ||
+			sparse_header.chunk_hdr_sz < sizeof(chunk_header_t) ||
+			sparse_header.blk_sz == 0 || sparse_header.blk_sz % 4) {
+		if (verbose) {
+			sparse_print_verbose("Invalid sparse file format at header\n");
+		}
+		return NULL;
+	}
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx) {
+		return NULL;
+	}
+
+	idx->fd = fd;
+	idx->hdr.magic = SPARSE_INDEX_MAGIC;
+	idx->hdr.version = SPARSE_INDEX_VERSION;
+	idx->hdr.blk_sz = sparse_header.blk_sz;
+	idx->hdr.total_blks = sparse_header.total_blks;
+	idx->hdr.total_chunks = sparse_header.total_chunks;
+	idx->hdr.image_checksum = sparse_header.image_checksum;
+	idx->hdr.image_size = st.st_size;
+	idx->hdr.image_mtime = st.st_mtim.tv_sec;
+	idx->hdr.image_mtime_nsec = st.st_mtim.tv_nsec;
+	idx->hdr.image_ino = st.st_ino;
+
+	ret = -ENOENT;
+	if (index_path) {
+		ret = index_load(idx, index_path);
+		if (ret < 0) {
+			free(idx->entries);
+			idx->entries = NULL;
+			idx->hdr.nr_entries = 0;
+		}
+	}
+
+	if (ret < 0) {
+		ret = index_build(idx, &sparse_header);
+		if (ret < 0) {
+			if (verbose) {
+				sparse_print_verbose("Invalid sparse file format at chunk %u\n",
+						idx->hdr.nr_entries);
+			}
+			sparse_index_destroy(idx);
+			return NULL;
+		}
+
+		if (index_path && index_save(idx, index_path) < 0 && verbose) {
+			sparse_print_verbose("Cannot write index %s\n", index_path);
+		}
+	}
+
+	s = sparse_file_new(sparse_header.blk_sz,
+			(int64_t)sparse_header.total_blks * sparse_header.blk_sz);
+	if (!s) {
+		sparse_index_destroy(idx);
+		return NULL;
+	}
+
+	s->verbose = verbose;
+	s->index = idx;
+
+	return s;
+}
+
+static void fill_buf(void *buf, size_t len, uint32_t fill_val)
+{
+	uint32_t *ptr = buf;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(uint32_t); i++) {
+		ptr[i] = fill_val;
+	}
+}
+
+/* Last entry starting at or before block */
+static unsigned int index_find(struct sparse_index *idx, unsigned int block)
+{
+	unsigned int lo = 0;
+	unsigned int hi = idx->hdr.nr_entries - 1;
+	unsigned int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (idx->entries[mid].block <= block) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return lo;
+}
+
+static int index_read_blocks(struct sparse_index *idx, unsigned int block,
+		unsigned int count, char *buf)
+{
+	unsigned int block_size = idx->hdr.blk_sz;
+	struct sparse_index_entry *e;
+	unsigned int i = index_find(idx, block);
+	unsigned int n;
+	size_t len;
+	int ret;
+
+	while (count) {
+		e = &idx->entries[i];
+		n = min(idx->entries[i + 1].block - block, count);
+		len = (size_t)n * block_size;
+
+		switch (e->type) {
+		case CHUNK_TYPE_RAW:
+			ret = pread_all(idx->fd, buf, len,
+					e->data + (int64_t)(block - e->block) * block_size);
+			if (ret < 0) {
+				return ret;
+			}
+			break;
+		case CHUNK_TYPE_FILL:
+			fill_buf(buf, len, e->data);
+			break;
+		default:
+			memset(buf, 0, len);
+			break;
+		}
+
+		buf += len;
+		block += n;
+		count -= n;
+		i++;
+	}
+
+	return 0;
+}
+
+static int bb_read(struct backed_block *bb, int64_t offset, char *buf,
+		size_t len)
+{
+	int fd;
+	int ret;
+
+	switch (backed_block_type(bb)) {
+	case BACKED_BLOCK_DATA:
+		memcpy(buf, (char *)backed_block_data(bb) + offset, len);
+		return 0;
+	case BACKED_BLOCK_FILL:
+		fill_buf(buf, len, backed_block_fill_val(bb));
+		return 0;
+	case BACKED_BLOCK_FD:
+		return pread_all(backed_block_fd(bb), buf, len,
+				backed_block_file_offset(bb) + offset);
+	case BACKED_BLOCK_FILE:
+		fd = open(backed_block_filename(bb), O_RDONLY | O_BINARY);
+		if (fd < 0) {
+			return -errno;
+		}
+		ret = pread_all(fd, buf, len, backed_block_file_offset(bb) + offset);
+		close(fd);
+		return ret;
+	}
+
+	return -EINVAL;
+}
+
+/* Files built in memory are read from their backed blocks */
+static int list_read_blocks(struct sparse_file *s, unsigned int block,
+		unsigned int count, char *buf)
+{
+	struct backed_block *bb;
+	int64_t start = (int64_t)block * s->block_size;
+	int64_t end = start + (int64_t)count * s->block_size;
+	int64_t bb_start;
+	int64_t bb_end;
+	int64_t from;
+	int64_t to;
+	int ret;
+
+	memset(buf, 0, end - start);
+
+	for (bb = backed_block_iter_find(s->backed_block_list, block); bb;
+			bb = backed_block_iter_next(bb)) {
+		bb_start = (int64_t)backed_block_block(bb) * s->block_size;
+		bb_end = bb_start + backed_block_len(bb);
+		if (bb_start >= end) {
+			break;
+		}
+		if (bb_end <= start) {
+			continue;
+		}
+
+		from = bb_start > start ? bb_start : start;
+		to = bb_end < end ? bb_end : end;
+		ret = bb_read(bb, from - bb_start, buf + (from - start), to - from);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int sparse_file_read_blocks(struct sparse_file *s, unsigned int block,
+		unsigned int count, void *buf)
+{
+	if (block > DIV_ROUND_UP(s->len, s->block_size) ||
+			count > DIV_ROUND_UP(s->len, s->block_size) - block) {
+		return -EINVAL;
+	}
+
+	if (s->index) {
+		return index_read_blocks(s->index, block, count, buf);
+	}
+
+	return list_read_blocks(s, block, count, buf);
+}
+
+static int index_copy_blocks(struct sparse_file *to, struct sparse_index *idx,
+		unsigned int block, unsigned int count)
+{
+	unsigned int block_size = idx->hdr.blk_sz;
+	struct sparse_index_entry *e;
+	unsigned int i = index_find(idx, block);
+	unsigned int n;
+	unsigned int len;
+	int ret = 0;
+
+	while (count) {
+		e = &idx->entries[i];
+		n = min(idx->entries[i + 1].block - block, count);
+		len = n * block_size;
+
+		switch (e->type) {
+		case CHUNK_TYPE_RAW:
+			ret = sparse_file_add_fd(to, idx->fd,
+					e->data + (int64_t)(block - e->block) * block_size,
+					len, block);
+			break;
+		case CHUNK_TYPE_FILL:
+			ret = sparse_file_add_fill(to, e->data, len, block);
+			break;
+		default:
+			break;
+		}
+		if (ret < 0) {
+			return ret;
+		}
+
+		block += n;
+		count -= n;
+		i++;
+	}
+
+	return 0;
+}
+
+static int list_copy_blocks(struct sparse_file *to, struct sparse_file *s,
+		unsigned int block, unsigned int count)
+{
+	struct backed_block *bb;
+	int64_t start = (int64_t)block * s->block_size;
+	int64_t end = start + (int64_t)count * s->block_size;
+	int64_t bb_start;
+	int64_t bb_end;
+	int64_t from;
+	int64_t to_end;
+	unsigned int len;
+	unsigned int to_block;
+	int ret = 0;
+
+	for (bb = backed_block_iter_find(s->backed_block_list, block); bb;
+			bb = backed_block_iter_next(bb)) {
+		bb_start = (int64_t)backed_block_block(bb) * s->block_size;
+		bb_end = bb_start + backed_block_len(bb);
+		if (bb_start >= end) {
+			break;
+		}
+		if (bb_end <= start) {
+			continue;
+		}
+
+		from = bb_start > start ? bb_start : start;
+		to_end = bb_end < end ? bb_end : end;
+		len = to_end - from;
+		to_block = from / s->block_size;
+
+		switch (backed_block_type(bb)) {
+		case BACKED_BLOCK_DATA:
+			ret = sparse_file_add_data(to,
+					(char *)backed_block_data(bb) + (from - bb_start),
+					len, to_block);
+			break;
+		case BACKED_BLOCK_FILL:
+			ret = sparse_file_add_fill(to, backed_block_fill_val(bb), len,
+					to_block);
+			break;
+		case BACKED_BLOCK_FD:
+			ret = sparse_file_add_fd(to, backed_block_fd(bb),
+					backed_block_file_offset(bb) + (from - bb_start),
+					len, to_block);
+			break;
+		case BACKED_BLOCK_FILE:
+			ret = sparse_file_add_file(to, backed_block_filename(bb),
+					backed_block_file_offset(bb) + (from - bb_start),
+					len, to_block);
+			break;
+		}
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int sparse_file_copy_blocks(struct sparse_file *to, struct sparse_file *from,
+		unsigned int block, unsigned int count)
+{
+	if (from->index) {
+		return index_copy_blocks(to, from->index, block, count);
+	}
+
+	return list_copy_blocks(to, from, block, count);
+}
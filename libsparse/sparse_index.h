@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBSPARSE_SPARSE_INDEX_H_
+#define _LIBSPARSE_SPARSE_INDEX_H_
+
+struct sparse_file;
+struct sparse_index;
+
+void sparse_index_destroy(struct sparse_index *idx);
+
+/*
+ * Add blocks [block, block + count) of from to the sparse file to, at the
+ * same place.  The new blocks refer to the data of from, nothing is copied,
+ * and don't care regions are left out.
+ */
+int sparse_file_copy_blocks(struct sparse_file *to, struct sparse_file *from,
+		unsigned int block, unsigned int count);
+
+#endif /* _LIBSPARSE_SPARSE_INDEX_H_ */
@@ -19,6 +19,7 @@
 #define _LARGEFILE64_SOURCE 1
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -137,11 +138,8 @@ static int process_fill_chunk(struct sparse_file *s, unsigned int chunk_size,
 		int fd, unsigned int blocks, unsigned int block, uint32_t *crc32)
 {
 	int ret;
-	int chunk;
 	int64_t len = (int64_t)blocks * s->block_size;
 	uint32_t fill_val;
-	uint32_t *fillbuf;
-	unsigned int i;
 
 	if (chunk_size != sizeof(fill_val)) {
 		return -EINVAL;
@@ -158,17 +156,7 @@ static int process_fill_chunk(struct sparse_file *s, unsigned int chunk_size,
 	}
 
 	if (crc32) {
-		/* Fill copy_buf with the fill value */
-		fillbuf = (uint32_t *)copybuf;
-		for (i = 0; i < (COPY_BUF_SIZE / sizeof(fill_val)); i++) {
-			fillbuf[i] = fill_val;
-		}
-
-		while (len) {
-			chunk = min(len, COPY_BUF_SIZE);
-			*crc32 = sparse_crc32(*crc32, copybuf, chunk);
-			len -= chunk;
-		}
+		*crc32 = sparse_crc32_fill(*crc32, fill_val, len);
 	}
 
 	return 0;
@@ -177,31 +165,21 @@ static int process_fill_chunk(struct sparse_file *s, unsigned int chunk_size,
 static int process_skip_chunk(struct sparse_file *s, unsigned int chunk_size,
 		int fd, unsigned int blocks, unsigned int block, uint32_t *crc32)
 {
-	int ret;
-	int chunk;
 	int64_t len = (int64_t)blocks * s->block_size;
-	uint32_t fill_val;
-	uint32_t *fillbuf;
-	unsigned int i;
 
 	if (chunk_size != 0) {
 		return -EINVAL;
 	}
 
 	if (crc32) {
-		memset(copybuf, 0, COPY_BUF_SIZE);
-
-		while (len) {
-			chunk = min(len, COPY_BUF_SIZE);
-			*crc32 = sparse_crc32(*crc32, copybuf, chunk);
-			len -= chunk;
-		}
+		*crc32 = sparse_crc32_fill(*crc32, 0, len);
 	}
 
 	return 0;
 }
 
-static int process_crc32_chunk(int fd, unsigned int chunk_size, uint32_t crc32)
+static int process_crc32_chunk(int fd, unsigned int chunk_size,
+		uint32_t *crc_ptr)
 {
 	uint32_t file_crc32;
 	int ret;
@@ -215,7 +193,7 @@ static int process_crc32_chunk(int fd, unsigned int chunk_size, uint32_t crc32)
 		return ret;
 	}
 
-	if (file_crc32 != crc32) {
+	if (crc_ptr && file_crc32 != *crc_ptr) {
 		return -EINVAL;
 	}
 
@@ -259,7 +237,7 @@ static int process_chunk(struct sparse_file *s, int fd, off64_t offset,
 			}
 			return chunk_header->chunk_sz;
 		case CHUNK_TYPE_CRC32:
-			ret = process_crc32_chunk(fd, chunk_data_size, *crc_ptr);
+			ret = process_crc32_chunk(fd, chunk_data_size, crc_ptr);
 			if (ret < 0) {
 				verbose_error(s->verbose, -EINVAL, "crc block at %lld",
 						offset);
@@ -356,57 +334,597 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
 	return 0;
 }
 
-static int sparse_file_read_normal(struct sparse_file *s, int fd)
+enum sparse_push_step {
+	PUSH_FILE_HEADER,
+	PUSH_CHUNK_HEADER,
+	PUSH_RAW_DATA,
+	PUSH_FILL_DATA,
+	PUSH_CRC_DATA,
+	PUSH_ERROR,
+};
+
+struct sparse_push {
+	const struct sparse_push_ops *ops;
+	void *priv;
+	bool verbose;
+	bool crc;
+	uint32_t crc32;
+
+	enum sparse_push_step step;
+	uint8_t hdr[SPARSE_HEADER_LEN];
+	unsigned int hdr_len;
+	unsigned int hdr_need;
+	int64_t skip;
+	int64_t offset;
+
+	sparse_header_t sparse_header;
+	chunk_header_t chunk_header;
+	unsigned int chunks;
+	unsigned int cur_block;
+	unsigned int raw_done;
+	unsigned int raw_len;
+};
+
+struct sparse_push *sparse_push_new(const struct sparse_push_ops *ops,
+		void *priv, bool verbose, bool crc)
 {
-	int ret;
-	uint32_t *buf = malloc(s->block_size);
-	unsigned int block = 0;
-	int64_t remain = s->len;
-	int64_t offset = 0;
-	unsigned int to_read;
-	char *ptr;
-	unsigned int i;
-	bool sparse_block;
+	struct sparse_push *p;
 
-	if (!buf) {
-		return -ENOMEM;
+	p = calloc(1, sizeof(struct sparse_push));
+	if (!p) {
+		return NULL;
 	}
 
-	while (remain > 0) {
-		to_read = min(remain, s->block_size);
-		ret = read_all(fd, buf, to_read);
+	p->ops = ops;
+	p->priv = priv;
+	p->verbose = verbose;
+	p->crc = crc;
+	p->step = PUSH_FILE_HEADER;
+	p->hdr_need = SPARSE_HEADER_LEN;
+
+	return p;
+}
+
+void sparse_push_destroy(struct sparse_push *p)
+{
+	free(p);
+}
+
+static void push_next_chunk(struct sparse_push *p)
+{
+	p->step = PUSH_CHUNK_HEADER;
+	p->hdr_need = CHUNK_HEADER_LEN;
+}
+
+static int push_file_header(struct sparse_push *p)
+{
+	sparse_header_t *sparse_header = &p->sparse_header;
+
+	memcpy(sparse_header, p->hdr, SPARSE_HEADER_LEN);
+
+	if (sparse_header->magic != SPARSE_HEADER_MAGIC) {
+		verbose_error(p->verbose, -EINVAL, "header magic");
+		return -EINVAL;
+	}
+
+	if (sparse_header->major_version != SPARSE_HEADER_MAJOR_VER) {
+		verbose_error(p->verbose, -EINVAL, "header major version");
+		return -EINVAL;
+	}
+
+	if (sparse_header->file_hdr_sz < SPARSE_HEADER_LEN ||
+			sparse_header->chunk_hdr_sz < CHUNK_HEADER_LEN) {
+		verbose_error(p->verbose, -EINVAL, "header size");
+		return -EINVAL;
+	}
+
+	if (sparse_header->blk_sz == 0 || sparse_header->blk_sz % 4) {
+		verbose_error(p->verbose, -EINVAL, "header block size");
+		return -EINVAL;
+	}
+
+	if (p->ops->on_header) {
+		int ret = p->ops->on_header(p->priv, sparse_header->blk_sz,
+				sparse_header->total_blks, sparse_header->total_chunks);
 		if (ret < 0) {
-			error("failed to read sparse file");
 			return ret;
 		}
+	}
 
-		if (to_read == s->block_size) {
-			sparse_block = true;
-			for (i = 1; i < s->block_size / sizeof(uint32_t); i++) {
-				if (buf[0] != buf[i]) {
-					sparse_block = false;
-					break;
-				}
+	p->skip = sparse_header->file_hdr_sz - SPARSE_HEADER_LEN;
+	push_next_chunk(p);
+
+	return 0;
+}
+
+static int push_chunk_header(struct sparse_push *p)
+{
+	sparse_header_t *sparse_header = &p->sparse_header;
+	chunk_header_t *chunk_header = &p->chunk_header;
+	unsigned int chunk_data_size;
+	int64_t len;
+	int ret = 0;
+
+	memcpy(chunk_header, p->hdr, CHUNK_HEADER_LEN);
+
+	if (p->chunks == sparse_header->total_chunks) {
+		verbose_error(p->verbose, -EINVAL, "extra chunk at %lld", p->offset);
+		return -EINVAL;
+	}
+
+	if (chunk_header->total_sz < sparse_header->chunk_hdr_sz ||
+			chunk_header->chunk_sz > sparse_header->total_blks - p->cur_block) {
+		verbose_error(p->verbose, -EINVAL, "chunk size at %lld", p->offset);
+		return -EINVAL;
+	}
+
+	chunk_data_size = chunk_header->total_sz - sparse_header->chunk_hdr_sz;
+	len = (int64_t)chunk_header->chunk_sz * sparse_header->blk_sz;
+	p->skip = sparse_header->chunk_hdr_sz - CHUNK_HEADER_LEN;
+	p->chunks++;
+
+	switch (chunk_header->chunk_type) {
+		case CHUNK_TYPE_RAW:
+			if (chunk_data_size != len) {
+				verbose_error(p->verbose, -EINVAL, "data block at %lld",
+						p->offset);
+				return -EINVAL;
 			}
-		} else {
-			sparse_block = false;
+			p->raw_done = 0;
+			p->raw_len = chunk_data_size;
+			if (p->raw_len) {
+				p->step = PUSH_RAW_DATA;
+			} else {
+				push_next_chunk(p);
+			}
+			return 0;
+		case CHUNK_TYPE_FILL:
+			if (chunk_data_size != sizeof(uint32_t)) {
+				verbose_error(p->verbose, -EINVAL, "fill block at %lld",
+						p->offset);
+				return -EINVAL;
+			}
+			p->step = PUSH_FILL_DATA;
+			p->hdr_need = sizeof(uint32_t);
+			return 0;
+		case CHUNK_TYPE_DONT_CARE:
+			if (chunk_data_size != 0) {
+				verbose_error(p->verbose, -EINVAL, "skip block at %lld",
+						p->offset);
+				return -EINVAL;
+			}
+			if (p->ops->on_skip) {
+				ret = p->ops->on_skip(p->priv, p->cur_block,
+						chunk_header->chunk_sz);
+			}
+			if (p->crc) {
+				p->crc32 = sparse_crc32_fill(p->crc32, 0, len);
+			}
+			p->cur_block += chunk_header->chunk_sz;
+			push_next_chunk(p);
+			return ret;
+		case CHUNK_TYPE_CRC32:
+			if (chunk_data_size != sizeof(uint32_t)) {
+				verbose_error(p->verbose, -EINVAL, "crc block at %lld",
+						p->offset);
+				return -EINVAL;
+			}
+			p->step = PUSH_CRC_DATA;
+			p->hdr_need = sizeof(uint32_t);
+			return 0;
+		default:
+			verbose_error(p->verbose, -EINVAL, "unknown block %04X at %lld",
+					chunk_header->chunk_type, p->offset);
+			return -EINVAL;
+	}
+}
+
+static int push_chunk_data(struct sparse_push *p)
+{
+	chunk_header_t *chunk_header = &p->chunk_header;
+	uint32_t val;
+	int ret = 0;
+
+	memcpy(&val, p->hdr, sizeof(val));
+
+	if (p->step == PUSH_FILL_DATA) {
+		if (p->ops->on_fill) {
+			ret = p->ops->on_fill(p->priv, p->cur_block,
+					chunk_header->chunk_sz, val);
+		}
+		if (p->crc) {
+			p->crc32 = sparse_crc32_fill(p->crc32, val,
+					(int64_t)chunk_header->chunk_sz *
+					p->sparse_header.blk_sz);
 		}
+		p->cur_block += chunk_header->chunk_sz;
+	} else {
+		if (p->crc && val != p->crc32) {
+			verbose_error(p->verbose, -EINVAL, "crc block at %lld",
+					p->offset);
+			return -EINVAL;
+		}
+		if (p->ops->on_crc) {
+			ret = p->ops->on_crc(p->priv, val);
+		}
+	}
+
+	push_next_chunk(p);
+	return ret;
+}
+
+static int push_raw_data(struct sparse_push *p, const uint8_t *data,
+		unsigned int len)
+{
+	unsigned int block_size = p->sparse_header.blk_sz;
+	unsigned int block = p->cur_block + p->raw_done / block_size;
+	int ret = 0;
 
-		if (sparse_block) {
-			/* TODO: add flag to use skip instead of fill for buf[0] == 0 */
-			sparse_file_add_fill(s, buf[0], to_read, block);
+	if (p->ops->on_raw) {
+		ret = p->ops->on_raw(p->priv, block, p->raw_done % block_size,
+				data, len);
+	}
+	if (p->crc) {
+		p->crc32 = sparse_crc32(p->crc32, data, len);
+	}
+
+	p->raw_done += len;
+	if (p->raw_done == p->raw_len) {
+		p->cur_block += p->chunk_header.chunk_sz;
+		push_next_chunk(p);
+	}
+
+	return ret;
+}
+
+int sparse_push_data(struct sparse_push *p, const void *data, size_t len)
+{
+	const uint8_t *ptr = data;
+	unsigned int chunk;
+	int ret = 0;
+
+	if (p->step == PUSH_ERROR) {
+		return -EINVAL;
+	}
+
+	while (len) {
+		if (p->skip) {
+			chunk = min((int64_t)len, p->skip);
+			p->skip -= chunk;
+		} else if (p->step == PUSH_RAW_DATA) {
+			chunk = min(len, (size_t)(p->raw_len - p->raw_done));
+			ret = push_raw_data(p, ptr, chunk);
 		} else {
-			sparse_file_add_fd(s, fd, offset, to_read, block);
+			chunk = min(len, (size_t)(p->hdr_need - p->hdr_len));
+			memcpy(p->hdr + p->hdr_len, ptr, chunk);
+			p->hdr_len += chunk;
+			if (p->hdr_len == p->hdr_need) {
+				p->hdr_len = 0;
+				if (p->step == PUSH_FILE_HEADER) {
+					ret = push_file_header(p);
+				} else if (p->step == PUSH_CHUNK_HEADER) {
+					ret = push_chunk_header(p);
+				} else {
+					ret = push_chunk_data(p);
+				}
+			}
 		}
 
-		remain -= to_read;
-		offset += to_read;
-		block++;
+		if (ret < 0) {
+			p->step = PUSH_ERROR;
+			return ret;
+		}
+
+		ptr += chunk;
+		len -= chunk;
+		p->offset += chunk;
+	}
+
+	return 0;
+}
+
+int sparse_push_finish(struct sparse_push *p)
+{
+	if (p->step != PUSH_CHUNK_HEADER || p->hdr_len || p->skip ||
+			p->chunks != p->sparse_header.total_chunks) {
+		verbose_error(p->verbose, -EOVERFLOW, "chunk %u", p->chunks);
+		return -EINVAL;
+	}
+
+	if (p->cur_block != p->sparse_header.total_blks) {
+		verbose_error(p->verbose, -EINVAL, "block count %u", p->cur_block);
+		return -EINVAL;
 	}
 
 	return 0;
 }
 
+/*
+ * Raw images are scanned in windows of blocks.  The blocks of a window are
+ * split between the threads, each reads its share with large preads and
+ * marks the blocks that repeat one 32 bit value.  The main thread then
+ * turns the marks into runs of data, fill or skipped blocks.
+ */
+#define SCAN_READ_SIZE (1024U * 1024U)
+#define SCAN_WINDOW_BLOCKS 65536
+#define MAX_DATA_RUN (64U * 1024U * 1024U)
+#define MAX_FILL_RUN (1024U * 1024U * 1024U)
+
+struct scan_job {
+	int fd;
+	unsigned int block_size;
+	int64_t len;
+	unsigned int first;
+	unsigned int count;
+	uint8_t *uniform;
+	uint32_t *vals;
+	bool threaded;
+	int ret;
+};
+
+enum run_type {
+	RUN_NONE,
+	RUN_DATA,
+	RUN_FILL,
+	RUN_SKIP,
+};
+
+struct scan_run {
+	enum run_type type;
+	uint32_t val;
+	unsigned int block;
+	unsigned int len;
+};
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static bool block_is_uniform(const uint8_t *p, unsigned int len, uint32_t val)
+{
+	__m128i pat = _mm_set1_epi32(val);
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	unsigned int i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		acc = _mm_or_si128(acc, _mm_xor_si128(pat,
+				_mm_loadu_si128((const __m128i *)(p + i))));
+		acc = _mm_or_si128(acc, _mm_xor_si128(pat,
+				_mm_loadu_si128((const __m128i *)(p + i + 16))));
+		acc = _mm_or_si128(acc, _mm_xor_si128(pat,
+				_mm_loadu_si128((const __m128i *)(p + i + 32))));
+		acc = _mm_or_si128(acc, _mm_xor_si128(pat,
+				_mm_loadu_si128((const __m128i *)(p + i + 48))));
+		/* most data blocks differ early, don't scan them to the end */
+		if ((i & 255) == 0 &&
+				_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+			return false;
+		}
+	}
+
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+		return false;
+	}
+
+	for (; i < len; i += sizeof(uint32_t)) {
+		uint32_t word;
+
+		memcpy(&word, p + i, sizeof(word));
+		if (word != val) {
+			return false;
+		}
+	}
+
+	return true;
+}
+#else
+static bool block_is_uniform(const uint8_t *p, unsigned int len, uint32_t val)
+{
+	const uint32_t *w = (const uint32_t *)p;
+	unsigned int words = len / sizeof(uint32_t);
+	uint32_t acc = 0;
+	unsigned int i;
+
+	for (i = 0; i < words; i++) {
+		acc |= w[i] ^ val;
+		if ((i & 63) == 63 && acc) {
+			return false;
+		}
+	}
+
+	return acc == 0;
+}
+#endif
+
+static void *scan_blocks(void *arg)
+{
+	struct scan_job *job = arg;
+	unsigned int block_size = job->block_size;
+	unsigned int batch = ALIGN_DOWN(SCAN_READ_SIZE, block_size);
+	unsigned int done = 0;
+	uint8_t *buf;
+
+	if (batch == 0) {
+		batch = block_size;
+	}
+
+	buf = malloc(batch);
+	if (!buf) {
+		job->ret = -ENOMEM;
+		return NULL;
+	}
+
+	while (done < job->count) {
+		unsigned int blocks = min(job->count - done, batch / block_size);
+		int64_t offset = (int64_t)(job->first + done) * block_size;
+		size_t to_read = min((int64_t)blocks * block_size, job->len - offset);
+		size_t got = 0;
+		unsigned int i;
+
+		while (got < to_read) {
+			ssize_t ret = pread(job->fd, buf + got, to_read - got, offset + got);
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			}
+			if (ret <= 0) {
+				job->ret = ret < 0 ? -errno : -EINVAL;
+				free(buf);
+				return NULL;
+			}
+			got += ret;
+		}
+
+		for (i = 0; i < blocks; i++) {
+			uint8_t *p = buf + (size_t)i * block_size;
+			unsigned int n = done + i;
+
+			memcpy(&job->vals[n], p, sizeof(uint32_t));
+			job->uniform[n] = (size_t)(i + 1) * block_size <= got &&
+				block_is_uniform(p, block_size, job->vals[n]);
+		}
+
+		done += blocks;
+	}
+
+	free(buf);
+	job->ret = 0;
+	return NULL;
+}
+
+static int flush_run(struct sparse_file *s, int fd, struct scan_run *run)
+{
+	int64_t offset = (int64_t)run->block * s->block_size;
+	int ret = 0;
+
+	switch (run->type) {
+	case RUN_DATA:
+		ret = sparse_file_add_fd(s, fd, offset, run->len, run->block);
+		break;
+	case RUN_FILL:
+		ret = sparse_file_add_fill(s, run->val, run->len, run->block);
+		break;
+	default:
+		break;
+	}
+
+	run->type = RUN_NONE;
+
+	return ret;
+}
+
+static int add_block(struct sparse_file *s, int fd, struct scan_run *run,
+		unsigned int block, enum run_type type, uint32_t val,
+		unsigned int len)
+{
+	unsigned int max = type == RUN_DATA ? MAX_DATA_RUN : MAX_FILL_RUN;
+	int ret;
+
+	if (run->type == type && (type != RUN_FILL || run->val == val) &&
+			run->block + run->len / s->block_size == block &&
+			run->len <= max - len) {
+		run->len += len;
+		return 0;
+	}
+
+	ret = flush_run(s, fd, run);
+	if (ret < 0) {
+		return ret;
+	}
+
+	run->type = type;
+	run->val = val;
+	run->block = block;
+	run->len = len;
+
+	return 0;
+}
+
+static int sparse_file_read_normal(struct sparse_file *s, int fd)
+{
+	unsigned int threads = s->threads > 1 ? s->threads : 1;
+	unsigned int total = DIV_ROUND_UP(s->len, s->block_size);
+	unsigned int window = min(total, (unsigned int)SCAN_WINDOW_BLOCKS);
+	struct scan_job *jobs;
+	pthread_t *tids;
+	struct scan_run run = { .type = RUN_NONE };
+	uint8_t *uniform;
+	uint32_t *vals;
+	unsigned int base;
+	unsigned int i, t;
+	int ret = 0;
+
+	jobs = calloc(threads, sizeof(struct scan_job));
+	tids = calloc(threads, sizeof(pthread_t));
+	uniform = malloc(window ? window : 1);
+	vals = malloc((window ? window : 1) * sizeof(uint32_t));
+	if (!jobs || !tids || !uniform || !vals) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (base = 0; base < total; base += window) {
+		unsigned int count = min(total - base, window);
+		unsigned int per_thread = DIV_ROUND_UP(count, threads);
+
+		for (t = 0; t < threads && t * per_thread < count; t++) {
+			struct scan_job *job = &jobs[t];
+
+			job->fd = fd;
+			job->block_size = s->block_size;
+			job->len = s->len;
+			job->first = base + t * per_thread;
+			job->count = min(per_thread, count - t * per_thread);
+			job->uniform = uniform + t * per_thread;
+			job->vals = vals + t * per_thread;
+			job->ret = -EINVAL;
+			job->threaded = t > 0 &&
+				!pthread_create(&tids[t], NULL, scan_blocks, job);
+		}
+
+		/* the calling thread scans the first share, and any share a
+		 * thread couldn't be started for */
+		for (t = 0; t < threads && t * per_thread < count; t++) {
+			if (jobs[t].threaded) {
+				pthread_join(tids[t], NULL);
+			} else {
+				scan_blocks(&jobs[t]);
+			}
+			if (jobs[t].ret < 0) {
+				ret = jobs[t].ret;
+			}
+		}
+		if (ret < 0) {
+			error("failed to read sparse file");
+			goto out;
+		}
+
+		for (i = 0; i < count; i++) {
+			unsigned int block = base + i;
+			int64_t offset = (int64_t)block * s->block_size;
+			unsigned int len = min(s->len - offset, (int64_t)s->block_size);
+			enum run_type type = RUN_DATA;
+
+			if (uniform[i]) {
+				type = vals[i] == 0 && s->skip_zeros ? RUN_SKIP : RUN_FILL;
+			}
+
+			ret = add_block(s, fd, &run, block, type, vals[i], len);
+			if (ret < 0) {
+				goto out;
+			}
+		}
+	}
+
+	ret = flush_run(s, fd, &run);
+
+out:
+	free(vals);
+	free(uniform);
+	free(tids);
+	free(jobs);
+	return ret;
+}
+
 int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc)
 {
 	if (crc && !sparse) {
@@ -29,6 +29,8 @@
  * SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 
@@ -60,12 +62,16 @@
 #include "tboot_plugin.h"
 #include "debug.h"
 #include "buffer.h"
+#include "flash.h"
+#include "bundle.h"
+#include "perf.h"
 
 #define CMD_PUSH               "push"
-#define CMD_PUSH_USAGE     "Usage:\n    oem push <local-file>    push <local-file> to target\n"
+#define CMD_PUSH_USAGE     "Usage:\n    oem push <local-file> [<size>]    push <local-file> to target\n"
 
 
 static Hashmap *flash_cmds;
+static Hashmap *flash_stream_cmds;
 static Hashmap *oem_cmds;
 
 #ifdef USE_GUI
@@ -97,6 +103,12 @@ int aboot_register_flash_cmd(char *key, flash_func callback)
 	return aboot_register_cmd(flash_cmds, key, callback);
 }
 
+int aboot_register_flash_stream_cmd(char *key,
+		const struct flash_stream_ops *ops)
+{
+	return aboot_register_cmd(flash_stream_cmds, key, (void *)ops);
+}
+
 int aboot_register_oem_cmd(char *key, oem_func callback)
 {
 	return aboot_register_cmd(oem_cmds, key, callback);
@@ -192,66 +204,289 @@ static int cmd_flash_system(void *data, unsigned sz)
 }
 
 /*
- * buffers for reader and writer
+ * ring buffer between the usb reader and the reader thread
  */
-#define SIZE (4096 * 1024)
-#define NR_BUFFER 2
-static struct buffer *buf[NR_BUFFER] = {NULL, NULL};
+static struct ring *ring;
+/* what the last stream flash wrote, filled in by the reader thread */
+static struct flash_stats flash_stats;
+/* the reader stopped because the image doesn't fit the device */
+static int flash_too_large;
+/* getvar:last-flash-digest, "sha256:<hex> crc32:<hex>[ verified]" */
+static char last_flash_digest[100] = "none";
+/* getvar:perf, stage metrics of the last stream flash, see perf.h */
+static char last_flash_perf[1024] = "none";
+
+static void set_last_flash_digest(const struct flash_stats *st)
+{
+	char *p = last_flash_digest;
+	int i;
+
+	if (!st->digest_valid) {
+		strcpy(last_flash_digest, "none");
+		return;
+	}
 
-/* tell reader if writer has finished its work */
-static int writer_finished;
+	p += sprintf(p, "sha256:");
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		p += sprintf(p, "%02x", st->sha256[i]);
+	p += sprintf(p, " crc32:%08x", st->crc32);
+	if (st->verified > 0)
+		sprintf(p, " verified");
+}
+
+static struct ring *flash_ring_init(void)
+{
+	int nr;
+	int size_kb;
+
+	nr = atoi(tboot_config_get(FLASH_BUFFERS_KEY));
+	size_kb = atoi(tboot_config_get(FLASH_BUFFER_SIZE_KEY));
+	if (nr < 2)
+		nr = 2;
+	/* keep slots page aligned */
+	size_kb &= ~3;
+	if (size_kb < 64)
+		size_kb = 64;
+
+	pr_verbose("flash ring: %d x %d KB\n", nr, size_kb);
+	return ring_init(nr, size_kb * 1024);
+}
 
 /*
- * reader thread to read from buffer and write to device node
+ * reader thread to read from the ring and write to the flash stream
  */
 static void *reader(void *args)
 {
-	int i = 0;
-	int empty_counter = 0;
-	FILE *fout = (FILE *)args;
+	struct ring_slot *slot;
+	struct flash_stream *fs = (struct flash_stream *)args;
+	unsigned long long wait;
 
-	if (!fout) {
+	if (!fs) {
 		printf("null arg in reader\n");
 		pthread_exit((void *)-1);
 	}
 
-	while (empty_counter < NR_BUFFER && pipe_broken == 0) {
-		pthread_mutex_lock(&buf[i]->mutex);
-		if (!buf[i]->len) {
-			pthread_mutex_unlock(&buf[i]->mutex);
-			if (writer_finished) {
-				pr_verbose("writer finished\n");
-				empty_counter++;
-			}
-			i = (i + 1) % NR_BUFFER;
-			continue;
-		}
-		if (fwrite(buf[i]->data, 1, buf[i]->len, fout)
-				!= buf[i]->len) {
+	for (;;) {
+		/* the time the device side waits for usb */
+		wait = perf_now();
+		if ((slot = ring_get_full(ring)) == NULL)
+			break;
+		perf_add(&flash_stats.perf.stage[PERF_BUFFER_WAIT], slot->len,
+				wait);
+
+		if (flash_stream_write(fs, slot->data, slot->len)) {
 			pr_error("short write in reader\n");
-			pthread_mutex_unlock(&buf[i]->mutex);
+			flash_too_large = flash_stream_too_large(fs);
+			/* wake up the writer, it will drain usb */
+			ring_abort(ring);
+			flash_stream_abort(fs);
 			pthread_exit((void *)-1);
 		}
-		buf[i]->len = 0;
-		pthread_mutex_unlock(&buf[i]->mutex);
-		i = (i + 1) % NR_BUFFER;
+		ring_put_empty(ring, slot);
+	}
+
+	/* the main thread gave up, don't finish a partial image */
+	if (ring_aborted(ring)) {
+		flash_stream_abort(fs);
+		pthread_exit((void *)-1);
+	}
+
+	if (flash_stream_close(fs, &flash_stats))
+		pthread_exit((void *)-1);
+
+	pthread_exit((void *)0);
+}
+
+/*
+ * buffered flash_cmds go through the streaming pipeline too, this adapter
+ * collects the image in the download buffer. cmd_stream_flash() calls the
+ * callback with the whole of it from the main thread once the reader
+ * thread is done, as before streaming.
+ */
+struct buffered_flash {
+	unsigned char *data;
+	unsigned long long size;
+	unsigned long long len;
+};
+
+static int buffered_begin(const char *name, unsigned long long size,
+		void **priv)
+{
+	struct buffered_flash *bf;
+
+	bf = calloc(1, sizeof(*bf));
+	if (!bf) {
+		fastboot_fail("out of memory");
+		return -1;
+	}
+	bf->data = download_buffer(size);
+	if (!bf->data) {
+		fastboot_fail("data too large");
+		free(bf);
+		return -1;
+	}
+	bf->size = size;
+	*priv = bf;
+
+	return 0;
+}
+
+static int buffered_chunk(void *priv, const void *data, size_t len)
+{
+	struct buffered_flash *bf = priv;
+
+	if (len > bf->size - bf->len)
+		return -1;
+	memcpy(bf->data + bf->len, data, len);
+	bf->len += len;
+
+	return 0;
+}
+
+static int buffered_end(void *priv)
+{
+	struct buffered_flash *bf = priv;
+	int ret = -1;
+
+	if (bf->len == bf->size)
+		ret = 0;
+	free(bf);
+
+	return ret;
+}
+
+static void buffered_abort(void *priv)
+{
+	free(priv);
+}
+
+static const struct flash_stream_ops buffered_flash_ops = {
+	.begin = buffered_begin,
+	.chunk = buffered_chunk,
+	.end = buffered_end,
+	.abort = buffered_abort,
+};
+
+/*
+ * oem push with a size streams the file straight from usb into push_dir.
+ * The ring slots are page aligned and a multiple of the page size, so all
+ * but the last chunk can bypass the page cache with O_DIRECT.
+ */
+struct push_file {
+	char *path;
+	int fd;
+	int direct;
+	unsigned long long size;
+	unsigned long long len;
+};
+
+static int push_begin(const char *path, unsigned long long size, void **priv)
+{
+	struct push_file *pf;
+
+	pf = calloc(1, sizeof(*pf));
+	if (!pf || !(pf->path = strdup(path))) {
+		free(pf);
+		fastboot_fail("memory allocation error");
+		return -1;
 	}
+	pf->size = size;
 
-	if (fout) {
-		struct stat st;
+	pf->direct = 1;
+	pf->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (pf->fd < 0 && errno == EINVAL) {
+		pf->direct = 0;
+		pf->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (pf->fd < 0) {
+		pr_perror("create file");
+		fastboot_fail("create file failed.");
+		goto err;
+	}
 
-		if (fstat(fileno(fout), &st)) {
-			pr_error("fstat failed.\n");
+	/* reserve the blocks now, so a full disk fails before the transfer */
+	if (size && fallocate(pf->fd, 0, 0, size)) {
+		if (errno == ENOSPC) {
+			fastboot_fail("file size is too large.");
+			goto err;
 		}
-		if (S_ISFIFO(st.st_mode)) {
-			if (pclose(fout))
-				pthread_exit((void *)-1);
+		pr_verbose("fallocate %s: %s\n", path, strerror(errno));
+	}
+
+	*priv = pf;
+	return 0;
+
+err:
+	if (pf->fd >= 0) {
+		close(pf->fd);
+		unlink(path);
+	}
+	free(pf->path);
+	free(pf);
+	return -1;
+}
+
+static int push_chunk(void *priv, const void *data, size_t len)
+{
+	struct push_file *pf = priv;
+	const char *p = data;
+	ssize_t ret;
+
+	/* the unaligned tail goes through the page cache */
+	if (pf->direct && len % 4096) {
+		if (fcntl(pf->fd, F_SETFL, fcntl(pf->fd, F_GETFL) & ~O_DIRECT))
+			return -1;
+		pf->direct = 0;
+	}
+
+	while (len) {
+		ret = write(pf->fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			pr_perror("write");
+			return -1;
 		}
+		p += ret;
+		len -= ret;
+		pf->len += ret;
 	}
 
-	pthread_exit((void *)0);
+	return 0;
 }
 
+static void push_abort(void *priv)
+{
+	struct push_file *pf = priv;
+
+	close(pf->fd);
+	unlink(pf->path);
+	free(pf->path);
+	free(pf);
+}
+
+static int push_end(void *priv)
+{
+	struct push_file *pf = priv;
+
+	if (pf->len != pf->size || flush_fd(pf->fd)) {
+		push_abort(pf);
+		return -1;
+	}
+	close(pf->fd);
+	free(pf->path);
+	free(pf);
+
+	return 0;
+}
+
+static const struct flash_stream_ops push_file_ops = {
+	.begin = push_begin,
+	.chunk = push_chunk,
+	.end = push_end,
+	.abort = push_abort,
+};
+
 static bool list_callback(void *key, void *value, void *context)
 {
 	char *name;
@@ -282,6 +517,7 @@ static void list_partitions(int os, int part)
 	if (os) {
 		fastboot_info("FW and raw OS can be flashed:\n");
 		hashmapForEach(flash_cmds, list_callback, NULL);
+		hashmapForEach(flash_stream_cmds, list_callback, NULL);
 	}
 
 	/* list partitions */
@@ -305,288 +541,459 @@ static void list_partitions(int os, int part)
 }
 
 /*
- * if partition is a OS slot, use the old fashion download and flash method.
- * if partition is a real partition of mmc, use streaming flash.
- * cmd is in the below format:
- * part_name:data_len
- *
- * In general, there are two buffers in the same size, two posix threads and
- * an extra pipe which write buffer to device node. We gave a try to use more
- * buffers but can't help, just waste much memory.
- *
- * the data flow looks like below.
- * the main thread read data from usb buffer and write to doubled buffers.
- * the reader thread read from doubled buffers and write to pipe.
- * the pipe writer write data to device node.
- *
- * So when we finished, the main thread should wait for reader thread while
- * the reader thread should wait for pipe writer finished. Otherwise, sync
- * issue may occur.
+ * device node of a partition from disk_layout.conf, only ext4 volumes in
+ * the fstab can be flashed. Returns a malloc'ed path, or NULL with *err
+ * set to the reason.
  */
-static void cmd_stream_flash(const char *cmd, void *data, unsigned sz)
+static char *partition_device(const char *part_name, struct part_info **ptn,
+		const char **err)
 {
-	char *pc;
-	char *part_name = NULL;
-	unsigned long len;
-	char *device = NULL;
-	flash_func cb;
-	int free_device = 0;
-	struct part_info *ptn = NULL;
-	int do_ext_checks = 0;
-	void *saved_data = NULL;
-	unsigned long size;
-	unsigned char *magic;
-	int i = 0;
-	char *cmd_line = NULL;
-	char *cmd_base;
-	unsigned long finished = 0;
-	pthread_t t_reader;
-	void *reader_exit;
-	FILE *fout = NULL;
-	int percent;
-	int joined = 0;
+	char *device;
 	Volume *vol;
 
-	pr_debug("flash command is: %s\n", cmd);
-	part_name = strdup(cmd);
-	if (!part_name) {
-		fastboot_fail("strdup failed.");
-		goto error;
+	device = find_part_device(disk_info, part_name);
+	if (!device) {
+		*err = "unknown partition specified";
+		return NULL;
 	}
+	*ptn = find_part(disk_info, part_name);
 
-	pc = strchr(part_name, ':');
-	if (!pc) {
-		fastboot_fail("invalid cmd.");
-		goto error;
+	/* check the filesystem type */
+	vol = volume_for_device(device);
+	if (!vol) {
+		*err = "invalid fstab or disk layout config";
+		goto err;
 	}
 
-	len = strtoul(pc + 1, NULL, 16);
-	*pc = 0;
-
-	if (strlen(part_name) == 0) {
-		list_partitions(1, 1);
-		return;
+	/* only ext4 support */
+	if (strcmp(vol->fs_type, "ext4")) {
+		*err = "unsupport filesystem type";
+		goto err;
 	}
 
-	pr_debug("part_name: %s, data size: 0x%lX\n", part_name, len);
+	return device;
 
-	if (!strcmp(part_name, "disk")) {
-		device = disk_info->device;
-	} else if ( (cb = hashmapGet(flash_cmds, (char *)part_name)) ) {
-		/*
-		 * download data first
-		 */
-		if (download_to(len, &saved_data)) {
-			fastboot_fail("download failed.");
-			goto error;
+err:
+	free(device);
+	return NULL;
+}
+
+/*
+ * after an image was written to device: re-read the partition table or
+ * check the file system. Sends FAIL and returns -1 on error.
+ */
+static int partition_flashed(const char *device, struct part_info *ptn)
+{
+	int do_ext_checks = 0;
+
+	/* Check if we wrote to the base device node. If so,
+	 * re-sync the partition table in case we wrote out
+	 * a new one */
+	if (!strcmp(device, disk_info->device)) {
+		int fd = open(device, O_RDWR);
+		if (fd < 0) {
+			fastboot_fail("could not open device node");
+			return -1;
 		}
+		pr_verbose("sync partition table\n");
+		ioctl(fd, BLKRRPART, NULL);
+		close(fd);
+	}
 
-		/* Use our table of flash functions registered by platform
-		 * specific plugin libraries */
-		int cbret;
-		tboot_ui_bouncebar("Flashing %s...", part_name);
-		cbret = cb(saved_data, len);
-		if (cbret) {
-			fastboot_fail("flash failed.");
-			goto error;
-		} else {
-			goto finish;
+	/* Make sure this is really an ext4 partition before we try to
+	 * run some disk checks and resize it, ptn->type isn't sufficient
+	 * information */
+	if (ptn && ptn->type == PC_PART_TYPE_LINUX) {
+		if (check_ext_superblock(ptn, &do_ext_checks)) {
+			fastboot_fail("couldn't check superblock");
+			return -1;
 		}
-	} else {
-		free_device = 1;
-		device = find_part_device(disk_info, part_name);
-		if (!device) {
-			fastboot_fail("unknown partition specified");
-			goto error;
+	}
+	if (do_ext_checks) {
+		tboot_ui_bouncebar("File system checking...");
+		if (ext4_filesystem_checks(device)) {
+			fastboot_fail("ext4 filesystem error");
+			return -1;
 		}
-		ptn = find_part(disk_info, part_name);
+	}
 
-		/* check the filesystem type */
-		vol = volume_for_device(device);
-		if (!vol) {
-			fastboot_fail("invalid fstab or disk layout config");
-			goto error;
-		}
+	return 0;
+}
 
-		/* only ext4 support */
-		if (strcmp(vol->fs_type, "ext4")) {
-			fastboot_fail("unsupport filesystem type");
-			goto error;
-		}
+/*
+ * size of the partition behind device in bytes, from the block device if
+ * it can be opened, else from disk_layout.conf. 0 if unknown.
+ */
+static unsigned long long partition_size(const char *device,
+		struct part_info *ptn)
+{
+	unsigned long long size = 0;
+	int fd;
+
+	fd = open(device, O_RDONLY);
+	if (fd >= 0) {
+		if (ioctl(fd, BLKGETSIZE64, &size))
+			size = 0;
+		close(fd);
+	}
+	if (!size && ptn)
+		size = (unsigned long long)ptn->len_kb * 1024;
+
+	return size;
+}
+
+/*
+ * sparse and gzip images can be a bit larger than what they expand to,
+ * the announced length is only refused past this much on top of the
+ * partition size
+ */
+#define IMAGE_OVERHEAD(size)	((size) / 64 + 1024 * 1024)
+
+/*
+ * publish the stage metrics of a stream flash for getvar:perf, and log
+ * them as one line of key=value pairs
+ */
+static void flash_perf_report(const struct perf_stats *usb,
+		unsigned long long total_us)
+{
+	flash_stats.perf.stage[PERF_USB_READ] = *usb;
+	perf_format(&flash_stats.perf, total_us, last_flash_perf,
+			sizeof(last_flash_perf));
+	pr_info("flash perf: %s\n", last_flash_perf);
+}
+
+/*
+ * receive len bytes from usb into a flash stream. The main thread reads
+ * usb into the ring while the reader thread writes the stream. If fs is
+ * NULL, a stream to device is opened once the first slot shows the image
+ * format. what names the transfer on the progress bar.
+ *
+ * dev_size, if not 0, is the size of device: lengths that can't fit are
+ * refused before the host starts sending, and once the image turns out
+ * not to fit the transfer is cancelled rather than read to the end.
+ *
+ * The stream is closed or aborted in any case. On error FAIL is sent and
+ * -1 returned. Once data was read, the stage metrics are published for
+ * getvar:perf, failed transfers included.
+ */
+static int stream_download(struct flash_stream *fs, const char *device,
+		unsigned int flags, unsigned long len,
+		unsigned long long dev_size, const char *what)
+{
+	unsigned long size;
+	enum flash_format format;
+	unsigned long finished = 0;
+	pthread_t t_reader;
+	void *reader_exit;
+	struct ring_slot *slot;
+	struct perf_stats usb;
+	unsigned long long start;
+	unsigned long long wait;
+	int percent;
+	int started = 0;
+	int ret = -1;
+
+	flash_too_large = 0;
+	memset(&flash_stats, 0, sizeof(flash_stats));
+	memset(&usb, 0, sizeof(usb));
+	start = perf_now();
+	if (dev_size && len > dev_size + IMAGE_OVERHEAD(dev_size)) {
+		pr_error("%lu bytes image for a %llu bytes partition\n",
+				len, dev_size);
+		fastboot_fail("image too large for partition.");
+		goto out;
 	}
 
 	/* response to flashing tool */
 	if (streaming_download(NULL, len, 1)) {
 		fastboot_fail("protocol handshake failed.");
-		goto error;
+		goto out;
 	}
 
 	/* create buffers */
-	for (i = 0; i < NR_BUFFER; i++) {
-		if ((buf[i] = buffer_init(SIZE)) == NULL) {
-			while(i)
-				buffer_free(buf[--i]);
-			fastboot_fail("out of memory");
-			goto error;
-		}
+	if ((ring = flash_ring_init()) == NULL) {
+		fastboot_fail("out of memory");
+		goto out;
 	}
+	streaming_download_perf(&usb);
 
-	size = len > buf[0]->size ? buf[0]->size : len;
+	slot = ring_get_empty(ring);
+	size = len > slot->size ? slot->size : len;
 
 	/* first through read to get stream magic */
-	if (streaming_download((void *)&buf[0]->data, size, 0)) {
+	if (streaming_download((void **)&slot->data, size, 0)) {
 		fastboot_fail("download failed.");
-		goto error;
+		goto out;
 	}
-	buf[0]->len = size;
+	slot->len = size;
 	finished += size;
 
-	/*
-	 * Check input stream for a gzip header or bzip2 header.
-	 * For details, please refer to
-	 * http://www.gzip.org/zlib/rfc-gzip.html#file-format
-	 * http://en.wikipedia.org/wiki/Bzip2#File_format
-	 */
-	magic = buf[0]->data;
-	pr_verbose("Checking if input in gzip or bzip2 format...\n"
-		"4 bytes header value is: %x, %x, %x, %x\n",
-		magic[0], magic[1], magic[2], magic[3]);
-	if (magic[0] == 0x1f && magic[1] == 0x8b) {
-		pr_verbose("Yes, input stream is in gzip format\n");
-		cmd_base = "/bin/gzip -c -d | /bin/dd of=%s bs=8192";
-	} else if (magic[0] == 'B' && magic[1] == 'Z' &&
-			(magic[2] == 'h' || magic[2] == '0') &&
-			(magic[3] >= 49 && magic[3] <= 57)) {
-		pr_verbose("Yes, input stream is in bzip2 format\n");
-		cmd_base = "/bin/bzip2 -c -d | /bin/dd of=%s bs=8192";
-	} else {
-		pr_verbose("Warning: Input stream isn't in gzip or bzip2 format!\n");
-		tboot_ui_warn("Input isn't in gzip or bzip2 format.");
-		cmd_base = "/bin/dd of=%s bs=8192";
-	}
-
-	if (asprintf(&cmd_line, cmd_base, device) < 0) {
-		fastboot_fail("asprintf");
-		goto error;
-	}
+	if (!fs) {
+		format = flash_detect_format(slot->data, size);
+		pr_verbose("input stream is in %s format\n",
+				flash_format_name(format));
+		if (format == FLASH_FORMAT_RAW) {
+			pr_verbose("Warning: Input stream isn't in gzip or bzip2 format!\n");
+			tboot_ui_warn("Input isn't in gzip or bzip2 format.");
+		}
 
-	pr_verbose("command: %s\n", cmd_line);
+		/* a raw image is exactly what ends up on the device */
+		if (format == FLASH_FORMAT_RAW && dev_size && len > dev_size) {
+			pr_error("%lu bytes image for a %llu bytes partition\n",
+					len, dev_size);
+			fastboot_cancel("image too large for partition.");
+			goto out;
+		}
 
-	if ((fout = popen(cmd_line, "w")) == NULL) {
-		fastboot_fail("open for write.");
-		goto error;
+		if ((fs = flash_stream_open(device, format, flags)) == NULL) {
+			fastboot_fail("open for write.");
+			goto out;
+		}
 	}
 
-	writer_finished = 0;
-	pipe_broken = 0;
+	ring_put_full(ring, slot);
+
 	 /* create reader thread to read */
-	if (pthread_create(&t_reader, NULL, reader, (void *)fout)) {
+	if (pthread_create(&t_reader, NULL, reader, (void *)fs)) {
 		fastboot_fail("create reader thread failed.");
-		goto error;
+		goto out;
 	}
+	/* the reader thread owns the stream now */
+	started = 1;
+	fs = NULL;
+
+	while (finished < len) {
+		/* sleeps until the reader gives back a slot */
+		wait = perf_now();
+		slot = ring_get_empty(ring);
+		perf_stall(&usb, wait);
+		if (slot == NULL)
+			break;
 
-	/* the first buffer has data already */
-	i = 1;
-	while (finished < len && pipe_broken == 0) {
-		pthread_mutex_lock(&buf[i]->mutex);
-		if (buf[i]->len) {	// has valid data, try next
-			pthread_mutex_unlock(&buf[i]->mutex);
-			i = (i + 1) % NR_BUFFER;
-			continue;
-		}
-
-		if (finished + size > len)
-			size = len - finished;
+		size = len - finished;
+		if (size > slot->size)
+			size = slot->size;
 
 		/* write to buffer */
-		if (streaming_download((void *)&buf[i]->data, size, 0)) {
+		if (streaming_download((void **)&slot->data, size, 0)) {
 			fastboot_fail("download failed.");
-			pthread_mutex_unlock(&buf[i]->mutex);
-			goto error;
+			goto out;
 		}
 
-		buf[i]->len = size;
-		pthread_mutex_unlock(&buf[i]->mutex);
-		i = (i + 1) % NR_BUFFER;
+		slot->len = size;
+		ring_put_full(ring, slot);
 		finished += size;
 		/* never archive 100% */
 		/* update progress bar */
 		percent = (double)finished / len * 100;
 		/* percent may be zero if len is too large */
 		if (percent < 100 && percent > 0)
-			tboot_ui_textbar(percent, "Flashing...%d%%", percent);
+			tboot_ui_textbar(percent, "%s...%d%%", what, percent);
 		else if (percent >= 100)
-			/* in case the data is smaller than SIZE */
-			tboot_ui_textbar(percent, "Flashing...99%%");
+			/* in case the data is smaller than a slot */
+			tboot_ui_textbar(percent, "%s...99%%", what);
 	}
 
-	if (pipe_broken) {
-		/* empty the usb buffer, so we can send back fail msgs */
+	ring_close(ring);
+
+	/* closing the flash stream syncs the device */
+	tboot_ui_bouncebar("Syncing...");
+
+	/* wait reader thread */
+	started = 0;
+	if (pthread_join(t_reader, &reader_exit)) {
+		fastboot_fail("join reader thread failed");
+		goto out;
+	}
+
+	/* compressed or sparse images only show their size once expanded */
+	if (finished < len && flash_too_large) {
+		fastboot_cancel("image too large for partition.");
+		goto out;
+	}
+
+	if (finished < len) {
+		/* the reader gave up, it doesn't use the slots any more.
+		 * empty the usb buffer, so we can send back fail msgs */
+		slot = &ring->slots[0];
 		while (finished < len) {
-			if (finished + size > len)
-				size = len - finished;
-			if (streaming_download((void *)&buf[i]->data, size, 0)) {
+			size = len - finished;
+			if (size > slot->size)
+				size = slot->size;
+			if (streaming_download((void **)&slot->data, size, 0)) {
 				pr_error("we may hang there.\n");
 				break;
 			}
 			finished += size;
 		}
-		fastboot_fail("broken pipe, image too large?");
-		goto error;
+		fastboot_fail("write to device failed, image too large?");
+		goto out;
 	}
 
-	writer_finished = 1;
+	if ((int)reader_exit) {
+		if (flash_stats.verified < 0)
+			fastboot_fail("read back verification failed.");
+		else
+			fastboot_fail("write to device failed.");
+		goto out;
+	}
 
-	/* wait reader thread */
-	if (pthread_join(t_reader, &reader_exit)) {
-		fastboot_fail("join reader thread failed");
-		goto error;
+	pr_debug("writer write: %ld bytes\n", finished);
+	ret = 0;
+
+out:
+	if (started) {
+		ring_abort(ring);
+		pthread_join(t_reader, NULL);
+	} else if (fs) {
+		flash_stream_abort(fs);
 	}
+	streaming_download_perf(NULL);
+	if (finished)
+		flash_perf_report(&usb, perf_now() - start);
+	ring_free(ring);
+	ring = NULL;
 
-	joined = 1;
+	return ret;
+}
 
-	if (finished != len || (int)reader_exit) {
-		fastboot_fail("write to device failed.");
+/*
+ * if partition is a OS slot, use the old fashion download and flash method.
+ * if partition is a real partition of mmc, use streaming flash.
+ * cmd is in the below format:
+ * part_name:data_len[:delta][:verify]
+ *
+ * with :delta, blocks the device already holds are read back and compared
+ * instead of being written again, see FLASH_DELTA. with :verify, the data
+ * is read back after the flush and its SHA-256 compared, see FLASH_VERIFY.
+ * The digest of what was written is sent as INFO and kept for
+ * getvar:last-flash-digest.
+ *
+ * In general, there is a ring of equally sized buffers and two posix threads.
+ * The slot count and size are set by flash_buffers and flash_buffer_size
+ * config, each side sleeps while the other one holds or empties the slots.
+ *
+ * the data flow looks like below.
+ * the main thread read data from usb buffer and write to ring slots.
+ * the reader thread read from ring slots and write to a flash stream,
+ * which inflates gzip data and writes it to the device node in-process,
+ * with O_DIRECT from a pool of writer threads unless flash_direct is off.
+ * bzip2 images (or all images if native_flash is off) go through an extra
+ * gzip/bzip2/dd pipe instead.
+ *
+ * So when we finished, the main thread should wait for reader thread while
+ * the reader thread should wait for the flash stream finished. Otherwise,
+ * sync issue may occur.
+ */
+static void cmd_stream_flash(const char *cmd, void *data, unsigned sz)
+{
+	char *pc;
+	char *part_name = NULL;
+	unsigned long len;
+	char *device = NULL;
+	int free_device = 0;
+	struct part_info *ptn = NULL;
+	const struct flash_stream_ops *ops = NULL;
+	struct flash_stream *fs = NULL;
+	flash_func cb = NULL;
+	unsigned int flags = 0;
+	char *opt;
+	char *saveptr;
+	const char *err;
+
+	pr_debug("flash command is: %s\n", cmd);
+	part_name = strdup(cmd);
+	if (!part_name) {
+		fastboot_fail("strdup failed.");
 		goto error;
 	}
 
-	pr_debug("writer write: %ld bytes\n", finished);
+	pc = strchr(part_name, ':');
+	if (!pc) {
+		fastboot_fail("invalid cmd.");
+		goto error;
+	}
 
-	pr_debug("syncing...\n");
-	tboot_ui_bouncebar("Syncing...");
-	sync();
+	len = strtoul(pc + 1, &opt, 16);
+	*pc = 0;
 
-	/* Check if we wrote to the base device node. If so,
-	 * re-sync the partition table in case we wrote out
-	 * a new one */
-	if (!strcmp(device, disk_info->device)) {
-		int fd = open(device, O_RDWR);
-		if (fd < 0) {
-			fastboot_fail("could not open device node");
+	/* options follow the length, separated by colons */
+	for (opt = strtok_r(opt, ":", &saveptr); opt;
+			opt = strtok_r(NULL, ":", &saveptr)) {
+		if (!strcmp(opt, "delta")) {
+			flags |= FLASH_DELTA;
+		} else if (!strcmp(opt, "verify")) {
+			flags |= FLASH_VERIFY;
+		} else {
+			fastboot_fail("unknown flash option.");
 			goto error;
 		}
-		pr_verbose("sync partition table\n");
-		ioctl(fd, BLKRRPART, NULL);
-		close(fd);
 	}
+	strcpy(last_flash_digest, "none");
 
-	/* Make sure this is really an ext4 partition before we try to
-	 * run some disk checks and resize it, ptn->type isn't sufficient
-	 * information */
-	if (ptn && ptn->type == PC_PART_TYPE_LINUX) {
-		if (check_ext_superblock(ptn, &do_ext_checks)) {
-			fastboot_fail("couldn't check superblock");
+	if (strlen(part_name) == 0) {
+		list_partitions(1, 1);
+		return;
+	}
+
+	pr_debug("part_name: %s, data size: 0x%lX\n", part_name, len);
+
+	if (!strcmp(part_name, "disk")) {
+		device = disk_info->device;
+	} else if ((ops = hashmapGet(flash_stream_cmds, (char *)part_name)) ||
+			(cb = hashmapGet(flash_cmds, (char *)part_name))) {
+		/* platform specific plugin libraries get the image as it
+		 * streams in, buffered ones through an adapter */
+		if (!ops)
+			ops = &buffered_flash_ops;
+		if ((fs = flash_stream_open_plugin(ops, part_name, len)) == NULL) {
+			fastboot_fail("flash failed.");
+			goto error;
+		}
+	} else {
+		free_device = 1;
+		device = partition_device(part_name, &ptn, &err);
+		if (!device) {
+			fastboot_fail(err);
 			goto error;
 		}
 	}
-	if (do_ext_checks) {
-		tboot_ui_bouncebar("File system checking...");
-		if (ext4_filesystem_checks(device)) {
-			fastboot_fail("ext4 filesystem error");
+
+	if (stream_download(fs, device, flags, len,
+				device ? partition_size(device, ptn) : 0, "Flashing"))
+		goto error;
+
+	if (flags & FLASH_DELTA) {
+		char *info;
+
+		if (asprintf(&info, "delta: %llu bytes written, %llu unchanged",
+				flash_stats.written, flash_stats.skipped) != -1) {
+			fastboot_info(info);
+			free(info);
+		}
+	}
+
+	/* Use our table of flash functions registered by platform
+	 * specific plugin libraries */
+	if (cb) {
+		tboot_ui_bouncebar("Flashing %s...", part_name);
+		if (cb(download_buffer(len), len)) {
+			fastboot_fail("flash failed.");
 			goto error;
 		}
 	}
 
+	/* plugins are done once their end() callback succeeded */
+	if (ops)
+		goto finish;
+
+	set_last_flash_digest(&flash_stats);
+	if (flash_stats.digest_valid)
+		fastboot_info(last_flash_digest);
+
+	if (partition_flashed(device, ptn))
+		goto error;
+
 finish:
 	tboot_ui_info("Flash %s finished.", part_name);
 	fastboot_okay("");
@@ -600,15 +1007,137 @@ out:
 		free(part_name);
 	if (device && free_device)
 		free(device);
-	i = 0;
-	while (i < NR_BUFFER) {
-		buffer_free(buf[i]);
-		buf[i++] = NULL;
+}
+
+
+/* the bundle being flashed, handed to the stream ops below */
+static struct bundle *flash_bundle;
+
+static int bundle_resolve(struct bundle_entry *e)
+{
+	struct part_info *ptn = NULL;
+	const char *err;
+
+	if (!strcmp(e->partition, "disk")) {
+		e->device = strdup(disk_info->device);
+		return e->device ? 0 : -1;
+	}
+
+	e->device = partition_device(e->partition, &ptn, &err);
+	if (!e->device) {
+		pr_error("bundle: %s: %s\n", e->partition, err);
+		return -1;
+	}
+	e->priv = ptn;
+
+	return 0;
+}
+
+static int bundle_begin(const char *name, unsigned long long size, void **priv)
+{
+	*priv = flash_bundle;
+	return 0;
+}
+
+static int bundle_chunk(void *priv, const void *data, size_t len)
+{
+	return bundle_write(priv, data, len);
+}
+
+static int bundle_end(void *priv)
+{
+	struct bundle_entry *e;
+	int ret;
+	int i;
+
+	ret = bundle_close(priv);
+	/* the stages of the bundle are those of its images */
+	for (i = 0; i < bundle_nr_entries(priv); i++) {
+		e = bundle_get_entry(priv, i);
+		perf_merge_all(&flash_stats.perf, &e->stats.perf);
 	}
-	if (cmd_line)
-		free(cmd_line);
-	if (!joined)
-		pthread_cancel(t_reader);
+
+	return ret;
+}
+
+static void bundle_stop(void *priv)
+{
+	bundle_abort(priv);
+}
+
+static const struct flash_stream_ops bundle_stream_ops = {
+	.begin = bundle_begin,
+	.chunk = bundle_chunk,
+	.end = bundle_end,
+	.abort = bundle_stop,
+};
+
+/*
+ * flash-bundle:data_len
+ *
+ * flash several partitions from one tar archive, see bundle.h. The
+ * images stream to their partitions one after the other through the same
+ * ring as flash:, every device is flushed once at the end and the file
+ * systems are checked after all images are written. One INFO line per
+ * image reports what was written.
+ */
+static void cmd_flash_bundle(const char *arg, void *data, unsigned sz)
+{
+	struct flash_stream *fs;
+	struct bundle_entry *e;
+	unsigned long len;
+	char *info;
+	int ret;
+	int i;
+
+	len = strtoul(arg, NULL, 16);
+	pr_debug("flash bundle, data size: 0x%lX\n", len);
+
+	flash_bundle = bundle_new(bundle_resolve);
+	if (!flash_bundle) {
+		fastboot_fail("out of memory");
+		goto error;
+	}
+
+	fs = flash_stream_open_plugin(&bundle_stream_ops, "bundle", len);
+	if (!fs) {
+		fastboot_fail("flash failed.");
+		goto error;
+	}
+	if (stream_download(fs, NULL, 0, len, 0, "Flashing bundle"))
+		goto error;
+
+	for (i = 0; i < bundle_nr_entries(flash_bundle); i++) {
+		e = bundle_get_entry(flash_bundle, i);
+		/* only the native stages hash what they write */
+		if (e->stats.digest_valid)
+			ret = asprintf(&info, "%s: %llu bytes written, crc32 %08x",
+					e->partition, e->stats.written,
+					e->stats.crc32);
+		else
+			ret = asprintf(&info, "%s: %llu bytes written",
+					e->partition, e->stats.written);
+		if (ret != -1) {
+			fastboot_info(info);
+			free(info);
+		}
+	}
+
+	for (i = 0; i < bundle_nr_entries(flash_bundle); i++) {
+		e = bundle_get_entry(flash_bundle, i);
+		if (partition_flashed(e->device, e->priv))
+			goto error;
+	}
+
+	tboot_ui_info("Flash bundle finished.");
+	fastboot_okay("");
+	goto out;
+
+error:
+	tboot_ui_error("Flash bundle failed.");
+out:
+	bundle_free(flash_bundle);
+	flash_bundle = NULL;
 }
 
 
@@ -711,6 +1240,7 @@ static void cmd_flash(const char *part_name, void *data, unsigned sz)
 	}
 
 	pr_verbose("command: %s\n", cmd);
+	flush_track(device);
 	fp = popen(cmd, "w");
 	if (!fp) {
 		pr_perror("popen");
@@ -768,7 +1298,7 @@ static void cmd_flash(const char *part_name, void *data, unsigned sz)
 	pclose(fp);
 	fp = NULL;
 	pr_debug("syncing...\n");
-	sync();
+	flush_tracked();
 
 	pr_debug("wrote %u bytes to %s\n", sz, device);
 
@@ -868,22 +1398,28 @@ static void cmd_oem(const char *arg, void *data, unsigned sz)
 		size_t saved;
 		char tmpfile[PATH_MAX];
 		struct statfs stat;
-		unsigned long max_size;
+		unsigned long long max_size;
 		char push_dir[PATH_MAX];
 
-		if (argc != 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+		if (argc < 2 || argc > 3 || !strcmp(argv[1], "-h") ||
+				!strcmp(argv[1], "--help")) {
 			fastboot_info(CMD_PUSH_USAGE);
 			fastboot_okay("");
-			return;
+			goto out;
 		}
+		/* with a size the file follows this command, not download: */
+		if (argc == 3)
+			sz = strtoul(argv[2], NULL, 16);
+
 		strncpy(push_dir, tboot_config_get(PUSH_DIR_KEY), sizeof(push_dir));
 		if (statfs(push_dir, &stat) == -1) {
 			pr_warning("get filesystem status failed.\n");
 			tboot_ui_warn("Get filesystem status failed.");
 		} else {
 			/* left 1M bytes to make sure write file successfully */
-			max_size = stat.f_bsize * stat.f_bfree - (1 << 20);
-			pr_verbose("free size: %lu\n", max_size);
+			max_size = (unsigned long long)stat.f_bsize * stat.f_bfree;
+			max_size = max_size > (1 << 20) ? max_size - (1 << 20) : 0;
+			pr_verbose("free size: %llu\n", max_size);
 			if (sz > max_size) {
 			/* check is there enough space to hold the file */
 				fastboot_fail("file size is too large.");
@@ -899,6 +1435,18 @@ static void cmd_oem(const char *arg, void *data, unsigned sz)
 
 		snprintf(tmpfile, sizeof(tmpfile), "%s/%s", push_dir, file);
 
+		if (argc == 3) {
+			struct flash_stream *fs;
+
+			fp = NULL;
+			fs = flash_stream_open_plugin(&push_file_ops, tmpfile, sz);
+			if (!fs || stream_download(fs, NULL, 0, sz, 0, "Pushing"))
+				goto err;
+			fastboot_okay(tmpfile);
+			tboot_ui_info("Saved file to %s.", tmpfile);
+			goto out;
+		}
+
 		if (!(fp = fopen(tmpfile, "wb"))) {
 			pr_perror("create file");
 			fastboot_fail("create file failed.");
@@ -937,7 +1485,7 @@ static void cmd_boot(const char *arg, void *data, unsigned sz)
 static void cmd_reboot(const char *arg, void *data, unsigned sz)
 {
 	fastboot_okay("");
-	sync();
+	flush_all();
 	pr_info("Rebooting!\n");
 	tboot_ui_bouncebar("Rebooting...");
 	preos_reboot(PREOS_RB_RESTART2, 0, PREOS_RB_ARG_NORMALOS);
@@ -948,7 +1496,7 @@ static void cmd_reboot(const char *arg, void *data, unsigned sz)
 static void cmd_reboot_bl(const char *arg, void *data, unsigned sz)
 {
 	fastboot_okay("");
-	sync();
+	flush_all();
 	pr_info("Restarting tboot...\n");
 	tboot_ui_bouncebar("Restarting tboot...");
 	preos_reboot(PREOS_RB_RESTART2, 0, PREOS_RB_ARG_PREOS);
@@ -976,11 +1524,15 @@ void aboot_register_commands(void)
 	fastboot_register("reboot-bootloader", cmd_reboot_bl);
 	fastboot_register("erase:", cmd_erase);
 	fastboot_register("flash:", cmd_stream_flash);
+	fastboot_register("flash-bundle:", cmd_flash_bundle);
+	fastboot_publish("last-flash-digest", last_flash_digest);
+	fastboot_publish("perf", last_flash_perf);
 	//fastboot_register("continue", cmd_continue);
 
 	flash_cmds = hashmapCreate(8, strhash, strcompare);
+	flash_stream_cmds = hashmapCreate(8, strhash, strcompare);
 	oem_cmds = hashmapCreate(8, strhash, strcompare);
-	if (!flash_cmds || !oem_cmds) {
+	if (!flash_cmds || !flash_stream_cmds || !oem_cmds) {
 		pr_error("Memory allocation error\n");
 		die();
 	}
@@ -999,6 +1551,8 @@ void aboot_cmds_free(void)
 {
 	if (flash_cmds)
 		hashmapFree(flash_cmds);
+	if (flash_stream_cmds)
+		hashmapFree(flash_stream_cmds);
 	if (oem_cmds)
 		hashmapFree(oem_cmds);
 }
@@ -6,51 +6,150 @@
 #include "buffer.h"
 
 /*
- * free a buffer
+ * free a ring
  */
-void buffer_free(struct buffer *buf)
+void ring_free(struct ring *r)
 {
-	if (!buf)
+	int i;
+
+	if (!r)
 		return;
-	if (buf->data)
-		free(buf->data);
-	pthread_mutex_destroy(&buf->mutex);
-	free(buf);
+	if (r->slots) {
+		for (i = 0; i < r->nr; i++)
+			free(r->slots[i].data);
+		free(r->slots);
+	}
+	pthread_cond_destroy(&r->not_empty);
+	pthread_cond_destroy(&r->not_full);
+	pthread_mutex_destroy(&r->mutex);
+	free(r);
 }
 
 /*
- * create a buffer
+ * create a ring of nr slots, size bytes each
  */
-struct buffer *buffer_init(int size)
+struct ring *ring_init(int nr, size_t size)
 {
 	int i;
-	struct buffer *buf;
+	struct ring *r;
 
-	if (size <= 0) {
-		printf("invalid buffer_init\n");
+	if (nr <= 0 || size == 0) {
+		printf("invalid ring_init\n");
 		return NULL;
 	}
 
-	buf = malloc(sizeof(*buf));
-	if (!buf) {
+	r = calloc(1, sizeof(*r));
+	if (!r) {
 		printf("out of memory.\n");
 		return NULL;
 	}
 
-	buf->data = malloc(size);
-	if (!buf->data) {
-		printf("out of memory.\n");
-		buffer_free(buf);
+	if (pthread_mutex_init(&r->mutex, NULL) ||
+			pthread_cond_init(&r->not_full, NULL) ||
+			pthread_cond_init(&r->not_empty, NULL)) {
+		printf("init mutex of ring failed.\n");
+		free(r);
 		return NULL;
 	}
 
-	buf->size = size;
-	buf->len = 0;
-	if (pthread_mutex_init(&buf->mutex, NULL)) {
-		printf("init mutex of buffer failed.\n");
-		buffer_free(buf);
+	r->nr = nr;
+	r->nr_free = nr;
+	r->slots = calloc(nr, sizeof(*r->slots));
+	if (!r->slots) {
+		printf("out of memory.\n");
+		ring_free(r);
 		return NULL;
 	}
 
-	return buf;
+	for (i = 0; i < nr; i++) {
+		/* page aligned, so slots can be handed to O_DIRECT io */
+		if (posix_memalign((void **)&r->slots[i].data, 4096, size)) {
+			printf("out of memory.\n");
+			r->slots[i].data = NULL;
+			ring_free(r);
+			return NULL;
+		}
+		r->slots[i].size = size;
+	}
+
+	return r;
+}
+
+struct ring_slot *ring_get_empty(struct ring *r)
+{
+	struct ring_slot *slot = NULL;
+
+	pthread_mutex_lock(&r->mutex);
+	while (!r->nr_free && !r->aborted)
+		pthread_cond_wait(&r->not_full, &r->mutex);
+	if (!r->aborted) {
+		r->nr_free--;
+		slot = &r->slots[r->head];
+		r->head = (r->head + 1) % r->nr;
+		slot->len = 0;
+	}
+	pthread_mutex_unlock(&r->mutex);
+
+	return slot;
+}
+
+void ring_put_full(struct ring *r, struct ring_slot *slot)
+{
+	pthread_mutex_lock(&r->mutex);
+	r->nr_full++;
+	pthread_cond_signal(&r->not_empty);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+void ring_close(struct ring *r)
+{
+	pthread_mutex_lock(&r->mutex);
+	r->closed = 1;
+	pthread_cond_broadcast(&r->not_empty);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+struct ring_slot *ring_get_full(struct ring *r)
+{
+	struct ring_slot *slot = NULL;
+
+	pthread_mutex_lock(&r->mutex);
+	while (!r->nr_full && !r->closed && !r->aborted)
+		pthread_cond_wait(&r->not_empty, &r->mutex);
+	if (r->nr_full && !r->aborted) {
+		r->nr_full--;
+		slot = &r->slots[r->tail];
+		r->tail = (r->tail + 1) % r->nr;
+	}
+	pthread_mutex_unlock(&r->mutex);
+
+	return slot;
+}
+
+void ring_put_empty(struct ring *r, struct ring_slot *slot)
+{
+	pthread_mutex_lock(&r->mutex);
+	r->nr_free++;
+	pthread_cond_signal(&r->not_full);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+void ring_abort(struct ring *r)
+{
+	pthread_mutex_lock(&r->mutex);
+	r->aborted = 1;
+	pthread_cond_broadcast(&r->not_full);
+	pthread_cond_broadcast(&r->not_empty);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+int ring_aborted(struct ring *r)
+{
+	int aborted;
+
+	pthread_mutex_lock(&r->mutex);
+	aborted = r->aborted;
+	pthread_mutex_unlock(&r->mutex);
+
+	return aborted;
 }
@@ -1,14 +1,51 @@
 #ifndef __BUFFER_H
 #define __BUFFER_H
 
-struct buffer {
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * bounded single producer/single consumer ring of equally sized slots.
+ *
+ * the producer takes an empty slot, fills it and hands it over with
+ * ring_put_full(), the consumer takes full slots in the same order and
+ * gives them back with ring_put_empty(). Both sides sleep on a condition
+ * variable while there's nothing to do.
+ */
+struct ring_slot {
 	unsigned char *data;	// data address
-	int size;	// buffer size
-	int len;	// data length
+	size_t size;		// slot size
+	size_t len;		// data length
+};
+
+struct ring {
+	struct ring_slot *slots;
+	int nr;
+	int head;	// next slot to fill
+	int tail;	// next slot to drain
+	int nr_free;
+	int nr_full;
+	int closed;	// producer is done
+	int aborted;	// error occurred, stop both sides
 	pthread_mutex_t mutex;
+	pthread_cond_t not_full;
+	pthread_cond_t not_empty;
 };
 
-void buffer_free(struct buffer *buf);
-struct buffer *buffer_init(int size);
+struct ring *ring_init(int nr, size_t size);
+void ring_free(struct ring *r);
+
+/* producer side, ring_get_empty() returns NULL once the ring is aborted */
+struct ring_slot *ring_get_empty(struct ring *r);
+void ring_put_full(struct ring *r, struct ring_slot *slot);
+void ring_close(struct ring *r);
+
+/* consumer side, ring_get_full() returns NULL when closed and drained or
+ * when the ring is aborted */
+struct ring_slot *ring_get_full(struct ring *r);
+void ring_put_empty(struct ring *r, struct ring_slot *slot);
+
+void ring_abort(struct ring *r);
+int ring_aborted(struct ring *r);
 
 #endif
@@ -0,0 +1,471 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tboot_util.h"
+#include "debug.h"
+#include "bundle.h"
+
+#define TAR_BLOCK		512
+/* the manifest is read into memory whole */
+#define BUNDLE_MAX_MANIFEST	(64 * 1024)
+#define BUNDLE_MANIFEST		"manifest"
+/* bytes of an image looked at to detect its format */
+#define BUNDLE_MAGIC_LEN	TAR_BLOCK
+
+enum bundle_state {
+	BUNDLE_HEADER,		/* collecting a tar header */
+	BUNDLE_MANIFEST_DATA,
+	BUNDLE_MAGIC,		/* collecting the start of an image */
+	BUNDLE_IMAGE,
+	BUNDLE_SKIP,		/* a member that isn't an image */
+	BUNDLE_PAD,		/* up to the next tar block */
+	BUNDLE_END,		/* past the end of archive blocks */
+};
+
+struct bundle {
+	int (*resolve)(struct bundle_entry *e);
+	enum bundle_state state;
+	unsigned char hdr[TAR_BLOCK];
+	size_t hdr_len;
+	unsigned long long left;	/* of the current member */
+	size_t pad;
+
+	char *manifest;
+	size_t manifest_len;
+	struct bundle_entry *entries;
+	int nr_entries;
+
+	struct bundle_entry *cur;
+	struct flash_stream *fs;
+	unsigned char magic[BUNDLE_MAGIC_LEN];
+	size_t magic_len;
+	size_t magic_want;
+
+	/* the previous image is closed while the next one streams in */
+	pthread_t closer;
+	int closing;
+	struct bundle_entry *closing_entry;
+	struct flash_stream *closing_fs;
+};
+
+static unsigned long long tar_number(const unsigned char *p, size_t len)
+{
+	unsigned long long n = 0;
+	size_t i;
+
+	/* GNU base-256 for sizes past 8GB */
+	if (p[0] & 0x80) {
+		n = p[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			n = n << 8 | p[i];
+		return n;
+	}
+
+	for (i = 0; i < len && (p[i] == ' ' || p[i] == '\0'); i++)
+		;
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+		n = n * 8 + p[i] - '0';
+	return n;
+}
+
+static int tar_checksum_ok(const unsigned char *hdr)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < TAR_BLOCK; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+
+	return sum == tar_number(hdr + 148, 8);
+}
+
+static int is_zero_block(const unsigned char *hdr)
+{
+	int i;
+
+	for (i = 0; i < TAR_BLOCK; i++)
+		if (hdr[i])
+			return 0;
+	return 1;
+}
+
+static struct bundle_entry *find_entry(struct bundle *b, const char *image)
+{
+	int i;
+
+	for (i = 0; i < b->nr_entries; i++)
+		if (!strcmp(b->entries[i].image, image))
+			return &b->entries[i];
+	return NULL;
+}
+
+static int parse_manifest(struct bundle *b)
+{
+	struct bundle_entry *e;
+	char *line, *saveline;
+	char *word, *saveword;
+	int i;
+
+	b->manifest[b->manifest_len] = '\0';
+	for (line = strtok_r(b->manifest, "\n", &saveline); line;
+			line = strtok_r(NULL, "\n", &saveline)) {
+		word = strtok_r(line, " \t\r", &saveword);
+		if (!word || word[0] == '#')
+			continue;
+
+		e = realloc(b->entries, (b->nr_entries + 1) * sizeof(*e));
+		if (!e) {
+			pr_error("out of memory\n");
+			return -1;
+		}
+		b->entries = e;
+		e = &b->entries[b->nr_entries++];
+		memset(e, 0, sizeof(*e));
+		e->image = word;
+		e->partition = strtok_r(NULL, " \t\r", &saveword);
+		if (!e->partition) {
+			pr_error("manifest: no partition for %s\n", e->image);
+			return -1;
+		}
+
+		while ((word = strtok_r(NULL, " \t\r", &saveword)) != NULL) {
+			if (!strcmp(word, "delta")) {
+				e->flags |= FLASH_DELTA;
+			} else if (!strcmp(word, "verify")) {
+				e->flags |= FLASH_VERIFY;
+			} else {
+				pr_error("manifest: unknown option %s\n", word);
+				return -1;
+			}
+		}
+
+		for (i = 0; i < b->nr_entries - 1; i++) {
+			if (!strcmp(b->entries[i].image, e->image)) {
+				pr_error("manifest: image %s listed twice\n",
+						e->image);
+				return -1;
+			}
+			if (!strcmp(b->entries[i].partition, e->partition)) {
+				pr_error("manifest: partition %s listed twice\n",
+						e->partition);
+				return -1;
+			}
+		}
+	}
+
+	if (!b->nr_entries) {
+		pr_error("manifest lists no images\n");
+		return -1;
+	}
+
+	for (i = 0; i < b->nr_entries; i++) {
+		if (b->resolve(&b->entries[i]))
+			return -1;
+		pr_verbose("bundle: %s -> %s (%s)\n", b->entries[i].image,
+				b->entries[i].partition, b->entries[i].device);
+	}
+
+	return 0;
+}
+
+static void *close_image(void *arg)
+{
+	struct bundle *b = arg;
+
+	b->closing_entry->ret = flash_stream_close(b->closing_fs,
+			&b->closing_entry->stats);
+	return NULL;
+}
+
+static void wait_closer(struct bundle *b)
+{
+	if (!b->closing)
+		return;
+	pthread_join(b->closer, NULL);
+	b->closing = 0;
+}
+
+static void image_done(struct bundle *b)
+{
+	wait_closer(b);
+
+	b->closing_entry = b->cur;
+	b->closing_fs = b->fs;
+	b->cur->flashed = 1;
+	b->cur = NULL;
+	b->fs = NULL;
+
+	if (pthread_create(&b->closer, NULL, close_image, b))
+		close_image(b);
+	else
+		b->closing = 1;
+}
+
+static int open_image(struct bundle *b)
+{
+	enum flash_format format;
+
+	format = flash_detect_format(b->magic, b->magic_len);
+	pr_debug("bundle: flashing %s (%s) to %s\n", b->cur->image,
+			flash_format_name(format), b->cur->partition);
+
+	/* the devices are flushed together once the bundle is done */
+	b->fs = flash_stream_open(b->cur->device, format,
+			b->cur->flags | FLASH_DEFER_FLUSH);
+	if (!b->fs) {
+		b->cur->ret = -1;
+		return -1;
+	}
+
+	if (flash_stream_write(b->fs, b->magic, b->magic_len)) {
+		b->cur->ret = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int start_member(struct bundle *b)
+{
+	char name[155 + 1 + 100 + 1];
+	const char *base;
+	unsigned char type = b->hdr[156];
+
+	if (is_zero_block(b->hdr)) {
+		b->state = BUNDLE_END;
+		return 0;
+	}
+	if (!tar_checksum_ok(b->hdr)) {
+		pr_error("bundle: bad tar header checksum\n");
+		return -1;
+	}
+
+	/* ustar keeps long paths in the prefix field */
+	if (!memcmp(b->hdr + 257, "ustar", 5) && b->hdr[345])
+		snprintf(name, sizeof(name), "%.155s/%.100s",
+				b->hdr + 345, b->hdr);
+	else
+		snprintf(name, sizeof(name), "%.100s", b->hdr);
+	base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+
+	b->left = tar_number(b->hdr + 124, 12);
+	b->pad = (TAR_BLOCK - b->left % TAR_BLOCK) % TAR_BLOCK;
+
+	/* directories, links and pax headers carry no image */
+	if (type != '0' && type != '\0') {
+		b->state = BUNDLE_SKIP;
+		return 0;
+	}
+
+	if (!b->manifest) {
+		if (strcmp(base, BUNDLE_MANIFEST)) {
+			pr_error("bundle: %s comes before the manifest\n", name);
+			return -1;
+		}
+		if (b->left > BUNDLE_MAX_MANIFEST) {
+			pr_error("bundle: manifest too large\n");
+			return -1;
+		}
+		b->manifest = malloc(b->left + 1);
+		if (!b->manifest) {
+			pr_error("out of memory\n");
+			return -1;
+		}
+		b->manifest_len = 0;
+		b->state = BUNDLE_MANIFEST_DATA;
+		return 0;
+	}
+
+	b->cur = find_entry(b, name);
+	if (!b->cur)
+		b->cur = find_entry(b, base);
+	if (!b->cur) {
+		pr_error("bundle: %s is not in the manifest\n", name);
+		return -1;
+	}
+	if (b->cur->flashed || !b->left) {
+		pr_error("bundle: %s is empty or repeated\n", name);
+		b->cur = NULL;
+		return -1;
+	}
+
+	b->magic_len = 0;
+	b->magic_want = b->left < BUNDLE_MAGIC_LEN ? b->left : BUNDLE_MAGIC_LEN;
+	b->state = BUNDLE_MAGIC;
+	return 0;
+}
+
+struct bundle *bundle_new(int (*resolve)(struct bundle_entry *e))
+{
+	struct bundle *b;
+
+	b = calloc(1, sizeof(*b));
+	if (!b) {
+		pr_error("out of memory\n");
+		return NULL;
+	}
+	b->resolve = resolve;
+	b->state = BUNDLE_HEADER;
+
+	return b;
+}
+
+int bundle_write(struct bundle *b, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t n;
+
+	while (len) {
+		switch (b->state) {
+		case BUNDLE_HEADER:
+			n = TAR_BLOCK - b->hdr_len;
+			if (n > len)
+				n = len;
+			memcpy(b->hdr + b->hdr_len, p, n);
+			b->hdr_len += n;
+			if (b->hdr_len == TAR_BLOCK) {
+				b->hdr_len = 0;
+				if (start_member(b))
+					return -1;
+			}
+			break;
+
+		case BUNDLE_MANIFEST_DATA:
+			n = len < b->left ? len : b->left;
+			memcpy(b->manifest + b->manifest_len, p, n);
+			b->manifest_len += n;
+			b->left -= n;
+			break;
+
+		case BUNDLE_MAGIC:
+			n = b->magic_want - b->magic_len;
+			if (n > len)
+				n = len;
+			memcpy(b->magic + b->magic_len, p, n);
+			b->magic_len += n;
+			b->left -= n;
+			if (b->magic_len == b->magic_want) {
+				if (open_image(b))
+					return -1;
+				b->state = BUNDLE_IMAGE;
+			}
+			break;
+
+		case BUNDLE_IMAGE:
+			n = len < b->left ? len : b->left;
+			if (flash_stream_write(b->fs, p, n)) {
+				b->cur->ret = -1;
+				return -1;
+			}
+			b->left -= n;
+			break;
+
+		case BUNDLE_SKIP:
+			n = len < b->left ? len : b->left;
+			b->left -= n;
+			break;
+
+		case BUNDLE_PAD:
+			n = len < b->pad ? len : b->pad;
+			b->pad -= n;
+			break;
+
+		default:
+			/* trailing zero blocks and record padding */
+			return 0;
+		}
+
+		p += n;
+		len -= n;
+
+		/* a member may end without more data, e.g. an empty one */
+		if (b->state != BUNDLE_HEADER && b->state != BUNDLE_PAD &&
+				b->state != BUNDLE_END && b->state != BUNDLE_MAGIC &&
+				!b->left) {
+			if (b->state == BUNDLE_MANIFEST_DATA &&
+					parse_manifest(b))
+				return -1;
+			if (b->state == BUNDLE_IMAGE)
+				image_done(b);
+			b->state = BUNDLE_PAD;
+		}
+		if (b->state == BUNDLE_PAD && !b->pad)
+			b->state = BUNDLE_HEADER;
+	}
+
+	return 0;
+}
+
+int bundle_close(struct bundle *b)
+{
+	int ret = 0;
+	int i;
+
+	wait_closer(b);
+
+	/* tools may leave out the end of archive blocks */
+	if (b->state != BUNDLE_END &&
+			!(b->state == BUNDLE_HEADER && !b->hdr_len)) {
+		pr_error("bundle: archive is truncated\n");
+		bundle_abort(b);
+		ret = -1;
+	}
+
+	for (i = 0; i < b->nr_entries; i++) {
+		if (!b->entries[i].flashed) {
+			pr_error("bundle: %s is missing\n", b->entries[i].image);
+			ret = -1;
+		} else if (b->entries[i].ret) {
+			ret = -1;
+		}
+	}
+	if (!b->manifest) {
+		pr_error("bundle: no manifest\n");
+		ret = -1;
+	}
+
+	/* one flush for all the images */
+	if (flush_tracked())
+		ret = -1;
+
+	return ret;
+}
+
+void bundle_abort(struct bundle *b)
+{
+	if (b->fs) {
+		flash_stream_abort(b->fs);
+		b->fs = NULL;
+	}
+	b->cur = NULL;
+	wait_closer(b);
+	flush_tracked();
+}
+
+void bundle_free(struct bundle *b)
+{
+	int i;
+
+	if (!b)
+		return;
+	for (i = 0; i < b->nr_entries; i++)
+		free(b->entries[i].device);
+	free(b->entries);
+	free(b->manifest);
+	free(b);
+}
+
+int bundle_nr_entries(struct bundle *b)
+{
+	return b->nr_entries;
+}
+
+struct bundle_entry *bundle_get_entry(struct bundle *b, int i)
+{
+	return &b->entries[i];
+}
@@ -0,0 +1,50 @@
+#ifndef __BUNDLE_H
+#define __BUNDLE_H
+
+#include <stddef.h>
+
+#include "flash.h"
+
+/*
+ * a flash bundle is a tar archive of partition images. Its first member,
+ * "manifest", has one line per image:
+ *
+ *	<image member> <partition> [delta] [verify]
+ *
+ * Blank lines and lines starting with '#' are ignored. The images follow
+ * in any order and are flashed while the archive streams in, each one
+ * through its own flash stream.
+ */
+struct bundle_entry {
+	char *image;
+	char *partition;
+	unsigned int flags;	/* FLASH_* */
+	char *device;		/* set by the resolve callback */
+	void *priv;		/* for the resolve callback */
+	int flashed;
+	int ret;
+	struct flash_stats stats;
+};
+
+struct bundle;
+
+/*
+ * resolve looks up the device of e->partition once the manifest is read,
+ * it sets e->device to a malloc'ed path and returns 0, or -1 to refuse
+ * the bundle.
+ */
+struct bundle *bundle_new(int (*resolve)(struct bundle_entry *e));
+int bundle_write(struct bundle *b, const void *data, size_t len);
+/*
+ * wait for the last image, then flush every device once. Returns -1 if
+ * the archive was cut short or any image failed or was missing.
+ */
+int bundle_close(struct bundle *b);
+/* stop after an error, the image being written is abandoned */
+void bundle_abort(struct bundle *b);
+void bundle_free(struct bundle *b);
+
+int bundle_nr_entries(struct bundle *b);
+struct bundle_entry *bundle_get_entry(struct bundle *b, int i);
+
+#endif
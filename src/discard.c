@@ -0,0 +1,441 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "debug.h"
+#include "erase.h"
+#include "discard.h"
+#include "ext4_utils/ext4_utils.h"
+#include "ext4_utils/ext4.h"
+
+/* extents waiting for the discard thread */
+#define DISCARD_QUEUE_LEN	64
+/* merged extents are queued once they reach this size */
+#define DISCARD_MAX_EXTENT	(256ULL * 1024 * 1024)
+
+/* ext4 images whose block bitmaps take more memory are not scanned */
+#define EXT4_SCAN_MAX_BITMAPS	(64 * 1024 * 1024)
+
+#ifndef BLKDISCARD
+#define BLKDISCARD	_IO(0x12,119)
+#endif
+
+struct discard_queue {
+	int fd;
+	struct discard_info di;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long long ext[DISCARD_QUEUE_LEN][2];
+	int head;
+	int nr;
+	int done;			/* no more extents will be queued */
+	int failed;			/* the device refused a discard */
+
+	/* the extent being merged, only touched by the producer */
+	unsigned long long start;
+	unsigned long long len;
+
+	unsigned long long discarded;
+	unsigned int requests;
+};
+
+/* issue one extent, shrunk to whole granules */
+static void discard_extent(struct discard_queue *dq, unsigned long long start,
+		unsigned long long len)
+{
+	unsigned long long gran = dq->di.granularity;
+	unsigned long long align = dq->di.alignment % gran;
+	unsigned long long end = start + len;
+	uint64_t range[2];
+
+	start = start < align ? align :
+		align + (start - align + gran - 1) / gran * gran;
+	end = end < align ? 0 : align + (end - align) / gran * gran;
+	if (end <= start)
+		return;
+
+	range[0] = start;
+	range[1] = end - start;
+	if (ioctl(dq->fd, BLKDISCARD, &range)) {
+		pr_verbose("BLKDISCARD failed: %s\n", strerror(errno));
+		dq->failed = 1;
+		return;
+	}
+	dq->discarded += range[1];
+	dq->requests++;
+}
+
+static void *discard_thread(void *arg)
+{
+	struct discard_queue *dq = arg;
+	unsigned long long start;
+	unsigned long long len;
+
+	pthread_mutex_lock(&dq->lock);
+	for (;;) {
+		while (!dq->nr && !dq->done)
+			pthread_cond_wait(&dq->cond, &dq->lock);
+		if (!dq->nr)
+			break;
+
+		start = dq->ext[dq->head][0];
+		len = dq->ext[dq->head][1];
+		dq->head = (dq->head + 1) % DISCARD_QUEUE_LEN;
+		dq->nr--;
+		pthread_cond_broadcast(&dq->cond);
+
+		if (dq->failed)
+			continue;
+		pthread_mutex_unlock(&dq->lock);
+		discard_extent(dq, start, len);
+		pthread_mutex_lock(&dq->lock);
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return NULL;
+}
+
+/* hand the merged extent to the thread, waits while the queue is full */
+static void discard_queue_push(struct discard_queue *dq)
+{
+	if (!dq->len)
+		return;
+
+	pthread_mutex_lock(&dq->lock);
+	while (dq->nr == DISCARD_QUEUE_LEN)
+		pthread_cond_wait(&dq->cond, &dq->lock);
+	dq->ext[(dq->head + dq->nr) % DISCARD_QUEUE_LEN][0] = dq->start;
+	dq->ext[(dq->head + dq->nr) % DISCARD_QUEUE_LEN][1] = dq->len;
+	dq->nr++;
+	pthread_cond_broadcast(&dq->cond);
+	pthread_mutex_unlock(&dq->lock);
+
+	dq->len = 0;
+}
+
+struct discard_queue *discard_queue_new(int fd)
+{
+	struct discard_queue *dq;
+
+	dq = calloc(1, sizeof(*dq));
+	if (!dq) {
+		pr_error("out of memory\n");
+		return NULL;
+	}
+	dq->fd = fd;
+
+	if (discard_info_get(fd, &dq->di) || !dq->di.granularity) {
+		pr_verbose("device can't discard\n");
+		goto err;
+	}
+
+	pthread_mutex_init(&dq->lock, NULL);
+	pthread_cond_init(&dq->cond, NULL);
+	if (pthread_create(&dq->thread, NULL, discard_thread, dq)) {
+		pr_error("can't create discard thread\n");
+		pthread_cond_destroy(&dq->cond);
+		pthread_mutex_destroy(&dq->lock);
+		goto err;
+	}
+
+	return dq;
+
+err:
+	free(dq);
+	return NULL;
+}
+
+void discard_queue_add(struct discard_queue *dq, unsigned long long start,
+		unsigned long long len)
+{
+	if (!len)
+		return;
+
+	if (dq->len && dq->start + dq->len == start &&
+			dq->len < DISCARD_MAX_EXTENT) {
+		dq->len += len;
+		return;
+	}
+
+	discard_queue_push(dq);
+	dq->start = start;
+	dq->len = len;
+}
+
+void discard_queue_finish(struct discard_queue *dq)
+{
+	discard_queue_push(dq);
+
+	pthread_mutex_lock(&dq->lock);
+	dq->done = 1;
+	pthread_cond_broadcast(&dq->cond);
+	pthread_mutex_unlock(&dq->lock);
+	pthread_join(dq->thread, NULL);
+
+	pr_debug("discarded %llu bytes in %u requests\n", dq->discarded,
+			dq->requests);
+	pthread_cond_destroy(&dq->cond);
+	pthread_mutex_destroy(&dq->lock);
+	free(dq);
+}
+
+void discard_queue_abort(struct discard_queue *dq)
+{
+	/* the thread drops what is still queued */
+	dq->len = 0;
+	pthread_mutex_lock(&dq->lock);
+	dq->failed = 1;
+	pthread_mutex_unlock(&dq->lock);
+
+	discard_queue_finish(dq);
+}
+
+/*
+ * ext4 scan. The superblock, then the group descriptors, then the block
+ * bitmaps are copied out of the stream, the way ext2simg finds the used
+ * blocks of an image. Only the first superblock and descriptor table are
+ * read, so meta_bg file systems are not scanned.
+ */
+enum scan_state {
+	SCAN_SB,
+	SCAN_DESC,
+	SCAN_BITMAPS,
+	SCAN_DEAD,
+};
+
+struct ext4_bitmap {
+	unsigned long long block;
+	unsigned int group;
+};
+
+struct ext4_scan {
+	enum scan_state state;
+	struct ext4_super_block sb;
+	size_t sb_got;
+
+	unsigned int block_size;
+	unsigned long long blocks;
+	unsigned int first_data_block;
+	unsigned int blocks_per_group;
+	unsigned int groups;
+	unsigned int desc_size;
+
+	unsigned char *desc;
+	size_t desc_got;
+
+	unsigned char *bitmaps;
+	size_t *bitmap_got;
+	struct ext4_bitmap *order;	/* bitmaps sorted by block */
+	unsigned int nr_order;
+	unsigned int next;		/* first bitmap not yet streamed past */
+};
+
+/*
+ * copy the part of [off, off + size) the data at pos holds into buf, got
+ * bytes of it are already there. Returns the new got.
+ */
+static size_t scan_copy(unsigned char *buf, unsigned long long off,
+		size_t size, size_t got, unsigned long long pos,
+		const unsigned char *data, size_t len)
+{
+	unsigned long long start = off + got;
+	unsigned long long end = off + size;
+
+	if (pos > start || pos + len <= start)
+		return got;
+	if (end > pos + len)
+		end = pos + len;
+	memcpy(buf + got, data + (start - pos), end - start);
+
+	return got + (end - start);
+}
+
+static int scan_bitmap_cmp(const void *a, const void *b)
+{
+	const struct ext4_bitmap *x = a;
+	const struct ext4_bitmap *y = b;
+
+	return x->block < y->block ? -1 : x->block > y->block;
+}
+
+static void scan_sb_done(struct ext4_scan *es)
+{
+	struct ext4_super_block *sb = &es->sb;
+	int bit64 = sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT;
+
+	es->state = SCAN_DEAD;
+	if (sb->s_magic != EXT4_SUPER_MAGIC || sb->s_log_block_size > 6)
+		return;
+	if (sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_META_BG)
+		return;
+
+	es->block_size = 1024 << sb->s_log_block_size;
+	es->blocks = sb->s_blocks_count_lo;
+	if (bit64)
+		es->blocks |= (unsigned long long)sb->s_blocks_count_hi << 32;
+	es->first_data_block = sb->s_first_data_block;
+	es->blocks_per_group = sb->s_blocks_per_group;
+	es->desc_size = bit64 ? sb->s_desc_size : 32;
+	if (es->desc_size < 32 || !es->blocks_per_group ||
+			es->blocks_per_group > es->block_size * 8 ||
+			es->blocks <= es->first_data_block)
+		return;
+
+	es->groups = DIV_ROUND_UP(es->blocks - es->first_data_block,
+			es->blocks_per_group);
+	if ((unsigned long long)es->groups * es->block_size >
+			EXT4_SCAN_MAX_BITMAPS)
+		return;
+
+	es->desc = malloc((size_t)es->groups * es->desc_size);
+	if (!es->desc)
+		return;
+
+	pr_debug("ext4 image: %llu blocks of %u bytes in %u groups\n",
+			es->blocks, es->block_size, es->groups);
+	es->state = SCAN_DESC;
+}
+
+static void scan_desc_done(struct ext4_scan *es)
+{
+	struct ext4_group_desc *gd;
+	unsigned long long block;
+	unsigned int i;
+
+	es->state = SCAN_DEAD;
+	es->bitmaps = malloc((size_t)es->groups * es->block_size);
+	es->bitmap_got = calloc(es->groups, sizeof(*es->bitmap_got));
+	es->order = malloc(es->groups * sizeof(*es->order));
+	if (!es->bitmaps || !es->bitmap_got || !es->order)
+		return;
+
+	/* groups without an initialised bitmap keep their blocks */
+	for (i = 0; i < es->groups; i++) {
+		gd = (struct ext4_group_desc *)(es->desc + i * es->desc_size);
+		if (gd->bg_flags & EXT4_BG_BLOCK_UNINIT)
+			continue;
+		block = gd->bg_block_bitmap_lo;
+		if (es->desc_size >= 64)
+			block |= (unsigned long long)gd->bg_block_bitmap_hi << 32;
+		if (block >= es->blocks)
+			continue;
+		es->order[es->nr_order].block = block;
+		es->order[es->nr_order].group = i;
+		es->nr_order++;
+	}
+	qsort(es->order, es->nr_order, sizeof(*es->order), scan_bitmap_cmp);
+
+	es->state = SCAN_BITMAPS;
+}
+
+struct ext4_scan *ext4_scan_new(void)
+{
+	struct ext4_scan *es;
+
+	es = calloc(1, sizeof(*es));
+	if (!es)
+		pr_error("out of memory\n");
+
+	return es;
+}
+
+void ext4_scan_data(struct ext4_scan *es, unsigned long long pos,
+		const void *data, size_t len)
+{
+	unsigned long long bs = es->block_size;
+	struct ext4_bitmap *b;
+	unsigned int i;
+
+	if (es->state == SCAN_SB) {
+		es->sb_got = scan_copy((unsigned char *)&es->sb, 1024,
+				sizeof(es->sb), es->sb_got, pos, data, len);
+		if (es->sb_got == sizeof(es->sb))
+			scan_sb_done(es);
+		bs = es->block_size;
+	}
+
+	if (es->state == SCAN_DESC) {
+		es->desc_got = scan_copy(es->desc,
+				(es->first_data_block + 1) * bs,
+				(size_t)es->groups * es->desc_size,
+				es->desc_got, pos, data, len);
+		if (es->desc_got == (size_t)es->groups * es->desc_size)
+			scan_desc_done(es);
+	}
+
+	if (es->state != SCAN_BITMAPS)
+		return;
+
+	while (es->next < es->nr_order &&
+			(es->order[es->next].block + 1) * bs <= pos)
+		es->next++;
+	for (i = es->next; i < es->nr_order; i++) {
+		b = &es->order[i];
+		if (b->block * bs >= pos + len)
+			break;
+		es->bitmap_got[b->group] = scan_copy(
+				es->bitmaps + (size_t)b->group * bs,
+				b->block * bs, bs, es->bitmap_got[b->group],
+				pos, data, len);
+	}
+}
+
+void ext4_scan_finish(struct ext4_scan *es, struct discard_queue *dq,
+		unsigned long long dev_size)
+{
+	unsigned long long bs = es->block_size;
+	unsigned long long first;
+	unsigned long long free_blocks = 0;
+	unsigned char *bitmap;
+	unsigned int last;
+	unsigned int block;
+	unsigned int run;
+	unsigned int g;
+
+	if (!dq || es->state != SCAN_BITMAPS)
+		goto out;
+
+	for (g = 0; g < es->groups; g++) {
+		if (es->bitmap_got[g] != bs)
+			continue;
+		bitmap = es->bitmaps + (size_t)g * bs;
+		first = es->first_data_block +
+			(unsigned long long)g * es->blocks_per_group;
+		last = min(es->blocks_per_group, es->blocks - first);
+
+		for (block = 0; block < last; block += run) {
+			/* whole bytes of used blocks are skipped at once */
+			if (!(block % 8) && bitmap[block / 8] == 0xff) {
+				run = 8;
+				continue;
+			}
+			for (run = 0; block + run < last &&
+					!(bitmap[(block + run) / 8] &
+						1 << ((block + run) % 8)); run++)
+				;
+			if (!run) {
+				run = 1;
+				continue;
+			}
+			discard_queue_add(dq, (first + block) * bs, run * bs);
+			free_blocks += run;
+		}
+	}
+
+	pr_debug("ext4 image: discarding %llu free blocks\n", free_blocks);
+	if (dev_size > es->blocks * bs)
+		discard_queue_add(dq, es->blocks * bs,
+				dev_size - es->blocks * bs);
+
+out:
+	free(es->desc);
+	free(es->bitmaps);
+	free(es->bitmap_got);
+	free(es->order);
+	free(es);
+}
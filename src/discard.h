@@ -0,0 +1,40 @@
+#ifndef __DISCARD_H
+#define __DISCARD_H
+
+#include <stddef.h>
+
+/*
+ * a discard queue collects the device ranges a flash leaves untouched.
+ * Contiguous ranges are merged into extents, and a thread issues them
+ * with BLKDISCARD while the flash goes on. Extents are trimmed to the
+ * discard granularity of the device.
+ */
+struct discard_queue;
+
+/* returns NULL if the device behind fd can't discard */
+struct discard_queue *discard_queue_new(int fd);
+void discard_queue_add(struct discard_queue *dq, unsigned long long start,
+		unsigned long long len);
+/* issue what is left, wait for it and free the queue */
+void discard_queue_finish(struct discard_queue *dq);
+/* drop what isn't issued yet, wait for the discard in progress and free */
+void discard_queue_abort(struct discard_queue *dq);
+
+/*
+ * free space of an ext4 image, found in its block bitmaps as the image
+ * streams past. The data must be fed in device order.
+ */
+struct ext4_scan;
+
+struct ext4_scan *ext4_scan_new(void);
+void ext4_scan_data(struct ext4_scan *es, unsigned long long pos,
+		const void *data, size_t len);
+/*
+ * queue the free blocks of the file system, and the device beyond its
+ * end up to dev_size, then free the scan. Nothing is queued if dq is NULL
+ * or the image wasn't ext4, groups whose bitmap wasn't seen are left out.
+ */
+void ext4_scan_finish(struct ext4_scan *es, struct discard_queue *dq,
+		unsigned long long dev_size);
+
+#endif
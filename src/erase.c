@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#include "tboot.h"
+#include "tboot_util.h"
+#include "debug.h"
+#include "erase.h"
+
+/* discards are issued, and progress reported, in chunks of this size */
+#define ERASE_CHUNK		(256ULL * 1024 * 1024)
+
+/* devices that can't discard are overwritten in O_DIRECT writes this big */
+#define ERASE_WRITE_SIZE	(4 * 1024 * 1024)
+#define ERASE_WRITE_ALIGN	4096
+
+#ifndef BLKDISCARD
+#define BLKDISCARD	_IO(0x12,119)
+#endif
+#ifndef BLKSECDISCARD
+#define BLKSECDISCARD	_IO(0x12,125)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT	_IO(0x12,127)
+#endif
+
+struct erase {
+	int fd;
+	unsigned long long size;
+	unsigned long long done;
+	unsigned char *zero;	/* ERASE_WRITE_SIZE zeroes, on first use */
+	erase_progress_func progress;
+	void *priv;
+};
+
+enum erase_policy erase_policy_get(void)
+{
+	char *policy;
+
+	policy = tboot_config_get(ERASE_POLICY_KEY);
+	if (policy && !strcasecmp(policy, "secure"))
+		return ERASE_SECURE;
+	if (policy && !strcasecmp(policy, "zero"))
+		return ERASE_ZERO;
+
+	return ERASE_DISCARD;
+}
+
+static int sysfs_read(const char *dir, const char *name,
+		unsigned long long *val)
+{
+	char path[128];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ret = fscanf(f, "%llu", val) == 1 ? 0 : -1;
+	fclose(f);
+
+	return ret;
+}
+
+int discard_info_get(int fd, struct discard_info *di)
+{
+	char dir[64];
+	char queue[80];
+	struct stat statbuf;
+	unsigned long long val;
+
+	memset(di, 0, sizeof(*di));
+	if (fstat(fd, &statbuf) || !S_ISBLK(statbuf.st_mode))
+		return -1;
+
+	snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u",
+			major(statbuf.st_rdev), minor(statbuf.st_rdev));
+	/* partitions use the request queue of their disk */
+	snprintf(queue, sizeof(queue), "%s/%squeue", dir,
+			sysfs_read(dir, "partition", &val) ? "" : "../");
+
+	if (sysfs_read(queue, "discard_granularity", &di->granularity) ||
+			sysfs_read(queue, "discard_max_bytes", &di->max_bytes))
+		return -1;
+	if (!di->max_bytes)
+		di->granularity = 0;
+
+	/* for a partition, this is already relative to its start */
+	if (sysfs_read(dir, "discard_alignment", &di->alignment))
+		di->alignment = 0;
+	if (!sysfs_read(queue, "discard_zeroes_data", &val))
+		di->zeroes_data = val == 1;
+
+	return 0;
+}
+
+static void erase_advance(struct erase *e, unsigned long long len)
+{
+	e->done += len;
+	if (e->progress)
+		e->progress(e->done, e->size, e->priv);
+}
+
+static int erase_write(struct erase *e, int fd, unsigned long long start,
+		unsigned long long len)
+{
+	size_t n;
+	ssize_t ret;
+
+	if (!e->zero) {
+		if (posix_memalign((void **)&e->zero, ERASE_WRITE_ALIGN,
+					ERASE_WRITE_SIZE)) {
+			pr_error("out of memory\n");
+			e->zero = NULL;
+			return -1;
+		}
+		memset(e->zero, 0, ERASE_WRITE_SIZE);
+	}
+
+	while (len) {
+		n = len > ERASE_WRITE_SIZE ? ERASE_WRITE_SIZE : len;
+		ret = pwrite(fd, e->zero, n, start);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			pr_error("zeroing at %llu failed: %s\n", start,
+					ret ? strerror(errno) : "short write");
+			return -1;
+		}
+		start += ret;
+		len -= ret;
+		erase_advance(e, ret);
+	}
+
+	return 0;
+}
+
+static int erase_zero(struct erase *e, unsigned long long start,
+		unsigned long long len)
+{
+	uint64_t range[2] = { start, len };
+
+	if (!len)
+		return 0;
+	if (!ioctl(e->fd, BLKZEROOUT, &range)) {
+		erase_advance(e, len);
+		return 0;
+	}
+	pr_verbose("BLKZEROOUT failed: %s\n", strerror(errno));
+
+	return erase_write(e, e->fd, start, len);
+}
+
+/*
+ * discard [start, end), which is granule aligned. Returns 1 if the device
+ * refused the first discard, so nothing was erased yet.
+ */
+static int erase_discard(struct erase *e, const struct discard_info *di,
+		enum erase_policy policy, unsigned long long start,
+		unsigned long long end)
+{
+	unsigned long long chunk = ERASE_CHUNK;
+	unsigned long long pos;
+	uint64_t range[2];
+
+	if (di->max_bytes && chunk > di->max_bytes)
+		chunk = di->max_bytes;
+	chunk -= chunk % di->granularity;
+	if (!chunk)
+		chunk = di->granularity;
+
+	for (pos = start; pos < end; pos += range[1]) {
+		range[0] = pos;
+		range[1] = end - pos > chunk ? chunk : end - pos;
+
+		if (ioctl(e->fd, policy == ERASE_SECURE ? BLKSECDISCARD :
+					BLKDISCARD, &range)) {
+			if (pos == start && (errno == EOPNOTSUPP ||
+						errno == ENOTTY))
+				return 1;
+			pr_error("discard at %llu failed: %s\n", pos,
+					strerror(errno));
+			return -1;
+		}
+
+		if (policy == ERASE_ZERO && !di->zeroes_data) {
+			if (erase_zero(e, range[0], range[1]))
+				return -1;
+		} else {
+			erase_advance(e, range[1]);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * overwrite the whole device, bypassing the page cache if possible. An
+ * unaligned tail goes through the page cache.
+ */
+static int erase_overwrite(struct erase *e, const char *device)
+{
+	unsigned long long aligned = e->size;
+	int fd;
+	int ret;
+
+	fd = open(device, O_WRONLY | O_DIRECT);
+	if (fd < 0) {
+		pr_verbose("%s: no O_DIRECT, writing through the page cache\n",
+				device);
+		fd = e->fd;
+	} else {
+		aligned -= e->size % ERASE_WRITE_ALIGN;
+	}
+
+	ret = erase_write(e, fd, 0, aligned);
+	if (!ret)
+		ret = erase_write(e, e->fd, aligned, e->size - aligned);
+	if (fd != e->fd)
+		close(fd);
+
+	return ret;
+}
+
+int erase_device(const char *device, enum erase_policy policy,
+		unsigned int flags, erase_progress_func progress, void *priv)
+{
+	struct erase e;
+	struct discard_info di;
+	unsigned long long start;
+	unsigned long long end;
+	int ret = -1;
+
+	memset(&e, 0, sizeof(e));
+	e.progress = progress;
+	e.priv = priv;
+
+	e.fd = open(device, O_WRONLY);
+	if (e.fd < 0) {
+		pr_error("can't open %s: %s\n", device, strerror(errno));
+		return -1;
+	}
+	if (ioctl(e.fd, BLKGETSIZE64, &e.size)) {
+		pr_perror("BLKGETSIZE64");
+		goto out;
+	}
+
+	if (discard_info_get(e.fd, &di) || !di.granularity)
+		goto no_discard;
+
+	/* first and last granule boundary, the rest is zeroed */
+	start = di.alignment % di.granularity;
+	end = e.size > start ? e.size - (e.size - start) % di.granularity : 0;
+	if (end <= start)
+		start = end = 0;
+
+	pr_verbose("erasing %s: %llu bytes, discard granularity %llu\n",
+			device, e.size, di.granularity);
+	switch (erase_discard(&e, &di, policy, start, end)) {
+	case 0:
+		break;
+	case 1:
+		goto no_discard;
+	default:
+		goto out;
+	}
+	if (erase_zero(&e, 0, start) || erase_zero(&e, end, e.size - end))
+		goto out;
+	goto flush;
+
+no_discard:
+	if (policy == ERASE_SECURE) {
+		pr_error("%s can't do secure discard\n", device);
+		goto out;
+	}
+	if (!(flags & ERASE_WRITE_FALLBACK)) {
+		pr_error("%s can't discard, old data left in place\n", device);
+		ret = 0;
+		goto out;
+	}
+	pr_verbose("%s can't discard, writing zeroes\n", device);
+	if (erase_overwrite(&e, device))
+		goto out;
+
+flush:
+	ret = flush_fd(e.fd);
+
+out:
+	free(e.zero);
+	close(e.fd);
+
+	return ret;
+}
@@ -0,0 +1,47 @@
+#ifndef __ERASE_H
+#define __ERASE_H
+
+/*
+ * how erase_device gets rid of the old contents, see the erase_policy
+ * config:
+ *
+ * ERASE_DISCARD	discard, blocks read back as whatever the device
+ *			returns for unmapped blocks
+ * ERASE_SECURE		secure discard, the old data is purged from the
+ *			media as well
+ * ERASE_ZERO		discard, then zero out unless the device already
+ *			reads discarded blocks back as zeroes
+ */
+enum erase_policy {
+	ERASE_DISCARD,
+	ERASE_SECURE,
+	ERASE_ZERO,
+};
+
+/* erase_device flags */
+#define ERASE_WRITE_FALLBACK	(1<<0)	/* write zeroes if the device can't discard */
+
+/* discard limits of a block device, from sysfs */
+struct discard_info {
+	unsigned long long granularity;	/* bytes, 0 if it can't discard */
+	unsigned long long max_bytes;	/* largest single discard, 0 if no limit */
+	unsigned long long alignment;	/* offset of the first granule */
+	int zeroes_data;		/* discarded blocks read back as zeroes */
+};
+
+/* called after each chunk with the number of bytes erased so far */
+typedef void (*erase_progress_func)(unsigned long long done,
+		unsigned long long total, void *priv);
+
+enum erase_policy erase_policy_get(void);
+int discard_info_get(int fd, struct discard_info *di);
+/*
+ * erase a whole block device according to policy. The granule aligned
+ * part is discarded in chunks, the unaligned head and tail are zeroed.
+ * A device that can't discard is overwritten with zeroes if flags has
+ * ERASE_WRITE_FALLBACK, else left as is. Returns 0 on success.
+ */
+int erase_device(const char *device, enum erase_policy policy,
+		unsigned int flags, erase_progress_func progress, void *priv);
+
+#endif
@@ -0,0 +1,577 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#include "tboot_util.h"
+#include "debug.h"
+#include "ext4_finalize.h"
+#include "ext4_utils/ext4_utils.h"
+#include "ext4_utils/ext4.h"
+
+/*
+ * After an image is flashed its file system is only as large as the image,
+ * and e2fsck, resize2fs and tune2fs used to be run on it one after the
+ * other. This does the same work in one pass over the metadata:
+ *
+ * - the quick check compares the superblock, the group descriptors and
+ *   the block bitmaps with each other,
+ * - the file system grows by extending its last group and appending new
+ *   ones, as long as their descriptors fit the existing descriptor blocks,
+ * - the mount count is set to 1.
+ *
+ * The superblock is parsed into the ext4_utils info and aux_info globals,
+ * like ext4fixup does, so this must not run along with make_ext4fs.
+ */
+
+/* inode tables of new groups are zeroed with writes of this size */
+#define FIN_ZERO_SIZE		(1024 * 1024)
+
+/* like mke2fs, a last group with less room than this isn't added */
+#define FIN_MIN_GROUP_DATA	50
+
+#ifndef BLKZEROOUT
+#define BLKZEROOUT	_IO(0x12,127)
+#endif
+
+/* features the file system may have for the in-process path */
+#define FIN_COMPAT	(EXT4_FEATURE_COMPAT_DIR_PREALLOC | \
+			EXT4_FEATURE_COMPAT_IMAGIC_INODES | \
+			EXT4_FEATURE_COMPAT_HAS_JOURNAL | \
+			EXT4_FEATURE_COMPAT_EXT_ATTR | \
+			EXT4_FEATURE_COMPAT_RESIZE_INODE | \
+			EXT4_FEATURE_COMPAT_DIR_INDEX)
+#define FIN_RO_COMPAT	(EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER | \
+			EXT4_FEATURE_RO_COMPAT_LARGE_FILE | \
+			EXT4_FEATURE_RO_COMPAT_HUGE_FILE | \
+			EXT4_FEATURE_RO_COMPAT_DIR_NLINK | \
+			EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE | \
+			EXT4_FEATURE_RO_COMPAT_BTREE_DIR)
+#define FIN_INCOMPAT	(EXT4_FEATURE_INCOMPAT_FILETYPE | \
+			EXT4_FEATURE_INCOMPAT_RECOVER | \
+			EXT4_FEATURE_INCOMPAT_EXTENTS | \
+			EXT4_FEATURE_INCOMPAT_FLEX_BG)
+
+struct ext4_fin {
+	int fd;
+	struct ext4_super_block sb;
+	unsigned long long blocks;	/* file system size in blocks */
+	unsigned int groups;
+	unsigned long long new_blocks;	/* after growing */
+	unsigned int new_groups;
+	u8 *buf;			/* one block */
+	u8 *zero;			/* FIN_ZERO_SIZE of zeroes */
+};
+
+/* ext4_parse_sb reports errors with a longjmp */
+static int fin_parse_sb(struct ext4_super_block *sb)
+{
+	if (setjmp(setjmp_env))
+		return -1;
+	ext4_parse_sb(sb);
+
+	return 0;
+}
+
+static int fin_read(struct ext4_fin *f, void *buf, size_t len,
+		unsigned long long off)
+{
+	if (pread(f->fd, buf, len, off) != (ssize_t)len) {
+		pr_error("ext4: read at %llu failed\n", off);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int fin_write(struct ext4_fin *f, const void *buf, size_t len,
+		unsigned long long off)
+{
+	if (pwrite(f->fd, buf, len, off) != (ssize_t)len) {
+		pr_error("ext4: write at %llu failed\n", off);
+		return -1;
+	}
+
+	return 0;
+}
+
+static unsigned long long group_first(unsigned int g)
+{
+	return aux_info.first_data_block +
+		(unsigned long long)g * info.blocks_per_group;
+}
+
+static unsigned int group_size(unsigned int g, unsigned long long blocks)
+{
+	return min((unsigned long long)info.blocks_per_group,
+			blocks - group_first(g));
+}
+
+/* superblock, descriptor and reserved descriptor blocks of a group */
+static unsigned int group_sb_blocks(unsigned int g)
+{
+	if (!ext4_bg_has_super_block(g))
+		return 0;
+
+	return 1 + aux_info.bg_desc_blocks + info.bg_desc_reserve_blocks;
+}
+
+static void bitmap_set(u8 *bitmap, unsigned int from, unsigned int to)
+{
+	for (; from < to; from++)
+		bitmap[from / 8] |= 1 << (from % 8);
+}
+
+static unsigned int bitmap_free(const u8 *bitmap, unsigned int n)
+{
+	unsigned int free_bits = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (!(bitmap[i / 8] & 1 << (i % 8)))
+			free_bits++;
+
+	return free_bits;
+}
+
+/*
+ * the quick check: every group's metadata lies inside the file system and
+ * its free counts agree with its block bitmap and with the superblock
+ */
+static int fin_check(struct ext4_fin *f)
+{
+	struct ext2_group_desc *gd;
+	unsigned long long free_blocks = 0;
+	unsigned long long free_inodes = 0;
+	unsigned int size;
+	unsigned int g;
+
+	if ((unsigned long long)f->groups * info.inodes_per_group !=
+			f->sb.s_inodes_count) {
+		pr_error("ext4: inode count doesn't match the groups\n");
+		return -1;
+	}
+
+	for (g = 0; g < f->groups; g++) {
+		gd = &aux_info.bg_desc[g];
+		size = group_size(g, f->blocks);
+
+		if (gd->bg_block_bitmap >= f->blocks ||
+				gd->bg_inode_bitmap >= f->blocks ||
+				gd->bg_inode_table + aux_info.inode_table_blocks >
+				f->blocks) {
+			pr_error("ext4: group %u metadata out of range\n", g);
+			return -1;
+		}
+		if (gd->bg_free_blocks_count > size ||
+				gd->bg_free_inodes_count > info.inodes_per_group) {
+			pr_error("ext4: group %u free counts invalid\n", g);
+			return -1;
+		}
+
+		if (fin_read(f, f->buf, info.block_size,
+				(unsigned long long)gd->bg_block_bitmap *
+				info.block_size))
+			return -1;
+		if (bitmap_free(f->buf, size) != gd->bg_free_blocks_count) {
+			pr_error("ext4: group %u free blocks don't match its "
+					"bitmap\n", g);
+			return -1;
+		}
+
+		free_blocks += gd->bg_free_blocks_count;
+		free_inodes += gd->bg_free_inodes_count;
+	}
+
+	if (free_blocks != f->sb.s_free_blocks_count_lo ||
+			free_inodes != f->sb.s_free_inodes_count) {
+		pr_error("ext4: superblock free counts don't match the groups\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * the resize inode maps each reserved descriptor block of group 0 to an
+ * indirect block listing its copies in the backup groups
+ */
+static int fin_resize_inode(struct ext4_fin *f, struct ext4_inode *inode,
+		unsigned long long *off)
+{
+	unsigned int rsv = info.bg_desc_reserve_blocks;
+	unsigned int apb = info.block_size / sizeof(u32);
+	unsigned int pblk;
+	unsigned int j;
+	u32 *dind = (u32 *)f->buf;
+
+	*off = (unsigned long long)aux_info.bg_desc[0].bg_inode_table *
+		info.block_size + (EXT4_RESIZE_INO - 1) * info.inode_size;
+	if (fin_read(f, inode, sizeof(*inode), *off))
+		return -1;
+	if (!inode->i_block[EXT4_DIND_BLOCK] ||
+			fin_read(f, dind, info.block_size,
+				(unsigned long long)inode->i_block[EXT4_DIND_BLOCK] *
+				info.block_size)) {
+		pr_error("ext4: resize inode invalid\n");
+		return -1;
+	}
+
+	for (j = 0; j < rsv; j++) {
+		pblk = aux_info.first_data_block + 1 + aux_info.bg_desc_blocks + j;
+		if (dind[(aux_info.bg_desc_blocks + j) % apb] != pblk) {
+			pr_error("ext4: resize inode doesn't map reserved block %u\n",
+					pblk);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * how far the file system can grow on a device of dev_blocks. Returns 1 if
+ * that needs more descriptor blocks or backups than the resize inode has.
+ */
+static int fin_plan(struct ext4_fin *f, unsigned long long dev_blocks)
+{
+	unsigned int apb = info.block_size / sizeof(u32);
+	unsigned int backups = 0;
+	unsigned int last;
+	unsigned int g;
+
+	f->new_blocks = dev_blocks;
+	f->new_groups = DIV_ROUND_UP(f->new_blocks - aux_info.first_data_block,
+			info.blocks_per_group);
+	last = f->new_blocks - group_first(f->new_groups - 1);
+	if (f->new_groups > f->groups && last < group_sb_blocks(f->new_groups - 1) +
+			2 + aux_info.inode_table_blocks + FIN_MIN_GROUP_DATA) {
+		f->new_groups--;
+		f->new_blocks = group_first(f->new_groups);
+	}
+	if (f->new_blocks <= f->blocks) {
+		f->new_blocks = f->blocks;
+		f->new_groups = f->groups;
+		return 0;
+	}
+
+	if (DIV_ROUND_UP(f->new_groups * sizeof(struct ext2_group_desc),
+				info.block_size) > aux_info.bg_desc_blocks) {
+		pr_verbose("ext4: growing to %u groups needs more descriptor "
+				"blocks\n", f->new_groups);
+		return 1;
+	}
+	if ((unsigned long long)f->new_groups * info.inodes_per_group >
+			0xffffffffULL)
+		return 1;
+
+	for (g = 1; g < f->new_groups; g++)
+		if (ext4_bg_has_super_block(g))
+			backups++;
+	if (info.bg_desc_reserve_blocks && backups > apb)
+		return 1;
+
+	return 0;
+}
+
+static int fin_zero(struct ext4_fin *f, unsigned long long block,
+		unsigned long long count)
+{
+	uint64_t range[2] = { block * info.block_size, count * info.block_size };
+	unsigned long long off = range[0];
+	unsigned long long len = range[1];
+	size_t n;
+
+	if (!ioctl(f->fd, BLKZEROOUT, &range))
+		return 0;
+
+	while (len) {
+		n = len > FIN_ZERO_SIZE ? FIN_ZERO_SIZE : len;
+		if (fin_write(f, f->zero, n, off))
+			return -1;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* add the backups of the new groups to the resize inode */
+static int fin_grow_resize_inode(struct ext4_fin *f)
+{
+	unsigned int rsv = info.bg_desc_reserve_blocks;
+	unsigned long long blocks_512 = 0;
+	unsigned long long off;
+	struct ext4_inode inode;
+	u32 *ind = (u32 *)f->buf;
+	unsigned int pblk;
+	unsigned int k;
+	unsigned int g;
+	unsigned int j;
+
+	if (fin_resize_inode(f, &inode, &off))
+		return -1;
+
+	for (j = 0; j < rsv; j++) {
+		pblk = aux_info.first_data_block + 1 + aux_info.bg_desc_blocks + j;
+		if (fin_read(f, ind, info.block_size,
+				(unsigned long long)pblk * info.block_size))
+			return -1;
+
+		for (k = 0, g = 1; g < f->new_groups; g++) {
+			if (!ext4_bg_has_super_block(g))
+				continue;
+			if (g >= f->groups) {
+				ind[k] = pblk + group_first(g) -
+					aux_info.first_data_block;
+				blocks_512 += info.block_size / 512;
+			}
+			k++;
+		}
+
+		if (fin_write(f, ind, info.block_size,
+				(unsigned long long)pblk * info.block_size))
+			return -1;
+	}
+
+	blocks_512 += inode.i_blocks_lo;
+	if (blocks_512 > 0xffffffffULL) {
+		pr_error("ext4: resize inode too large\n");
+		return -1;
+	}
+	inode.i_blocks_lo = blocks_512;
+
+	return fin_write(f, &inode, sizeof(inode), off);
+}
+
+/*
+ * extend the last group and append the new ones. Only the metadata of the
+ * new groups is written, the descriptors and superblock are updated in
+ * memory.
+ */
+static int fin_grow(struct ext4_fin *f)
+{
+	struct ext2_group_desc *gd;
+	struct ext4_inode inode;
+	unsigned long long added = 0;
+	unsigned long long block;
+	unsigned int bits = info.block_size * 8;
+	unsigned int size;
+	unsigned int used;
+	unsigned int old;
+	unsigned int g;
+	u64 r_blocks;
+
+	/* nothing is written unless the resize inode can be updated */
+	if (info.bg_desc_reserve_blocks && fin_resize_inode(f, &inode, &block))
+		return -1;
+
+	/* the last group's padding past the old end becomes free */
+	g = f->groups - 1;
+	gd = &aux_info.bg_desc[g];
+	old = group_size(g, f->blocks);
+	size = group_size(g, f->new_blocks);
+	if (size > old) {
+		block = gd->bg_block_bitmap;
+		if (fin_read(f, f->buf, info.block_size, block * info.block_size))
+			return -1;
+		for (; old < size; old++) {
+			f->buf[old / 8] &= ~(1 << (old % 8));
+			gd->bg_free_blocks_count++;
+			added++;
+		}
+		if (fin_write(f, f->buf, info.block_size, block * info.block_size))
+			return -1;
+	}
+
+	for (g = f->groups; g < f->new_groups; g++) {
+		gd = &aux_info.bg_desc[g];
+		size = group_size(g, f->new_blocks);
+		block = group_first(g) + group_sb_blocks(g);
+		used = group_sb_blocks(g) + 2 + aux_info.inode_table_blocks;
+
+		memset(gd, 0, sizeof(*gd));
+		gd->bg_block_bitmap = block;
+		gd->bg_inode_bitmap = block + 1;
+		gd->bg_inode_table = block + 2;
+		gd->bg_free_blocks_count = size - used;
+		gd->bg_free_inodes_count = info.inodes_per_group;
+
+		memset(f->buf, 0, info.block_size);
+		bitmap_set(f->buf, 0, used);
+		bitmap_set(f->buf, size, bits);
+		if (fin_write(f, f->buf, info.block_size, block * info.block_size))
+			return -1;
+
+		memset(f->buf, 0, info.block_size);
+		bitmap_set(f->buf, info.inodes_per_group, bits);
+		if (fin_write(f, f->buf, info.block_size,
+				(block + 1) * info.block_size))
+			return -1;
+
+		if (fin_zero(f, block + 2, aux_info.inode_table_blocks))
+			return -1;
+
+		added += size - used;
+	}
+
+	if (info.bg_desc_reserve_blocks && fin_grow_resize_inode(f))
+		return -1;
+
+	/* keep the same share of reserved blocks */
+	r_blocks = (u64)f->sb.s_r_blocks_count_lo * f->new_blocks / f->blocks;
+	f->sb.s_r_blocks_count_lo = r_blocks;
+	f->sb.s_blocks_count_lo = f->new_blocks;
+	f->sb.s_free_blocks_count_lo += added;
+	f->sb.s_inodes_count += (f->new_groups - f->groups) *
+		info.inodes_per_group;
+	f->sb.s_free_inodes_count += (f->new_groups - f->groups) *
+		info.inodes_per_group;
+
+	pr_verbose("ext4: grown from %llu to %llu blocks, %u to %u groups\n",
+			f->blocks, f->new_blocks, f->groups, f->new_groups);
+	return 0;
+}
+
+/* descriptors and backup superblocks first, the primary superblock last */
+static int fin_write_metadata(struct ext4_fin *f, int grown)
+{
+	struct ext4_super_block sb;
+	unsigned long long first;
+	unsigned int g;
+
+	for (g = 0; grown && g < f->new_groups; g++) {
+		if (!ext4_bg_has_super_block(g))
+			continue;
+		first = group_first(g);
+		if (fin_write(f, aux_info.bg_desc,
+				info.block_size * aux_info.bg_desc_blocks,
+				(first + 1) * info.block_size))
+			return -1;
+		if (!g)
+			continue;
+		memcpy(&sb, &f->sb, sizeof(sb));
+		sb.s_block_group_nr = g;
+		if (fin_write(f, &sb, sizeof(sb), first * info.block_size))
+			return -1;
+	}
+	if (grown && flush_fd(f->fd))
+		return -1;
+
+	f->sb.s_block_group_nr = 0;
+	if (fin_write(f, &f->sb, sizeof(f->sb), 1024))
+		return -1;
+
+	return flush_fd(f->fd);
+}
+
+int ext4_finalize(const char *device)
+{
+	struct ext4_fin f;
+	struct stat statbuf;
+	unsigned long long dev_size;
+	int parsed = 0;
+	int ret = -1;
+
+	memset(&f, 0, sizeof(f));
+	f.fd = open(device, O_RDWR);
+	if (f.fd < 0) {
+		pr_error("can't open %s: %s\n", device, strerror(errno));
+		return -1;
+	}
+
+	if (fin_read(&f, &f.sb, sizeof(f.sb), 1024))
+		goto out;
+	if (f.sb.s_magic != EXT4_SUPER_MAGIC ||
+			f.sb.s_first_data_block != (f.sb.s_log_block_size ? 0 : 1)) {
+		pr_error("ext4: no valid superblock on %s\n", device);
+		goto out;
+	}
+	if (f.sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_RECOVER) {
+		pr_error("ext4: %s needs journal recovery\n", device);
+		goto out;
+	}
+	if ((f.sb.s_feature_compat & ~FIN_COMPAT) ||
+			(f.sb.s_feature_ro_compat & ~FIN_RO_COMPAT) ||
+			(f.sb.s_feature_incompat & ~FIN_INCOMPAT) ||
+			(f.sb.s_reserved_gdt_blocks && !(f.sb.s_feature_compat &
+				EXT4_FEATURE_COMPAT_RESIZE_INODE))) {
+		pr_verbose("ext4: %s has features only e2fsprogs handle\n",
+				device);
+		ret = 1;
+		goto out;
+	}
+
+	if (fin_parse_sb(&f.sb))
+		goto out;
+	parsed = 1;
+	f.blocks = aux_info.len_blocks;
+	f.groups = aux_info.groups;
+	/* ext4_create_fs_aux_info leaves out a small last group */
+	if (f.blocks != f.sb.s_blocks_count_lo) {
+		ret = 1;
+		goto out;
+	}
+
+	f.buf = malloc(info.block_size);
+	f.zero = calloc(1, FIN_ZERO_SIZE);
+	if (!f.buf || !f.zero) {
+		pr_error("out of memory\n");
+		goto out;
+	}
+
+	if (fin_read(&f, aux_info.bg_desc,
+			info.block_size * aux_info.bg_desc_blocks,
+			(unsigned long long)(aux_info.first_data_block + 1) *
+			info.block_size))
+		goto out;
+	if (fin_check(&f))
+		goto out;
+
+	if (ioctl(f.fd, BLKGETSIZE64, &dev_size)) {
+		if (fstat(f.fd, &statbuf)) {
+			pr_perror("fstat");
+			goto out;
+		}
+		dev_size = statbuf.st_size;
+	}
+	dev_size /= info.block_size;
+	if (dev_size > 0xffffffffULL)
+		dev_size = 0xffffffffULL;
+	if (dev_size < f.blocks) {
+		pr_error("ext4: file system larger than %s\n", device);
+		goto out;
+	}
+
+	ret = fin_plan(&f, dev_size);
+	if (ret)
+		goto out;
+	ret = -1;
+	if (f.new_blocks > f.blocks && fin_grow(&f))
+		goto out;
+
+	f.sb.s_mnt_count = 1;
+	if (fin_write_metadata(&f, f.new_blocks > f.blocks))
+		goto out;
+	ret = 0;
+
+out:
+	if (parsed)
+		ext4_free_fs_aux_info();
+	free(f.zero);
+	free(f.buf);
+	close(f.fd);
+
+	return ret;
+}
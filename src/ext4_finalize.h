@@ -0,0 +1,12 @@
+#ifndef __EXT4_FINALIZE_H
+#define __EXT4_FINALIZE_H
+
+/*
+ * check a flashed ext4 file system, grow it to fill its partition and set
+ * its mount count to 1, all in-process. Returns 0 on success, -1 if the
+ * quick check failed or on I/O errors, and 1 if the file system uses
+ * features this can't handle, so the e2fsprogs tools have to do it.
+ */
+int ext4_finalize(const char *device);
+
+#endif
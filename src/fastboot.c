@@ -41,6 +41,7 @@
 #include "fastboot.h"
 #include "tboot_util.h"
 #include "tboot_ui.h"
+#include "perf.h"
 
 struct fastboot_cmd {
 	struct fastboot_cmd *next;
@@ -274,6 +275,18 @@ void fastboot_fail(const char *reason)
 	fastboot_state = STATE_COMPLETE;
 }
 
+/*
+ * fail a command while the host is still sending its data: rather than
+ * reading the rest, the connection is dropped after FAIL so the host's
+ * transfer stops instead of running to the end
+ */
+void fastboot_cancel(const char *reason)
+{
+	pr_error("ack FAIL %s, cancelling transfer\n", reason);
+	_fastboot_ack("FAIL", reason);
+	fastboot_state = STATE_ERROR;
+}
+
 void fastboot_okay(const char *info)
 {
 	pr_debug("ack OKAY %s\n", info);
@@ -299,7 +312,13 @@ static void cmd_getvar(const char *arg, void *data, unsigned sz)
 	}
 	for (var = varlist; var; var = var->next) {
 		if (!strcmp(var->name, arg)) {
-			fastboot_okay(var->value);
+			/* an OKAY packet ends the reply, long values go as INFO */
+			if (strlen(var->value) > MAX_LEN - 5) {
+				fastboot_info(var->value);
+				fastboot_okay("");
+			} else {
+				fastboot_okay(var->value);
+			}
 			return;
 		}
 	}
@@ -322,20 +341,32 @@ static int response_data(unsigned long len)
 	return 0;
 }
 
+/* where streaming_download accounts its reads, or NULL */
+static struct perf_stats *usb_perf;
+
+void streaming_download_perf(struct perf_stats *stats)
+{
+	usb_perf = stats;
+}
+
 /*
  * this is a just wrap of usb_read used by streaming flash
  */
 int streaming_download(void **data, unsigned long len, int response)
 {
+	unsigned long long start;
 	int r;
 
 	if (response)
 		return response_data(len);
 
+	start = usb_perf ? perf_now() : 0;
 	if (usb_read(*data, len) != len) {
 		printf("short read\n");
 		return -1;
 	}
+	if (usb_perf)
+		perf_add(usb_perf, len, start);
 
 	return 0;
 }
@@ -370,6 +401,16 @@ int download_to(unsigned long size, void **data)
 	return 0;
 }
 
+/*
+ * the scratch buffer download_to() fills, for callers collecting data
+ * themselves. Returns NULL if size doesn't fit.
+ */
+void *download_buffer(unsigned long size)
+{
+	if (size > download_max)
+		return NULL;
+	return download_base;
+}
 
 static void cmd_download(const char *arg, void *data, unsigned sz)
 {
@@ -48,9 +48,16 @@ const char *fastboot_getvar(const char *name);
 void fastboot_info(const char *buf);
 void fastboot_okay(const char *result);
 void fastboot_fail(const char *reason);
+/* fail in the middle of a data phase and drop the connection */
+void fastboot_cancel(const char *reason);
+
+struct perf_stats;
 
 int streaming_download(void **data, unsigned long len, int response);
+/* account the reads of streaming_download in stats, NULL stops it */
+void streaming_download_perf(struct perf_stats *stats);
 int download_to(unsigned long size, void **data);
+void *download_buffer(unsigned long size);
 int pull_file(int fd);
 
 int is_fastboot_active(void);
@@ -0,0 +1,1670 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <zlib.h>
+
+#include <sparse/sparse.h>
+
+#include "libsparse/sparse_format.h"
+
+#include "tboot.h"
+#include "tboot_util.h"
+#include "tboot_plugin.h"
+#include "debug.h"
+#include "buffer.h"
+#include "sha256.h"
+#include "discard.h"
+#include "perf.h"
+#include "flash.h"
+
+/*
+ * size of the inflate output buffer, data is written to the device node
+ * in blocks of this size, so keep it large and page aligned.
+ */
+#define FLASH_OUT_SIZE		(1024 * 1024)
+#define FLASH_OUT_ALIGN		4096
+
+/* size of the buffer non-zero sparse fill patterns are expanded into */
+#define FLASH_FILL_SIZE		(256 * 1024)
+
+/* O_DIRECT writes must start and end on this boundary */
+#define FLASH_DIRECT_ALIGN	4096
+
+/* delta flashing compares and skips the device in blocks of this size */
+#define FLASH_DELTA_BLOCK	4096
+/* and keeps device reads queued this far ahead of the write position */
+#define FLASH_DELTA_AHEAD	(8 * 1024 * 1024)
+
+/* verification reads the device back in slots of this size */
+#define FLASH_VERIFY_SIZE	(4 * 1024 * 1024)
+#define FLASH_VERIFY_SLOTS	3
+
+#ifndef BLKZEROOUT
+#define BLKZEROOUT	_IO(0x12,127)
+#endif
+
+enum image_type {
+	IMAGE_UNKNOWN,
+	IMAGE_PLAIN,
+	IMAGE_SPARSE,
+};
+
+/*
+ * O_DIRECT device writer. The device stage gathers contiguous data in one
+ * buffer at a time and queues it, a pool of threads pwrites the queued
+ * buffers so several requests are in flight.
+ */
+struct dio_buf {
+	unsigned char *data;
+	size_t len;
+	unsigned long long pos;
+};
+
+struct dio {
+	int fd;
+	size_t size;			/* of each buffer */
+	int nr;				/* buffers, one more than threads */
+	struct dio_buf *bufs;
+	struct dio_buf **free;
+	int nr_free;
+	struct dio_buf **queue;
+	int head;
+	int nr_queued;
+	int busy;
+	int nr_threads;
+	pthread_t *threads;
+	int stop;
+	int error;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct dio_buf *cur;		/* being filled */
+	struct perf_stats perf;		/* under lock, merged on close */
+};
+
+/*
+ * digest of the data the device stage writes, in device order. A thread
+ * hashes each buffer while the device stage writes the same buffer, so
+ * nothing is copied. Don't care ranges are not part of the digest, the
+ * written extents are kept to read the same bytes back for verification.
+ */
+struct flash_extent {
+	unsigned long long start;
+	unsigned long long len;
+};
+
+struct digest {
+	struct sha256_ctx sha;
+	uint32_t crc;
+	pthread_t thread;
+	int threaded;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const unsigned char *data;	/* hashed over and over */
+	size_t size;
+	unsigned long long len;		/* total bytes to hash */
+	int pending;
+	int stop;
+	int keep_extents;
+	struct flash_extent *extents;
+	int nr_extents;
+	int max_extents;
+};
+
+/* an android sparse image being applied while it streams in */
+struct sparse_state {
+	struct sparse_push *push;
+	unsigned int block_size;
+	unsigned long long raw_bytes;
+	unsigned long long fill_bytes;
+	unsigned long long skip_bytes;
+};
+
+struct flash_stream {
+	enum flash_format format;
+	int (*write)(struct flash_stream *fs, const void *data, size_t len);
+	int (*close)(struct flash_stream *fs);
+	void (*abort)(struct flash_stream *fs);
+
+	/* shell fallback */
+	FILE *pipe;
+
+	/* platform plugin */
+	const struct flash_stream_ops *ops;
+	void *ops_priv;
+
+	/* native stages */
+	int fd;
+	z_stream zs;
+	int z_end;		/* inflate reached the end of a gzip member */
+	int z_trailing;		/* ignoring garbage after the gzip stream */
+	unsigned char *out;
+	size_t out_len;
+
+	/* decompress, device write and sync metrics */
+	struct perf perf;
+
+	/* image stage, sees decompressed data */
+	enum image_type image;
+	struct sparse_state *sparse;
+
+	/* device stage */
+	unsigned long long pos;		/* device offset of the next write */
+	unsigned long long written;
+	unsigned long long dev_size;	/* 0 if not a block device */
+	int too_large;			/* the image doesn't fit the device */
+	struct discard_queue *dq;	/* untouched ranges, or NULL */
+	struct ext4_scan *ext4;		/* free space of a plain image */
+	unsigned char *fill;
+	unsigned int fill_val;
+	int fill_valid;
+	struct dio *dio;		/* O_DIRECT writer, or NULL */
+	struct digest *digest;
+	int defer_flush;		/* device flushed later by the caller */
+	int verify;			/* read the data back on close */
+	int verified;
+	int digest_valid;
+	unsigned char sha256[SHA256_DIGEST_SIZE];
+	uint32_t crc32;
+
+	/* delta flashing */
+	int delta;
+	unsigned char *cmp;		/* device contents being compared */
+	unsigned long long ra_pos;	/* end of the queued readahead */
+	unsigned long long skipped;	/* bytes already on the device */
+};
+
+static int is_sparse_magic(const unsigned char *p, size_t len)
+{
+	return len >= 4 && (p[0] | p[1] << 8 | p[2] << 16 |
+			(unsigned int)p[3] << 24) == SPARSE_HEADER_MAGIC;
+}
+
+enum flash_format flash_detect_format(const unsigned char *magic, size_t len)
+{
+	/*
+	 * Check input stream for a gzip header or bzip2 header.
+	 * For details, please refer to
+	 * http://www.gzip.org/zlib/rfc-gzip.html#file-format
+	 * http://en.wikipedia.org/wiki/Bzip2#File_format
+	 */
+	if (len < 4)
+		return FLASH_FORMAT_RAW;
+
+	pr_verbose("4 bytes header value is: %x, %x, %x, %x\n",
+		magic[0], magic[1], magic[2], magic[3]);
+	if (is_sparse_magic(magic, len))
+		return FLASH_FORMAT_SPARSE;
+	if (magic[0] == 0x1f && magic[1] == 0x8b && magic[2] == 8)
+		return FLASH_FORMAT_GZIP;
+	if (magic[0] == 'B' && magic[1] == 'Z' &&
+			(magic[2] == 'h' || magic[2] == '0') &&
+			(magic[3] >= '1' && magic[3] <= '9'))
+		return FLASH_FORMAT_BZIP2;
+
+	return FLASH_FORMAT_RAW;
+}
+
+const char *flash_format_name(enum flash_format format)
+{
+	switch (format) {
+	case FLASH_FORMAT_GZIP:
+		return "gzip";
+	case FLASH_FORMAT_BZIP2:
+		return "bzip2";
+	case FLASH_FORMAT_SPARSE:
+		return "sparse";
+	default:
+		return "raw";
+	}
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("write");
+			return -1;
+		}
+		if (ret == 0) {
+			pr_error("no space left on device\n");
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * shell pipeline, the way images were always flashed
+ */
+static int pipe_write(struct flash_stream *fs, const void *data, size_t len)
+{
+	if (fwrite(data, 1, len, fs->pipe) != len) {
+		pr_error("short write to pipe\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pipe_close(struct flash_stream *fs)
+{
+	int ret;
+
+	ret = pclose(fs->pipe);
+	if (ret < 0) {
+		pr_perror("pclose");
+		return -1;
+	}
+	if (WEXITSTATUS(ret)) {
+		pr_error("flash command exited with %d\n", WEXITSTATUS(ret));
+		return -1;
+	}
+
+	/* dd leaves the data in the page cache */
+	if (!fs->defer_flush && flush_tracked())
+		return -1;
+
+	return 0;
+}
+
+static void pipe_abort(struct flash_stream *fs)
+{
+	pclose(fs->pipe);
+}
+
+static int stream_open_pipe(struct flash_stream *fs, const char *device)
+{
+	char *cmd_base;
+	char *cmd_line;
+
+	switch (fs->format) {
+	case FLASH_FORMAT_GZIP:
+		cmd_base = "/bin/gzip -c -d | /bin/dd of=%s bs=8192";
+		break;
+	case FLASH_FORMAT_BZIP2:
+		cmd_base = "/bin/bzip2 -c -d | /bin/dd of=%s bs=8192";
+		break;
+	default:
+		cmd_base = "/bin/dd of=%s bs=8192";
+		break;
+	}
+
+	if (asprintf(&cmd_line, cmd_base, device) < 0) {
+		pr_perror("asprintf");
+		return -1;
+	}
+
+	pr_verbose("command: %s\n", cmd_line);
+	flush_track(device);
+	fs->pipe = popen(cmd_line, "w");
+	free(cmd_line);
+	if (!fs->pipe) {
+		pr_perror("popen");
+		return -1;
+	}
+
+	fs->write = pipe_write;
+	fs->close = pipe_close;
+	fs->abort = pipe_abort;
+	return 0;
+}
+
+static int plugin_write(struct flash_stream *fs, const void *data, size_t len)
+{
+	if (fs->ops->chunk(fs->ops_priv, data, len)) {
+		pr_error("plugin refused %zu bytes at %llu\n", len, fs->written);
+		return -1;
+	}
+	fs->written += len;
+
+	return 0;
+}
+
+static int plugin_close(struct flash_stream *fs)
+{
+	if (fs->ops->end(fs->ops_priv)) {
+		pr_error("plugin flash failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pwrite_all(int fd, const void *data, size_t len, off_t offset)
+{
+	const unsigned char *p = data;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, p, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("pwrite");
+			return -1;
+		}
+		if (ret == 0) {
+			pr_error("no space left on device\n");
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+/* returns how much could be read, the end of the device reads short */
+static size_t pread_upto(int fd, void *data, size_t len, off_t offset)
+{
+	unsigned char *p = data;
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(fd, p + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret < 0)
+				pr_verbose("pread: %s\n", strerror(errno));
+			break;
+		}
+		done += ret;
+	}
+
+	return done;
+}
+
+/*
+ * delta flashing, reads back what the device holds and writes only the
+ * blocks that differ. readahead() keeps the device reads queued ahead of
+ * the usb data, so the compare finds them in the page cache.
+ */
+static void delta_readahead(struct flash_stream *fs, unsigned long long end)
+{
+	if (fs->ra_pos < fs->pos)
+		fs->ra_pos = fs->pos;
+
+	while (fs->ra_pos < end + FLASH_DELTA_AHEAD) {
+		readahead(fs->fd, fs->ra_pos, FLASH_DELTA_AHEAD / 2);
+		fs->ra_pos += FLASH_DELTA_AHEAD / 2;
+	}
+}
+
+static int delta_flush(struct flash_stream *fs, const unsigned char *data,
+		unsigned long long pos, size_t len)
+{
+	unsigned long long start;
+
+	if (!len)
+		return 0;
+	start = perf_now();
+	if (pwrite_all(fs->fd, data, len, pos))
+		return -1;
+	perf_add(&fs->perf.stage[PERF_DEVICE_WRITE], len, start);
+	fs->written += len;
+
+	return 0;
+}
+
+static int delta_write(struct flash_stream *fs, const unsigned char *data,
+		size_t len)
+{
+	size_t n, got, i, step, run_start, run_len;
+
+	while (len) {
+		n = len < FLASH_OUT_SIZE ? len : FLASH_OUT_SIZE;
+		delta_readahead(fs, fs->pos + n);
+		got = pread_upto(fs->fd, fs->cmp, n, fs->pos);
+
+		run_start = run_len = 0;
+		for (i = 0; i < n; i += step) {
+			step = FLASH_DELTA_BLOCK - (fs->pos + i) % FLASH_DELTA_BLOCK;
+			if (step > n - i)
+				step = n - i;
+
+			if (i + step > got || memcmp(fs->cmp + i, data + i, step)) {
+				if (!run_len)
+					run_start = i;
+				run_len += step;
+				continue;
+			}
+
+			fs->skipped += step;
+			if (delta_flush(fs, data + run_start, fs->pos + run_start,
+						run_len))
+				return -1;
+			run_len = 0;
+		}
+		if (delta_flush(fs, data + run_start, fs->pos + run_start, run_len))
+			return -1;
+
+		data += n;
+		len -= n;
+		fs->pos += n;
+	}
+
+	/* keep the file offset right for dev_seek and plain writes */
+	if (lseek(fs->fd, fs->pos, SEEK_SET) == (off_t)-1) {
+		pr_perror("lseek");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *dio_worker(void *arg)
+{
+	struct dio *dio = arg;
+	struct dio_buf *buf;
+	unsigned long long start;
+	int ret;
+
+	pthread_mutex_lock(&dio->lock);
+	for (;;) {
+		while (!dio->nr_queued && !dio->stop)
+			pthread_cond_wait(&dio->work, &dio->lock);
+		if (!dio->nr_queued)
+			break;
+
+		buf = dio->queue[dio->head];
+		dio->head = (dio->head + 1) % dio->nr;
+		dio->nr_queued--;
+		dio->busy++;
+		pthread_mutex_unlock(&dio->lock);
+
+		start = perf_now();
+		ret = pwrite_all(dio->fd, buf->data, buf->len, buf->pos);
+
+		pthread_mutex_lock(&dio->lock);
+		if (ret)
+			dio->error = 1;
+		else
+			perf_add(&dio->perf, buf->len, start);
+		dio->free[dio->nr_free++] = buf;
+		dio->busy--;
+		pthread_cond_broadcast(&dio->done);
+	}
+	pthread_mutex_unlock(&dio->lock);
+
+	return NULL;
+}
+
+/* wait for every queued write, returns -1 if any of them failed */
+static int dio_drain(struct dio *dio)
+{
+	unsigned long long start;
+	int ret;
+
+	pthread_mutex_lock(&dio->lock);
+	if (dio->nr_queued || dio->busy) {
+		start = perf_now();
+		while (dio->nr_queued || dio->busy)
+			pthread_cond_wait(&dio->done, &dio->lock);
+		perf_stall(&dio->perf, start);
+	}
+	ret = dio->error ? -1 : 0;
+	pthread_mutex_unlock(&dio->lock);
+
+	return ret;
+}
+
+static struct dio_buf *dio_get(struct dio *dio)
+{
+	struct dio_buf *buf = NULL;
+	unsigned long long start;
+
+	pthread_mutex_lock(&dio->lock);
+	if (!dio->nr_free && !dio->error) {
+		/* every buffer is queued, the device is the bottleneck */
+		start = perf_now();
+		while (!dio->nr_free && !dio->error)
+			pthread_cond_wait(&dio->done, &dio->lock);
+		perf_stall(&dio->perf, start);
+	}
+	if (!dio->error)
+		buf = dio->free[--dio->nr_free];
+	pthread_mutex_unlock(&dio->lock);
+
+	return buf;
+}
+
+/*
+ * queue the current buffer. A buffer only has an unaligned tail when the
+ * data stops or jumps elsewhere, that tail goes through the page cache of
+ * the normal fd once every direct write has finished, so the page cache
+ * never reads back a block that is still being written.
+ */
+static int dio_submit(struct flash_stream *fs)
+{
+	struct dio *dio = fs->dio;
+	struct dio_buf *buf = dio->cur;
+	unsigned long long pos;
+	size_t len;
+	size_t direct;
+
+	if (!buf)
+		return 0;
+	dio->cur = NULL;
+
+	pos = buf->pos;
+	len = buf->len;
+	direct = len - len % FLASH_DIRECT_ALIGN;
+
+	pthread_mutex_lock(&dio->lock);
+	if (direct) {
+		buf->len = direct;
+		dio->queue[(dio->head + dio->nr_queued) % dio->nr] = buf;
+		dio->nr_queued++;
+		pthread_cond_signal(&dio->work);
+	} else {
+		dio->free[dio->nr_free++] = buf;
+	}
+	pthread_mutex_unlock(&dio->lock);
+
+	if (direct == len)
+		return 0;
+
+	/* only this thread takes free buffers, the tail stays intact */
+	if (dio_drain(dio))
+		return -1;
+
+	return pwrite_all(fs->fd, buf->data + direct, len - direct, pos + direct);
+}
+
+static int dio_write(struct flash_stream *fs, const unsigned char *data,
+		size_t len)
+{
+	struct dio *dio = fs->dio;
+	struct dio_buf *buf;
+	size_t n;
+
+	while (len) {
+		buf = dio->cur;
+		if (buf && buf->pos + buf->len != fs->pos) {
+			if (dio_submit(fs))
+				return -1;
+			buf = NULL;
+		}
+
+		if (!buf && fs->pos % FLASH_DIRECT_ALIGN) {
+			/* unaligned start, write up to the boundary buffered */
+			n = FLASH_DIRECT_ALIGN - fs->pos % FLASH_DIRECT_ALIGN;
+			if (n > len)
+				n = len;
+			if (dio_drain(dio) || pwrite_all(fs->fd, data, n, fs->pos))
+				return -1;
+		} else {
+			if (!buf) {
+				buf = dio_get(dio);
+				if (!buf)
+					return -1;
+				buf->pos = fs->pos;
+				buf->len = 0;
+				dio->cur = buf;
+			}
+
+			n = dio->size - buf->len;
+			if (n > len)
+				n = len;
+			memcpy(buf->data + buf->len, data, n);
+			buf->len += n;
+		}
+
+		data += n;
+		len -= n;
+		fs->pos += n;
+		fs->written += n;
+
+		if (buf && buf->len == dio->size && dio_submit(fs))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void dio_free(struct dio *dio)
+{
+	int i;
+
+	pthread_mutex_lock(&dio->lock);
+	dio->stop = 1;
+	pthread_cond_broadcast(&dio->work);
+	pthread_mutex_unlock(&dio->lock);
+	for (i = 0; i < dio->nr_threads; i++)
+		pthread_join(dio->threads[i], NULL);
+
+	if (dio->bufs)
+		for (i = 0; i < dio->nr; i++)
+			free(dio->bufs[i].data);
+	if (dio->fd >= 0)
+		close(dio->fd);
+	pthread_cond_destroy(&dio->done);
+	pthread_cond_destroy(&dio->work);
+	pthread_mutex_destroy(&dio->lock);
+	free(dio->threads);
+	free(dio->queue);
+	free(dio->free);
+	free(dio->bufs);
+	free(dio);
+}
+
+/* stop the writers, writes that are queued but not started are dropped */
+static void dio_abort(struct dio *dio)
+{
+	pthread_mutex_lock(&dio->lock);
+	dio->nr_queued = 0;
+	pthread_mutex_unlock(&dio->lock);
+	dio_free(dio);
+}
+
+static int dio_close(struct flash_stream *fs)
+{
+	int ret;
+
+	ret = dio_submit(fs);
+	if (dio_drain(fs->dio))
+		ret = -1;
+	perf_merge(&fs->perf.stage[PERF_DEVICE_WRITE], &fs->dio->perf);
+	dio_free(fs->dio);
+	fs->dio = NULL;
+
+	return ret;
+}
+
+/*
+ * set up the O_DIRECT writer, buffers are as large as the flash ring
+ * slots. Returns -1 if the device can't do O_DIRECT, the caller then
+ * keeps writing through the page cache.
+ */
+static int dio_open(struct flash_stream *fs, const char *device)
+{
+	struct dio *dio;
+	char *direct;
+	int depth;
+	int size_kb;
+	int i;
+
+	direct = tboot_config_get(FLASH_DIRECT_KEY);
+	if (direct && !strcasecmp(direct, "no"))
+		return -1;
+
+	depth = atoi(tboot_config_get(FLASH_DIRECT_DEPTH_KEY));
+	if (depth < 1)
+		depth = 1;
+	size_kb = atoi(tboot_config_get(FLASH_BUFFER_SIZE_KEY)) & ~3;
+	if (size_kb < 64)
+		size_kb = 64;
+
+	dio = calloc(1, sizeof(*dio));
+	if (!dio)
+		return -1;
+	pthread_mutex_init(&dio->lock, NULL);
+	pthread_cond_init(&dio->work, NULL);
+	pthread_cond_init(&dio->done, NULL);
+	dio->size = size_kb * 1024;
+	dio->nr = depth + 1;
+
+	dio->fd = open(device, O_WRONLY | O_DIRECT);
+	if (dio->fd < 0) {
+		pr_verbose("O_DIRECT open of %s failed: %s\n", device,
+				strerror(errno));
+		goto err;
+	}
+
+	dio->bufs = calloc(dio->nr, sizeof(*dio->bufs));
+	dio->free = calloc(dio->nr, sizeof(*dio->free));
+	dio->queue = calloc(dio->nr, sizeof(*dio->queue));
+	dio->threads = calloc(depth, sizeof(*dio->threads));
+	if (!dio->bufs || !dio->free || !dio->queue || !dio->threads)
+		goto err;
+
+	for (i = 0; i < dio->nr; i++) {
+		if (posix_memalign((void **)&dio->bufs[i].data,
+					FLASH_DIRECT_ALIGN, dio->size)) {
+			dio->bufs[i].data = NULL;
+			goto err;
+		}
+		dio->free[dio->nr_free++] = &dio->bufs[i];
+	}
+
+	for (i = 0; i < depth; i++) {
+		if (pthread_create(&dio->threads[i], NULL, dio_worker, dio))
+			break;
+		dio->nr_threads++;
+	}
+	if (!dio->nr_threads)
+		goto err;
+
+	pr_verbose("O_DIRECT writer: %d x %d KB in flight\n",
+			dio->nr_threads, size_kb);
+	fs->dio = dio;
+	return 0;
+
+err:
+	dio_free(dio);
+	return -1;
+}
+
+static void digest_hash(struct digest *d, const unsigned char *data,
+		size_t size, unsigned long long len)
+{
+	size_t n;
+
+	while (len) {
+		n = len < size ? len : size;
+		sha256_update(&d->sha, data, n);
+		d->crc = crc32(d->crc, data, n);
+		len -= n;
+	}
+}
+
+static void *digest_worker(void *arg)
+{
+	struct digest *d = arg;
+
+	pthread_mutex_lock(&d->lock);
+	for (;;) {
+		while (!d->pending && !d->stop)
+			pthread_cond_wait(&d->cond, &d->lock);
+		if (!d->pending)
+			break;
+		pthread_mutex_unlock(&d->lock);
+
+		digest_hash(d, d->data, d->size, d->len);
+
+		pthread_mutex_lock(&d->lock);
+		d->pending = 0;
+		pthread_cond_broadcast(&d->cond);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return NULL;
+}
+
+static int digest_add_extent(struct digest *d, unsigned long long start,
+		unsigned long long len)
+{
+	struct flash_extent *e;
+
+	if (d->nr_extents) {
+		e = &d->extents[d->nr_extents - 1];
+		if (e->start + e->len == start) {
+			e->len += len;
+			return 0;
+		}
+	}
+
+	if (d->nr_extents == d->max_extents) {
+		d->max_extents = d->max_extents ? d->max_extents * 2 : 64;
+		e = realloc(d->extents, d->max_extents * sizeof(*e));
+		if (!e) {
+			pr_error("out of memory\n");
+			return -1;
+		}
+		d->extents = e;
+	}
+	e = &d->extents[d->nr_extents++];
+	e->start = start;
+	e->len = len;
+
+	return 0;
+}
+
+/*
+ * start hashing len bytes at device offset pos, the size bytes at data
+ * repeat until len is reached. data must stay untouched until
+ * digest_wait() returns.
+ */
+static int digest_start(struct flash_stream *fs, const void *data,
+		size_t size, unsigned long long len)
+{
+	struct digest *d = fs->digest;
+
+	if (!d || !len)
+		return 0;
+	if (d->keep_extents && digest_add_extent(d, fs->pos, len))
+		return -1;
+
+	if (!d->threaded) {
+		digest_hash(d, data, size, len);
+		return 0;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	d->data = data;
+	d->size = size;
+	d->len = len;
+	d->pending = 1;
+	pthread_cond_signal(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+
+	return 0;
+}
+
+static void digest_wait(struct flash_stream *fs)
+{
+	struct digest *d = fs->digest;
+
+	if (!d || !d->threaded)
+		return;
+
+	pthread_mutex_lock(&d->lock);
+	while (d->pending)
+		pthread_cond_wait(&d->cond, &d->lock);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void digest_free(struct digest *d)
+{
+	if (d->threaded) {
+		pthread_mutex_lock(&d->lock);
+		d->stop = 1;
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+		pthread_join(d->thread, NULL);
+	}
+	pthread_cond_destroy(&d->cond);
+	pthread_mutex_destroy(&d->lock);
+	free(d->extents);
+	free(d);
+}
+
+static int digest_open(struct flash_stream *fs)
+{
+	struct digest *d;
+
+	d = calloc(1, sizeof(*d));
+	if (!d) {
+		pr_error("out of memory\n");
+		return -1;
+	}
+	sha256_init(&d->sha);
+	d->crc = crc32(0, NULL, 0);
+	d->keep_extents = fs->verify;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->cond, NULL);
+
+	/* without the thread the device stage hashes inline */
+	d->threaded = !pthread_create(&d->thread, NULL, digest_worker, d);
+	fs->digest = d;
+
+	return 0;
+}
+
+struct verify_reader {
+	int fd;
+	struct digest *digest;
+	struct ring *ring;
+	int ret;
+};
+
+/* reads the written extents in large sequential slots */
+static void *verify_read(void *arg)
+{
+	struct verify_reader *v = arg;
+	struct flash_extent *e;
+	struct ring_slot *slot;
+	unsigned long long pos;
+	size_t n;
+	int i;
+
+	for (i = 0; i < v->digest->nr_extents; i++) {
+		e = &v->digest->extents[i];
+		posix_fadvise(v->fd, e->start, e->len, POSIX_FADV_SEQUENTIAL);
+		for (pos = e->start; pos < e->start + e->len; pos += n) {
+			slot = ring_get_empty(v->ring);
+			if (!slot)
+				goto out;
+			n = e->start + e->len - pos < slot->size ?
+				e->start + e->len - pos : slot->size;
+			slot->len = pread_upto(v->fd, slot->data, n, pos);
+			if (slot->len != n) {
+				pr_error("short read back at %llu\n", pos);
+				v->ret = -1;
+				ring_abort(v->ring);
+				goto out;
+			}
+			ring_put_full(v->ring, slot);
+		}
+	}
+out:
+	ring_close(v->ring);
+	return NULL;
+}
+
+/*
+ * read the written data back after the flush and hash it again. One
+ * thread reads ahead while this one hashes, the digests must match.
+ */
+static int dev_verify(struct flash_stream *fs, const unsigned char *digest)
+{
+	struct verify_reader v = { fs->fd, fs->digest, NULL, 0 };
+	struct sha256_ctx sha;
+	unsigned char got[SHA256_DIGEST_SIZE];
+	struct ring_slot *slot;
+	pthread_t t;
+
+	v.ring = ring_init(FLASH_VERIFY_SLOTS, FLASH_VERIFY_SIZE);
+	if (!v.ring)
+		return -1;
+	if (pthread_create(&t, NULL, verify_read, &v)) {
+		ring_free(v.ring);
+		return -1;
+	}
+
+	sha256_init(&sha);
+	while ((slot = ring_get_full(v.ring)) != NULL) {
+		sha256_update(&sha, slot->data, slot->len);
+		ring_put_empty(v.ring, slot);
+	}
+	pthread_join(t, NULL);
+	ring_free(v.ring);
+	if (v.ret)
+		return -1;
+
+	sha256_final(&sha, got);
+	if (memcmp(got, digest, SHA256_DIGEST_SIZE)) {
+		pr_error("read back digest differs from the written data\n");
+		fs->verified = -1;
+		return -1;
+	}
+	pr_debug("read back digest verified\n");
+	fs->verified = 1;
+
+	return 0;
+}
+
+/*
+ * device stage, writes at a tracked offset so sparse images can seek
+ */
+static int dev_write_data(struct flash_stream *fs, const void *data,
+		size_t len)
+{
+	unsigned long long start;
+
+	if (fs->delta)
+		return delta_write(fs, data, len);
+	if (fs->dio)
+		return dio_write(fs, data, len);
+
+	start = perf_now();
+	if (write_all(fs->fd, data, len))
+		return -1;
+	perf_add(&fs->perf.stage[PERF_DEVICE_WRITE], len, start);
+	fs->pos += len;
+	fs->written += len;
+
+	return 0;
+}
+
+static int dev_write(struct flash_stream *fs, const void *data, size_t len)
+{
+	int ret;
+
+	if (fs->dev_size && fs->pos + len > fs->dev_size) {
+		pr_error("image larger than the device (%llu bytes)\n",
+				fs->dev_size);
+		fs->too_large = 1;
+		return -1;
+	}
+
+	if (digest_start(fs, data, len, len))
+		return -1;
+	ret = dev_write_data(fs, data, len);
+	digest_wait(fs);
+
+	return ret;
+}
+
+static int dev_seek(struct flash_stream *fs, unsigned long long len)
+{
+	if (lseek(fs->fd, fs->pos + len, SEEK_SET) == (off_t)-1) {
+		pr_perror("lseek");
+		return -1;
+	}
+	fs->pos += len;
+
+	return 0;
+}
+
+static int dev_skip(struct flash_stream *fs, unsigned long long len)
+{
+	if (fs->dq)
+		discard_queue_add(fs->dq, fs->pos, len);
+
+	return dev_seek(fs, len);
+}
+
+static int fill_prepare(struct flash_stream *fs, unsigned int val)
+{
+	unsigned int *p;
+
+	if (!fs->fill && posix_memalign((void **)&fs->fill, FLASH_OUT_ALIGN,
+				FLASH_FILL_SIZE)) {
+		pr_error("out of memory\n");
+		fs->fill = NULL;
+		return -1;
+	}
+	if (!fs->fill_valid || fs->fill_val != val) {
+		for (p = (unsigned int *)fs->fill;
+				p < (unsigned int *)(fs->fill + FLASH_FILL_SIZE); p++)
+			*p = val;
+		fs->fill_val = val;
+		fs->fill_valid = 1;
+	}
+
+	return 0;
+}
+
+static int dev_fill(struct flash_stream *fs, unsigned int val,
+		unsigned long long len)
+{
+	unsigned long long range[2] = { fs->pos, len };
+	unsigned long long start;
+	size_t n;
+	int ret;
+
+	if (fill_prepare(fs, val))
+		return -1;
+
+	/* delta flashing compares fills too, zeroing would rewrite them */
+	if (!val && !fs->delta) {
+		/* the zeroes are hashed while the device zeroes the range */
+		if (digest_start(fs, fs->fill, FLASH_FILL_SIZE, len))
+			return -1;
+		start = perf_now();
+		ret = ioctl(fs->fd, BLKZEROOUT, &range);
+		digest_wait(fs);
+		if (!ret) {
+			perf_add(&fs->perf.stage[PERF_DEVICE_WRITE], len, start);
+			return dev_seek(fs, len);
+		}
+		/* written below, the digest already has the zeroes */
+		while (len) {
+			n = len < FLASH_FILL_SIZE ? len : FLASH_FILL_SIZE;
+			if (dev_write_data(fs, fs->fill, n))
+				return -1;
+			len -= n;
+		}
+		return 0;
+	}
+
+	while (len) {
+		n = len < FLASH_FILL_SIZE ? len : FLASH_FILL_SIZE;
+		if (dev_write(fs, fs->fill, n))
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * the data is only on the device after a flush of its write cache,
+ * flushing the device does it for this stream alone. ret is -1 if an
+ * earlier stage failed, the free blocks of the image are not discarded
+ * then.
+ */
+static int dev_close(struct flash_stream *fs, int ret)
+{
+	unsigned long long start;
+
+	if (fs->dio && dio_close(fs))
+		ret = -1;
+	/* verification must read what is on the device */
+	if (!fs->defer_flush || fs->verify) {
+		start = perf_now();
+		if (flush_fd(fs->fd))
+			ret = -1;
+		perf_add(&fs->perf.stage[PERF_SYNC], 0, start);
+	}
+	if (fs->digest) {
+		sha256_final(&fs->digest->sha, fs->sha256);
+		fs->crc32 = fs->digest->crc;
+		fs->digest_valid = 1;
+		if (!ret && fs->verify && dev_verify(fs, fs->sha256))
+			ret = -1;
+		digest_free(fs->digest);
+		fs->digest = NULL;
+	}
+	/* free blocks read back differently, so only after verification */
+	if (fs->ext4) {
+		ext4_scan_finish(fs->ext4, ret ? NULL : fs->dq, fs->dev_size);
+		fs->ext4 = NULL;
+	}
+	if (fs->dq) {
+		discard_queue_finish(fs->dq);
+		fs->dq = NULL;
+	}
+	if (close(fs->fd)) {
+		pr_perror("close");
+		ret = -1;
+	}
+	free(fs->fill);
+	free(fs->cmp);
+	pr_debug("wrote %llu bytes to device\n", fs->written);
+	if (fs->delta)
+		pr_debug("delta: %llu bytes unchanged\n", fs->skipped);
+
+	return ret;
+}
+
+/*
+ * sparse image stage, libsparse parses the chunks in stream order and the
+ * callbacks apply them to the device. CRC32 chunks are checked against
+ * the data expanded so far.
+ */
+static int sparse_on_header(void *priv, unsigned int block_size,
+		unsigned int total_blocks, unsigned int total_chunks)
+{
+	struct flash_stream *fs = priv;
+	unsigned long long size = (unsigned long long)total_blocks * block_size;
+
+	pr_debug("sparse image: %u blocks of %u bytes in %u chunks\n",
+			total_blocks, block_size, total_chunks);
+	if (fs->dev_size && size > fs->dev_size) {
+		pr_error("sparse image expands to %llu bytes, device has %llu\n",
+				size, fs->dev_size);
+		fs->too_large = 1;
+		return -1;
+	}
+	fs->sparse->block_size = block_size;
+
+	return 0;
+}
+
+static int sparse_on_raw(void *priv, unsigned int block, unsigned int offset,
+		const void *data, unsigned int len)
+{
+	struct flash_stream *fs = priv;
+
+	fs->sparse->raw_bytes += len;
+	return dev_write(fs, data, len) ? -EIO : 0;
+}
+
+static int sparse_on_fill(void *priv, unsigned int block, unsigned int blocks,
+		uint32_t fill_val)
+{
+	struct flash_stream *fs = priv;
+	unsigned long long len;
+
+	len = (unsigned long long)blocks * fs->sparse->block_size;
+	fs->sparse->fill_bytes += len;
+	return dev_fill(fs, fill_val, len) ? -EIO : 0;
+}
+
+static int sparse_on_skip(void *priv, unsigned int block, unsigned int blocks)
+{
+	struct flash_stream *fs = priv;
+	unsigned long long len;
+
+	len = (unsigned long long)blocks * fs->sparse->block_size;
+	fs->sparse->skip_bytes += len;
+	return dev_skip(fs, len) ? -EIO : 0;
+}
+
+static const struct sparse_push_ops sparse_ops = {
+	.on_header = sparse_on_header,
+	.on_raw = sparse_on_raw,
+	.on_fill = sparse_on_fill,
+	.on_skip = sparse_on_skip,
+};
+
+static int sparse_open(struct flash_stream *fs)
+{
+	fs->sparse = calloc(1, sizeof(*fs->sparse));
+	if (!fs->sparse) {
+		pr_error("out of memory\n");
+		return -1;
+	}
+
+	fs->sparse->push = sparse_push_new(&sparse_ops, fs, true, true);
+	if (!fs->sparse->push) {
+		pr_error("out of memory\n");
+		free(fs->sparse);
+		fs->sparse = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int sparse_write(struct flash_stream *fs, const void *data, size_t len)
+{
+	int ret;
+
+	ret = sparse_push_data(fs->sparse->push, data, len);
+	if (ret < 0) {
+		pr_error("bad sparse image: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int sparse_close(struct flash_stream *fs)
+{
+	struct sparse_state *sp = fs->sparse;
+	int ret = 0;
+
+	if (sparse_push_finish(sp->push)) {
+		pr_error("sparse image is truncated\n");
+		ret = -1;
+	} else {
+		pr_debug("sparse image: %llu bytes written, %llu filled, "
+				"%llu skipped\n", sp->raw_bytes, sp->fill_bytes,
+				sp->skip_bytes);
+	}
+	sparse_push_destroy(sp->push);
+	free(sp);
+	fs->sparse = NULL;
+
+	return ret;
+}
+
+/*
+ * image stage, decides from the first decompressed bytes whether the
+ * data is a plain partition image or an android sparse image
+ */
+static int image_write(struct flash_stream *fs, const void *data, size_t len)
+{
+	if (!len)
+		return 0;
+
+	if (fs->image == IMAGE_UNKNOWN) {
+		fs->image = IMAGE_PLAIN;
+		if (is_sparse_magic(data, len)) {
+			if (sparse_open(fs))
+				return -1;
+			fs->image = IMAGE_SPARSE;
+		} else if (fs->dq) {
+			fs->ext4 = ext4_scan_new();
+		}
+	}
+
+	if (fs->image == IMAGE_SPARSE)
+		return sparse_write(fs, data, len);
+
+	if (fs->ext4)
+		ext4_scan_data(fs->ext4, fs->pos, data, len);
+	return dev_write(fs, data, len);
+}
+
+static int image_close(struct flash_stream *fs)
+{
+	int ret = 0;
+
+	if (fs->image == IMAGE_SPARSE && sparse_close(fs))
+		ret = -1;
+
+	return dev_close(fs, ret);
+}
+
+/*
+ * drop a partial image: nothing is flushed, verified or discarded, data
+ * the writers already took may still reach the device
+ */
+static void image_abort(struct flash_stream *fs)
+{
+	if (fs->sparse) {
+		sparse_push_destroy(fs->sparse->push);
+		free(fs->sparse);
+		fs->sparse = NULL;
+	}
+	if (fs->dio) {
+		dio_abort(fs->dio);
+		fs->dio = NULL;
+	}
+	if (fs->digest) {
+		digest_free(fs->digest);
+		fs->digest = NULL;
+	}
+	if (fs->ext4) {
+		ext4_scan_finish(fs->ext4, NULL, 0);
+		fs->ext4 = NULL;
+	}
+	if (fs->dq) {
+		discard_queue_abort(fs->dq);
+		fs->dq = NULL;
+	}
+	close(fs->fd);
+	free(fs->fill);
+	free(fs->cmp);
+}
+
+/*
+ * native stages, data goes straight from the usb buffers to the device
+ */
+static int raw_write(struct flash_stream *fs, const void *data, size_t len)
+{
+	return image_write(fs, data, len);
+}
+
+static int raw_close(struct flash_stream *fs)
+{
+	return image_close(fs);
+}
+
+/* the decompress stage stalls while the device stage takes its output */
+static int gzip_flush(struct flash_stream *fs)
+{
+	unsigned long long start;
+	int ret;
+
+	if (!fs->out_len)
+		return 0;
+	start = perf_now();
+	ret = image_write(fs, fs->out, fs->out_len);
+	perf_stall(&fs->perf.stage[PERF_DECOMPRESS], start);
+	if (ret)
+		return -1;
+	fs->out_len = 0;
+
+	return 0;
+}
+
+static int gzip_write(struct flash_stream *fs, const void *data, size_t len)
+{
+	z_stream *zs = &fs->zs;
+	unsigned long long start;
+	unsigned int avail_in;
+	int ret;
+
+	if (fs->z_trailing)
+		return 0;
+
+	zs->next_in = (unsigned char *)data;
+	zs->avail_in = len;
+
+	while (zs->avail_in) {
+		if (fs->z_end) {
+			/*
+			 * concatenated gzip members are valid gzip data. A
+			 * member may start on the last byte of a slot, then
+			 * inflate checks the rest of its header
+			 */
+			if (zs->next_in[0] == 0x1f && (zs->avail_in == 1 ||
+						zs->next_in[1] == 0x8b)) {
+				inflateReset(zs);
+				fs->z_end = 0;
+			} else {
+				pr_warning("trailing garbage after gzip data ignored\n");
+				fs->z_trailing = 1;
+				break;
+			}
+		}
+
+		zs->next_out = fs->out + fs->out_len;
+		zs->avail_out = FLASH_OUT_SIZE - fs->out_len;
+		avail_in = zs->avail_in;
+		start = perf_now();
+		ret = inflate(zs, Z_NO_FLUSH);
+		/* counts the compressed bytes */
+		perf_add(&fs->perf.stage[PERF_DECOMPRESS],
+				avail_in - zs->avail_in, start);
+		fs->out_len = FLASH_OUT_SIZE - zs->avail_out;
+
+		switch (ret) {
+		case Z_OK:
+			break;
+		case Z_STREAM_END:
+			fs->z_end = 1;
+			break;
+		case Z_BUF_ERROR:
+			/* no progress possible, output buffer is full */
+			if (zs->avail_out)
+				return 0;
+			break;
+		default:
+			pr_error("zlib inflate error %d: %s\n", ret,
+					zs->msg ? zs->msg : "");
+			return -1;
+		}
+
+		if (fs->out_len == FLASH_OUT_SIZE && gzip_flush(fs))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int gzip_close(struct flash_stream *fs)
+{
+	int ret = 0;
+
+	if (gzip_flush(fs))
+		ret = -1;
+	if (!fs->z_end) {
+		pr_error("gzip stream is truncated\n");
+		ret = -1;
+	}
+	inflateEnd(&fs->zs);
+	free(fs->out);
+
+	if (fs->image == IMAGE_SPARSE && sparse_close(fs))
+		ret = -1;
+
+	return dev_close(fs, ret);
+}
+
+static void gzip_abort(struct flash_stream *fs)
+{
+	inflateEnd(&fs->zs);
+	free(fs->out);
+	image_abort(fs);
+}
+
+static int stream_open_native(struct flash_stream *fs, const char *device)
+{
+	char *discard;
+	int ret;
+
+	if (fs->format == FLASH_FORMAT_BZIP2)
+		return -1;
+
+	fs->fd = open(device, fs->delta || fs->verify ? O_RDWR : O_WRONLY);
+	if (fs->fd < 0) {
+		pr_error("can't open %s: %s\n", device, strerror(errno));
+		return -1;
+	}
+	if (ioctl(fs->fd, BLKGETSIZE64, &fs->dev_size))
+		fs->dev_size = 0;
+
+	if (fs->delta && posix_memalign((void **)&fs->cmp, FLASH_OUT_ALIGN,
+				FLASH_OUT_SIZE)) {
+		pr_error("out of memory\n");
+		fs->cmp = NULL;
+		goto err;
+	}
+
+	if (digest_open(fs))
+		goto err;
+	if (fs->defer_flush)
+		flush_track(device);
+
+	discard = tboot_config_get(FLASH_DISCARD_KEY);
+	if (discard && !strcasecmp(discard, "yes"))
+		fs->dq = discard_queue_new(fs->fd);
+
+	/* delta flashing writes scattered blocks, keep it buffered */
+	if (!fs->delta && dio_open(fs, device))
+		pr_verbose("writing %s through the page cache\n", device);
+
+	if (fs->format != FLASH_FORMAT_GZIP) {
+		fs->write = raw_write;
+		fs->close = raw_close;
+		fs->abort = image_abort;
+		return 0;
+	}
+
+	if (posix_memalign((void **)&fs->out, FLASH_OUT_ALIGN, FLASH_OUT_SIZE)) {
+		pr_error("out of memory\n");
+		goto err;
+	}
+
+	/* 15 + 16: window size for gzip decoding only */
+	ret = inflateInit2(&fs->zs, 15 + 16);
+	if (ret != Z_OK) {
+		pr_error("zlib inflateInit error %d\n", ret);
+		goto err;
+	}
+
+	fs->write = gzip_write;
+	fs->close = gzip_close;
+	fs->abort = gzip_abort;
+	return 0;
+
+err:
+	if (fs->dio) {
+		dio_free(fs->dio);
+		fs->dio = NULL;
+	}
+	if (fs->dq) {
+		discard_queue_finish(fs->dq);
+		fs->dq = NULL;
+	}
+	if (fs->digest) {
+		digest_free(fs->digest);
+		fs->digest = NULL;
+	}
+	free(fs->out);
+	fs->out = NULL;
+	free(fs->cmp);
+	fs->cmp = NULL;
+	close(fs->fd);
+	fs->fd = -1;
+	return -1;
+}
+
+struct flash_stream *flash_stream_open(const char *device,
+		enum flash_format format, unsigned int flags)
+{
+	struct flash_stream *fs;
+	char *native;
+
+	fs = calloc(1, sizeof(*fs));
+	if (!fs) {
+		pr_error("out of memory\n");
+		return NULL;
+	}
+	fs->format = format;
+	fs->fd = -1;
+	fs->delta = !!(flags & FLASH_DELTA);
+	fs->verify = !!(flags & FLASH_VERIFY);
+	fs->defer_flush = !!(flags & FLASH_DEFER_FLUSH);
+
+	/*
+	 * there is no shell tool for sparse images or delta flashing, and
+	 * only the native stages can verify
+	 */
+	native = tboot_config_get(NATIVE_FLASH_KEY);
+	if (!native || strcasecmp(native, "no") ||
+			format == FLASH_FORMAT_SPARSE || fs->delta || fs->verify) {
+		if (!stream_open_native(fs, device)) {
+			pr_debug("flashing %s image natively%s%s\n",
+					flash_format_name(format),
+					fs->delta ? ", delta" : "",
+					fs->verify ? ", verify" : "");
+			return fs;
+		}
+		if (format == FLASH_FORMAT_SPARSE || fs->delta || fs->verify)
+			goto err;
+		if (format != FLASH_FORMAT_BZIP2)
+			pr_warning("native flash unavailable, using shell\n");
+	}
+
+	if (!stream_open_pipe(fs, device))
+		return fs;
+
+err:
+	free(fs);
+	return NULL;
+}
+
+struct flash_stream *flash_stream_open_plugin(const struct flash_stream_ops *ops,
+		const char *name, unsigned long long size)
+{
+	struct flash_stream *fs;
+
+	fs = calloc(1, sizeof(*fs));
+	if (!fs) {
+		pr_error("out of memory\n");
+		return NULL;
+	}
+	fs->fd = -1;
+	fs->ops = ops;
+
+	if (ops->begin(name, size, &fs->ops_priv)) {
+		pr_error("plugin refused %s\n", name);
+		free(fs);
+		return NULL;
+	}
+
+	fs->write = plugin_write;
+	fs->close = plugin_close;
+	return fs;
+}
+
+int flash_stream_write(struct flash_stream *fs, const void *data, size_t len)
+{
+	return fs->write(fs, data, len);
+}
+
+int flash_stream_close(struct flash_stream *fs, struct flash_stats *stats)
+{
+	int ret;
+
+	ret = fs->close(fs);
+	if (stats) {
+		stats->written = fs->written;
+		stats->skipped = fs->skipped;
+		stats->digest_valid = fs->digest_valid;
+		memcpy(stats->sha256, fs->sha256, sizeof(stats->sha256));
+		stats->crc32 = fs->crc32;
+		stats->verified = fs->verified;
+		perf_merge_all(&stats->perf, &fs->perf);
+	}
+	free(fs);
+
+	return ret;
+}
+
+int flash_stream_too_large(struct flash_stream *fs)
+{
+	return fs->too_large;
+}
+
+void flash_stream_abort(struct flash_stream *fs)
+{
+	if (!fs->ops)
+		fs->abort(fs);
+	else if (fs->ops->abort)
+		fs->ops->abort(fs->ops_priv);
+	free(fs);
+}
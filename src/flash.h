@@ -0,0 +1,85 @@
+#ifndef __FLASH_H
+#define __FLASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+#include "perf.h"
+
+/* image formats recognised by the stream flash pipeline */
+enum flash_format {
+	FLASH_FORMAT_RAW,
+	FLASH_FORMAT_GZIP,
+	FLASH_FORMAT_BZIP2,
+	FLASH_FORMAT_SPARSE,
+};
+
+/* flash_stream_open flags */
+#define FLASH_DELTA	(1 << 0)	/* only write blocks that differ */
+#define FLASH_VERIFY	(1 << 1)	/* read back and compare the digest */
+#define FLASH_DEFER_FLUSH (1 << 2)	/* leave the flush to flush_tracked() */
+
+struct flash_stream;
+struct flash_stream_ops;
+
+struct flash_stats {
+	unsigned long long written;	/* bytes written to the device */
+	unsigned long long skipped;	/* bytes the device already held */
+	int digest_valid;		/* only the native stages hash */
+	unsigned char sha256[SHA256_DIGEST_SIZE];
+	uint32_t crc32;
+	int verified;			/* 1 matched, -1 differed, 0 not read back */
+	struct perf perf;		/* decompress, write and sync stages */
+};
+
+enum flash_format flash_detect_format(const unsigned char *magic, size_t len);
+const char *flash_format_name(enum flash_format format);
+
+/*
+ * open a stream which writes an image in the given format to device.
+ *
+ * gzip and raw images are decompressed and written in-process, unless
+ * native flashing is disabled by config. Other formats, or a failure to
+ * set up the native stages, fall back to a gzip/bzip2/dd shell pipeline.
+ * Android sparse images, plain or inside gzip, are always applied in-process
+ * chunk by chunk: raw chunks are written, fill chunks expanded or zeroed
+ * with BLKZEROOUT and don't care chunks seeked over. With flash_discard
+ * the don't care ranges, and the free blocks of plain ext4 images, are
+ * discarded in the background, see discard.h.
+ *
+ * With FLASH_DELTA the device is read back ahead of the data and only the
+ * blocks that differ are written. Delta flashing is always in-process.
+ *
+ * In-process streams hash what they write, in device order and without
+ * the don't care ranges of sparse images, with SHA-256 and CRC32. With
+ * FLASH_VERIFY the stream reads those bytes back once they are flushed
+ * and fails if their SHA-256 differs.
+ */
+struct flash_stream *flash_stream_open(const char *device,
+		enum flash_format format, unsigned int flags);
+/*
+ * open a stream which hands the image to plugin callbacks instead of a
+ * device, see struct flash_stream_ops. Returns NULL if begin() refused it.
+ */
+struct flash_stream *flash_stream_open_plugin(const struct flash_stream_ops *ops,
+		const char *name, unsigned long long size);
+int flash_stream_write(struct flash_stream *fs, const void *data, size_t len);
+/*
+ * flush pending data and release the stream, returns 0 on success.
+ * stats, if not NULL, is filled in with what was written. The stage
+ * metrics are added to stats->perf, so several streams can be summed up.
+ */
+int flash_stream_close(struct flash_stream *fs, struct flash_stats *stats);
+/*
+ * true if the last write failed because the image, or the size announced
+ * by a sparse header, doesn't fit the device
+ */
+int flash_stream_too_large(struct flash_stream *fs);
+/*
+ * release the stream after a failure, plugins get abort() instead of end().
+ * A partial image is dropped without flushing, verifying or discarding.
+ */
+void flash_stream_abort(struct flash_stream *fs);
+
+#endif
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "perf.h"
+
+static const char *stage_names[PERF_NR_STAGES] = {
+	[PERF_USB_READ] = "usb",
+	[PERF_BUFFER_WAIT] = "buffer",
+	[PERF_DECOMPRESS] = "inflate",
+	[PERF_DEVICE_WRITE] = "write",
+	[PERF_SYNC] = "sync",
+};
+
+unsigned long long perf_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static unsigned int perf_bucket(unsigned long long us)
+{
+	unsigned int b = 0;
+
+	for (us >>= 6; us && b < PERF_BUCKETS - 1; us >>= 2)
+		b++;
+
+	return b;
+}
+
+unsigned long long perf_add(struct perf_stats *s, unsigned long long bytes,
+		unsigned long long start)
+{
+	unsigned long long now = perf_now();
+	/* the wall clock may step back */
+	unsigned long long us = now > start ? now - start : 0;
+
+	s->ops++;
+	s->bytes += bytes;
+	s->busy_us += us;
+	if (us > s->max_us)
+		s->max_us = us;
+	s->hist[perf_bucket(us)]++;
+
+	return now;
+}
+
+unsigned long long perf_stall(struct perf_stats *s, unsigned long long start)
+{
+	unsigned long long now = perf_now();
+
+	if (now > start)
+		s->stall_us += now - start;
+
+	return now;
+}
+
+void perf_merge(struct perf_stats *to, const struct perf_stats *from)
+{
+	int i;
+
+	to->ops += from->ops;
+	to->bytes += from->bytes;
+	to->busy_us += from->busy_us;
+	to->stall_us += from->stall_us;
+	if (from->max_us > to->max_us)
+		to->max_us = from->max_us;
+	for (i = 0; i < PERF_BUCKETS; i++)
+		to->hist[i] += from->hist[i];
+}
+
+void perf_merge_all(struct perf *to, const struct perf *from)
+{
+	int i;
+
+	for (i = 0; i < PERF_NR_STAGES; i++)
+		perf_merge(&to->stage[i], &from->stage[i]);
+}
+
+void perf_format(const struct perf *p, unsigned long long total_us,
+		char *buf, size_t size)
+{
+	const struct perf_stats *s;
+	size_t len;
+	int i;
+	int j;
+
+	len = snprintf(buf, size, "total_us=%llu", total_us);
+	for (i = 0; i < PERF_NR_STAGES && len < size; i++) {
+		s = &p->stage[i];
+		len += snprintf(buf + len, size - len, " %s.bytes=%llu "
+				"%s.busy_us=%llu %s.stall_us=%llu %s.ops=%llu "
+				"%s.max_us=%llu %s.hist=",
+				stage_names[i], s->bytes, stage_names[i],
+				s->busy_us, stage_names[i], s->stall_us,
+				stage_names[i], s->ops, stage_names[i],
+				s->max_us, stage_names[i]);
+		for (j = 0; j < PERF_BUCKETS && len < size; j++)
+			len += snprintf(buf + len, size - len, "%s%u",
+					j ? "/" : "", s->hist[j]);
+	}
+}
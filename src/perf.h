@@ -0,0 +1,53 @@
+#ifndef __PERF_H
+#define __PERF_H
+
+#include <stddef.h>
+
+/*
+ * stage metrics of the flash pipeline. Every stage counts the bytes it
+ * handled and how long it was busy, with a histogram of the latency of
+ * single operations, and how long it stalled waiting for the next stage.
+ * A set of stats is only updated by one thread, so no locking is done.
+ */
+enum perf_stage {
+	PERF_USB_READ,		/* usb reads, stalls on a full ring */
+	PERF_BUFFER_WAIT,	/* the reader waiting for a full slot */
+	PERF_DECOMPRESS,	/* inflate, stalls on the device stage */
+	PERF_DEVICE_WRITE,	/* device writes, stalls on the O_DIRECT queue */
+	PERF_SYNC,		/* device flushes */
+	PERF_NR_STAGES,
+};
+
+/* latency buckets, powers of 4 from 64us: <64us, <256us, ... <4s, >=4s */
+#define PERF_BUCKETS		10
+
+struct perf_stats {
+	unsigned long long ops;
+	unsigned long long bytes;
+	unsigned long long busy_us;
+	unsigned long long stall_us;
+	unsigned long long max_us;
+	unsigned int hist[PERF_BUCKETS];
+};
+
+struct perf {
+	struct perf_stats stage[PERF_NR_STAGES];
+};
+
+/* a timestamp in microseconds */
+unsigned long long perf_now(void);
+/* account one operation which started at start, returns the current time */
+unsigned long long perf_add(struct perf_stats *s, unsigned long long bytes,
+		unsigned long long start);
+/* account a stall which started at start, returns the current time */
+unsigned long long perf_stall(struct perf_stats *s, unsigned long long start);
+void perf_merge(struct perf_stats *to, const struct perf_stats *from);
+void perf_merge_all(struct perf *to, const struct perf *from);
+/*
+ * one line of key=value pairs, "total_us=... usb.bytes=... usb.busy_us=...
+ * usb.stall_us=... usb.ops=... usb.max_us=... usb.hist=n/n/... buffer..."
+ */
+void perf_format(const struct perf *p, unsigned long long total_us,
+		char *buf, size_t size);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE	32
+
+/* FIPS 180-4 SHA-256, fed incrementally */
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t count;		/* bytes hashed so far */
+	unsigned char buf[64];	/* partial block */
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+#endif
@@ -141,8 +141,8 @@ void set_platform_provision_function(int (*fn)(void))
  * as the partition that we're performing this routine on, verify its
  * integrity and resize it instead of formatting.
  *
- * Note that erase_partition does a 'quick' format; the disk is not zeroed
- * out. */
+ * Note that erase_partition discards the partition and does a 'quick'
+ * format; the disk is not zeroed out unless erase_policy asks for it. */
 static int provision_partition(const char *name, Volume *source_volume)
 {
 	struct part_info *ptn;
@@ -857,6 +857,13 @@ int check_battery(void)
 #define LCD_DIM_TIMEOUT_VALUE "30" // timeout from on to dim
 #define LCD_OFF_TIMEOUT_VALUE "10" // timeout from dim to off
 #define LCD_DIM_BRIGHTNESS_VALUE "10" // percent of max brightness
+#define NATIVE_FLASH_VALUE "yes"
+#define FLASH_BUFFERS_VALUE "4"
+#define FLASH_BUFFER_SIZE_VALUE "4096" // KB
+#define FLASH_DISCARD_VALUE "no"
+#define FLASH_DIRECT_VALUE "yes"
+#define FLASH_DIRECT_DEPTH_VALUE "4"
+#define ERASE_POLICY_VALUE "discard"
 
 #define array_size(a) (sizeof(a) / sizeof(a[0]))
 
@@ -872,6 +879,13 @@ static char *tc_keys[] = {
 	LCD_DIM_TIMEOUT_KEY,
 	LCD_OFF_TIMEOUT_KEY,
 	LCD_DIM_BRIGHTNESS_KEY,
+	NATIVE_FLASH_KEY,
+	FLASH_BUFFERS_KEY,
+	FLASH_BUFFER_SIZE_KEY,
+	FLASH_DISCARD_KEY,
+	FLASH_DIRECT_KEY,
+	FLASH_DIRECT_DEPTH_KEY,
+	ERASE_POLICY_KEY,
 	NULL,
 };
 
@@ -887,6 +901,13 @@ static char *tc_values[] = {
 	LCD_DIM_TIMEOUT_VALUE,
 	LCD_OFF_TIMEOUT_VALUE,
 	LCD_DIM_BRIGHTNESS_VALUE,
+	NATIVE_FLASH_VALUE,
+	FLASH_BUFFERS_VALUE,
+	FLASH_BUFFER_SIZE_VALUE,
+	FLASH_DISCARD_VALUE,
+	FLASH_DIRECT_VALUE,
+	FLASH_DIRECT_DEPTH_VALUE,
+	ERASE_POLICY_VALUE,
 	NULL,
 };
 
@@ -1035,6 +1056,34 @@ static int load_config(const char *config)
 	if (value)
 		tboot_config_set(LCD_DIM_BRIGHTNESS_KEY, value);
 
+	value = config_parser_get(cp, NATIVE_FLASH_KEY);
+	if (value)
+		tboot_config_set(NATIVE_FLASH_KEY, value);
+
+	value = config_parser_get(cp, FLASH_BUFFERS_KEY);
+	if (value)
+		tboot_config_set(FLASH_BUFFERS_KEY, value);
+
+	value = config_parser_get(cp, FLASH_BUFFER_SIZE_KEY);
+	if (value)
+		tboot_config_set(FLASH_BUFFER_SIZE_KEY, value);
+
+	value = config_parser_get(cp, FLASH_DISCARD_KEY);
+	if (value)
+		tboot_config_set(FLASH_DISCARD_KEY, value);
+
+	value = config_parser_get(cp, FLASH_DIRECT_KEY);
+	if (value)
+		tboot_config_set(FLASH_DIRECT_KEY, value);
+
+	value = config_parser_get(cp, FLASH_DIRECT_DEPTH_KEY);
+	if (value)
+		tboot_config_set(FLASH_DIRECT_DEPTH_KEY, value);
+
+	value = config_parser_get(cp, ERASE_POLICY_KEY);
+	if (value)
+		tboot_config_set(ERASE_POLICY_KEY, value);
+
 	config_parser_free(cp);
 	tboot_config_dump();
 	return 0;
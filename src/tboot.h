@@ -67,6 +67,21 @@ extern char preos_version[PREOS_VERSION_LEN];
  *		files pushed by 'oem push'.
  * battery_threshold, decimal integer number, specifies the smallest
  *		battery capacity to enable fastboot operations.
+ * native_flash, [yes|no], decompress and write images in tboot instead
+ *		of piping them through gzip and dd.
+ * flash_buffers, decimal integer number, specifies the number of buffers
+ *		between usb and the device writer when flashing.
+ * flash_buffer_size, decimal integer number, specifies the size of each
+ *		flash buffer in KB.
+ * flash_discard, [yes|no], discard the don't care ranges of sparse
+ *		images and the free blocks of ext4 images instead of
+ *		leaving stale data in them.
+ * flash_direct, [yes|no], write partitions with O_DIRECT from a pool
+ *		of writer threads instead of through the page cache.
+ * flash_direct_depth, decimal integer number, specifies how many
+ *		O_DIRECT writes of flash_buffer_size may be in flight.
+ * erase_policy, [discard|secure|zero], how 'erase' clears a partition:
+ *		discard it, secure discard it, or discard and zero it.
  */
 
 /* tboot config keys */
@@ -81,6 +96,13 @@ extern char preos_version[PREOS_VERSION_LEN];
 #define LCD_DIM_TIMEOUT_KEY "lcd_dim_timeout"
 #define LCD_OFF_TIMEOUT_KEY "lcd_off_timeout"
 #define LCD_DIM_BRIGHTNESS_KEY "lcd_dim_brightness"
+#define NATIVE_FLASH_KEY "native_flash"
+#define FLASH_BUFFERS_KEY "flash_buffers"
+#define FLASH_BUFFER_SIZE_KEY "flash_buffer_size"
+#define FLASH_DISCARD_KEY "flash_discard"
+#define FLASH_DIRECT_KEY "flash_direct"
+#define FLASH_DIRECT_DEPTH_KEY "flash_direct_depth"
+#define ERASE_POLICY_KEY "erase_policy"
 
 char *tboot_config_get(char *key);
 char *tboot_config_set(char *key, char *value);
@@ -17,17 +17,39 @@
 #ifndef TBOOT_PLUGIN_H
 #define TBOOT_PLUGIN_H
 
+#include <stddef.h>
+
 /* plugins.h will be generated by ./configure */
 #include "plugins.h"
 
 typedef int (*flash_func)(void *data, unsigned sz);
 
+/*
+ * streaming flash callbacks, the image is handed over in chunks while it
+ * is still being downloaded, so it never has to fit in RAM.
+ *
+ * begin() is called before any data is accepted, size is the image size
+ * and *priv may be set for the other callbacks; a non-zero return refuses
+ * the image. chunk() gets the data in order from the flash reader thread.
+ * end() is called once all size bytes were passed and returns the result
+ * of the flash, abort() instead when the transfer or a callback failed.
+ */
+struct flash_stream_ops {
+	int (*begin)(const char *name, unsigned long long size, void **priv);
+	int (*chunk)(void *priv, const void *data, size_t len);
+	int (*end)(void *priv);
+	void (*abort)(void *priv);
+};
+
 #define MAX_OEM_ARGS 64
 
 typedef int (*oem_func)(int argc, char **argv);
 
 int aboot_register_flash_cmd(char *key, flash_func callback);
 
+int aboot_register_flash_stream_cmd(char *key,
+		const struct flash_stream_ops *ops);
+
 int aboot_register_oem_cmd(char *key, oem_func callback);
 
 /* publish a variable readable by the built-in getvar command */
@@ -33,13 +33,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <linux/fs.h>
 #include <linux/limits.h>
 
 #include "linux/ext3_fs.h"
@@ -50,6 +53,9 @@
 #include "debug.h"
 #include "tboot_util.h"
 #include "fstab.h"
+#include "tboot_ui.h"
+#include "erase.h"
+#include "ext4_finalize.h"
 
 #define EXT_SUPERBLOCK_OFFSET	1024
 
@@ -318,6 +324,16 @@ int ext4_filesystem_checks(const char *device)
 {
 	int ret;
 
+	/*
+	 * check, resize and set the mount count in-process. If the quick
+	 * check failed, or couldn't be done at all, the e2fsprogs tools do
+	 * it all, starting with a full fsck.
+	 */
+	ret = ext4_finalize(device);
+	if (!ret)
+		return 0;
+	pr_verbose("%s needs e2fsck\n", device);
+
 	/* run fdisk to make sure the partition is OK */
 	ret = execute_command("/bin/e2fsck -C 0 -fn %s",
 				device);
@@ -395,11 +411,29 @@ int unmount_partition(struct part_info *ptn)
 	return ret;
 }
 
+static void erase_progress(unsigned long long done, unsigned long long total,
+		void *priv)
+{
+	int percent = total ? done * 100 / total : 100;
+
+	tboot_ui_textbar(percent < 100 ? percent : 99, "Erasing %s...%d%%",
+			(const char *)priv, percent);
+}
+
+/*
+ * discard the partition according to the erase_policy config, then give
+ * ext4 volumes of the fstab a fresh file system. A device that can't
+ * discard is overwritten with zeroes, except for ext4 volumes under the
+ * discard policy: the quick format is all they need then.
+ */
 int erase_partition(struct part_info *ptn)
 {
 	int ret = -1;
 	char *pdevice = NULL;
 	Volume *vol;
+	enum erase_policy policy;
+	unsigned int flags = ERASE_WRITE_FALLBACK;
+	int ext4;
 
 	pdevice = find_part_device(disk_info, ptn->name);
 	if (!pdevice) {
@@ -413,20 +447,24 @@ int erase_partition(struct part_info *ptn)
 	}
 
 	vol = volume_for_device(pdevice);
-	if (!vol) {
-		pr_error("%s not in preos.fstab!\n", pdevice);
+	ext4 = vol && !strcmp(vol->fs_type, "ext4");
+	policy = erase_policy_get();
+	if (ext4 && policy == ERASE_DISCARD)
+		flags = 0;
+
+	if (erase_device(pdevice, policy, flags, erase_progress, ptn->name)) {
+		pr_error("erasing %s failed\n", pdevice);
 		goto out;
 	}
 
-	if (!strcmp(vol->fs_type, "ext4")) {
+	if (ext4) {
+		flush_track(vol->device);
 		if (make_ext4fs_quick(vol->device, vol->length)) {
 		        pr_error("make_ext4fs failed\n");
 			goto out;
 		}
-	} else {
-		pr_error("erase_partition: I can't handle fs_type %s\n",
-				vol->fs_type);
-		goto out;
+		if (flush_tracked())
+			goto out;
 	}
 	ret = 0;
 out:
@@ -547,6 +585,103 @@ int is_valid_blkdev(const char *node)
 	return 1;
 }
 
+/*
+ * Devices written by the current operation.  Flushing only these avoids
+ * sync(), which also writes back every mounted filesystem; that is slow
+ * when /cache or an SD card is mounted with lots of dirty data.
+ */
+#define FLUSH_MAX_DEVICES	8
+
+static char *flush_devices[FLUSH_MAX_DEVICES];
+static int flush_nr_devices;
+/* flash streams of a bundle are closed on their own threads */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* write back the data written through fd and drop its buffer cache */
+int flush_fd(int fd)
+{
+	struct stat statbuf;
+	int ret = 0;
+
+	if (fdatasync(fd)) {
+		pr_perror("fdatasync");
+		ret = -1;
+	}
+	if (!fstat(fd, &statbuf) && S_ISBLK(statbuf.st_mode) &&
+			ioctl(fd, BLKFLSBUF, 0)) {
+		pr_perror("BLKFLSBUF");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static int flush_tracked_locked(void)
+{
+	int ret = 0;
+	int fd;
+	int i;
+
+	for (i = 0; i < flush_nr_devices; i++) {
+		pr_verbose("flushing %s\n", flush_devices[i]);
+		fd = open(flush_devices[i], O_RDONLY);
+		if (fd < 0) {
+			pr_perror("open");
+			ret = -1;
+		} else {
+			if (flush_fd(fd))
+				ret = -1;
+			close(fd);
+		}
+		free(flush_devices[i]);
+	}
+	flush_nr_devices = 0;
+
+	return ret;
+}
+
+void flush_track(const char *device)
+{
+	int i;
+
+	pthread_mutex_lock(&flush_lock);
+	for (i = 0; i < flush_nr_devices; i++)
+		if (!strcmp(flush_devices[i], device))
+			goto out;
+
+	if (flush_nr_devices == FLUSH_MAX_DEVICES) {
+		/* too many to remember, flush the oldest now */
+		flush_tracked_locked();
+	}
+
+	flush_devices[flush_nr_devices] = strdup(device);
+	if (flush_devices[flush_nr_devices])
+		flush_nr_devices++;
+	else
+		sync();
+out:
+	pthread_mutex_unlock(&flush_lock);
+}
+
+/* flush the tracked devices and forget them */
+int flush_tracked(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&flush_lock);
+	ret = flush_tracked_locked();
+	pthread_mutex_unlock(&flush_lock);
+
+	return ret;
+}
+
+/* everything must be on disk before a reboot or kexec */
+void flush_all(void)
+{
+	flush_tracked();
+	sync();
+}
+
 int kexec_linux(char *basepath, const char *kernel)
 {
 	char cmdline_buf[2048];
@@ -597,7 +732,7 @@ int kexec_linux(char *basepath, const char *kernel)
 	pr_info("kexec load successful, pull the trigger now...\n");
 
 	/* Pull the trigger */
-	sync();
+	flush_all();
 	execute_command("kexec -e");
 
 	/* Shouldn't get here! */
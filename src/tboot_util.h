@@ -8,6 +8,10 @@ int named_file_write(const char *filename, const unsigned char *what,
 		size_t sz);
 int kexec_linux(char *basepath, const char *kernel);
 int is_valid_blkdev(const char *node);
+int flush_fd(int fd);
+void flush_track(const char *device);
+int flush_tracked(void);
+void flush_all(void);
 /* Attribute specification and -Werror prevents most security shenanigans with
  * this function */
 int execute_command(const char *fmt, ...) __attribute__((format(printf,1,2)));